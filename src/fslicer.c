@@ -1,72 +1,263 @@
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include "vfileio.h"
+#include "vpartition.h"
+#include "vslice.h"
+#include "vstrutils.h"
+#include "vzio.h"
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <glob.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
 
 #define STRLEN (131072)
 
+#define DEFAULT_BALANCE_SAMPLES (4096)
+
+#define MODE_DUMP        (0)   // write one slice to stdout
+#define MODE_EXEC        (1)   // feed every slice to its own worker command
+#define MODE_EMIT_INDEX  (2)   // write every slice boundary to stdout
+#define MODE_PARTITION   (3)   // route every line to an output file by key hash
+#define MODE_RANGE       (4)   // write the lines of a sorted file whose key falls in a range
+#define MODE_SPLIT       (5)   // write every slice to its own file
+
+#define PARTITION_MIN_RANGE (16 * 1024 * 1024)   // don't start a partition thread for less input than this
+
+#define INDEX_MAGIC   "fslicer-index"
+#define INDEX_VERSION (1)
+
 struct ProgramArgs {
+  int Mode;
   int NumSlices;
   int SliceToDump;
+  int MaxJobs;
   int DupeHeader;
   int HeaderFile;
+  int CsvBoundaries;
+  int BalanceLines;
+  int NumSamples;
+  int NoCache;
+  int Direct;
   char Header[STRLEN];
   char HeaderFileContents[STRLEN];
   char *InfileName;
+  char *ExecCmd;
+  char *OutputTemplate;
+  char *IndexName;
+  char *MemberIndexName;
+  char *FileListName;
+  char *GlobPattern;
+  char *DelimChrs;
+  int *PartitionFields;
+  int NumPartitionFields;
+  char *RangeLo;
+  char *RangeHi;
+  int KeyField;
+  // filled in by main once the input is open
+  int Compression;
+  off_t InfileSize;
+  off_t *Members;
+  int NumMembers;
+  int DirectFd;           // the infile opened O_DIRECT for --direct, -1 otherwise
+  struct FileSet Parts;   // with --filelist or --glob, the files making up the input
+};
+
+/*
+   Everything --emit-index writes and --index reads back: the boundaries
+   plus enough about the input to notice when it changed underneath them.
+*/
+struct SliceIndex {
+  char InfileName[PATH_MAX];
+  off_t FileSize;
+  time_t MTime;
+  int NumSlices;
+  off_t *Offsets;
+};
+
+/*
+   One --split-all writer thread. The threads share the slice counter and
+   take the next unwritten slice until there are none left.
+*/
+struct SplitJob {
+  int InFd;
+  struct ProgramArgs *Args;
+  char *Header;
+  off_t *Offsets;
+  char *Template;
+  int *Next;
+  pthread_mutex_t *Lock;
+  int Started;
+  int Status;
 };
 
 int ParseArgs (struct ProgramArgs *Args, int argc, char **argv);
-void GetSliceOffsets (FILE *fp, off_t SliceSize, int NumSlices, int SliceToDump, off_t *Head, off_t *Tail);
 void GetSliceOffset (FILE *fp, off_t SliceSize, int NumSlices, int SliceToDump, off_t *Boundary);
+int GetSliceBounds (FILE *fp, struct ProgramArgs *Args, int FirstSlice, int Count, off_t *Offsets);
+int OpenCompressedInput (int Fd, struct ProgramArgs *Args, char *Header);
+int WriteSlice (int InFd, struct ProgramArgs *Args, char *Header, int Slice, off_t Head, off_t Tail, int OutFd);
+int ExecSlices (int InFd, struct ProgramArgs *Args, char *Header, off_t *Offsets);
+int RunSliceWorker (int InFd, struct ProgramArgs *Args, char *Header, int Slice, off_t Head, off_t Tail);
+void ExpandTemplate (char *d, int maxlen, char *Template, int Slice, int NumSlices);
+void WriteSliceIndex (FILE *out, struct SliceIndex *Index);
+int ReadSliceIndex (char *IndexName, struct SliceIndex *Index);
+int LoadPartNames (struct ProgramArgs *Args, char ***Names, int *NumNames);
+int OpenParts (struct ProgramArgs *Args, char *Header);
+void CloseParts (struct ProgramArgs *Args);
+int SliceParts (struct ProgramArgs *Args);
+int PartitionInput (struct ProgramArgs *Args);
+int ExtractKeyRange (struct ProgramArgs *Args);
+void OpenDirectInput (struct ProgramArgs *Args);
+void OutputPrefixTemplate (char *Template, char *Prefix);
+int SplitSlices (int InFd, struct ProgramArgs *Args, char *Header, off_t *Offsets);
+void *SplitThread (void *arg);
+off_t FindKeyBound (FILE *fp, struct ProgramArgs *Args, off_t Start, off_t End, char *Key, int PastKey);
+int CompareLineKey (char *Line, struct ProgramArgs *Args, char *Key);
+void GetPartsLineBoundary (struct FileSet *Parts, off_t SliceBlockStart, off_t *Boundary);
 
 
 
 int main (int argc, char **argv)
 {
   FILE *fp;
-  off_t SliceSize;
   off_t Head;
   off_t Tail;
-  off_t ReadLen;
-  off_t i;
-  int c;
+  off_t *Offsets = NULL;
+  int FirstSlice = 0;
+  int NumOffsets;
   int ParseStatus;
-  char *p;
+  int Status;
   char Header[STRLEN];
   struct ProgramArgs Args;
+  struct SliceIndex Index;
   struct stat statbuf;
   
   ParseStatus = ParseArgs (&Args, argc, argv);
   if (ParseStatus < 1)
     return (ParseStatus);
 
-  stat(Args.InfileName, &statbuf);
+  if (Args.Mode == MODE_PARTITION)
+    return (PartitionInput (&Args));
+
+  if (Args.Mode == MODE_RANGE)
+    return (ExtractKeyRange (&Args));
+
+  if ((Args.FileListName != NULL) || (Args.GlobPattern != NULL))
+    return (SliceParts (&Args));
+
+  if (Args.IndexName != NULL) {
+    if (ReadSliceIndex (Args.IndexName, &Index) != 0) return (-1);
+    Args.InfileName = Index.InfileName;
+    Args.NumSlices = Index.NumSlices;
+    Offsets = Index.Offsets;
+    if ((Args.Mode == MODE_DUMP) && (Args.SliceToDump >= Args.NumSlices)) {
+      fprintf (stderr, "slice-to-dump must be smaller than num-slices (%d in [%s]).\n", Args.NumSlices, Args.IndexName);
+      return (0);
+    }
+  }
 
   fp = fopen (Args.InfileName, "r");
   if (!fp) {
     fprintf (stderr, "Can't open [%s]\n", Args.InfileName);
 	 return (0);
   }
+  fstat (fileno (fp), &statbuf);
+  Args.InfileSize = statbuf.st_size;
 
-  fgets (Header, STRLEN, fp);
-  fseeko (fp, 0, SEEK_SET);
+  if ((Args.IndexName != NULL) && ((statbuf.st_size != Index.FileSize) || (statbuf.st_mtime != Index.MTime))) {
+    fprintf (stderr, "Index [%s] is stale, [%s] changed since it was written.\n", Args.IndexName, Args.InfileName);
+    fclose (fp);
+    return (-1);
+  }
 
-  SliceSize = statbuf.st_size / Args.NumSlices;
+  Header[0] = '\0';
+  Args.Compression = DetectCompression (fileno (fp));
+  if (Args.Compression != VZ_PLAIN) {
+    if (OpenCompressedInput (fileno (fp), &Args, Header) != 0) {
+      fclose (fp);
+      return (-1);
+    }
+  } else {
+    if (Args.MemberIndexName != NULL) {
+      fprintf (stderr, "--member-index only applies to gzip or zstd input.\n");
+      fclose (fp);
+      return (-1);
+    }
+    fgets (Header, STRLEN, fp);
+    fseeko (fp, 0, SEEK_SET);
+    if (Args.Direct)
+      OpenDirectInput (&Args);
+  }
 
-  GetSliceOffsets (fp, SliceSize, Args.NumSlices, Args.SliceToDump, &Head, &Tail);
+  if (Offsets == NULL) {
+    // a dump needs just its own two boundaries, everything else needs them all, found once here
+    if (Args.Mode == MODE_DUMP) {
+      FirstSlice = Args.SliceToDump;
+      NumOffsets = 2;
+    } else
+      NumOffsets = Args.NumSlices + 1;
 
-  if (Args.SliceToDump == Args.NumSlices - 1) Tail = statbuf.st_size;
+    Offsets = (off_t *) malloc (NumOffsets * sizeof (off_t));
+    if (Offsets == NULL) {
+      fprintf (stderr, "Out of memory for %d slice offsets\n", Args.NumSlices);
+      fclose (fp);
+      return (-1);
+    }
+    if (GetSliceBounds (fp, &Args, FirstSlice, NumOffsets, Offsets) != 0) {
+      perror ("fslicer: finding slice boundaries");
+      fclose (fp);
+      return (-1);
+    }
+  }
 
-  if ((Args.SliceToDump != 0) && (Args.DupeHeader)) fputs (Header, stdout);
+  if (Args.Mode == MODE_EMIT_INDEX) {
+    if (realpath (Args.InfileName, Index.InfileName) == NULL) strncpy (Index.InfileName, Args.InfileName, PATH_MAX - 1);
+    Index.FileSize = statbuf.st_size;
+    Index.MTime = statbuf.st_mtime;
+    Index.NumSlices = Args.NumSlices;
+    Index.Offsets = Offsets;
+    WriteSliceIndex (stdout, &Index);
+    free (Offsets);
+    fclose (fp);
+    return (0);
+  }
 
-  if (Args.HeaderFile) fputs (Args.HeaderFileContents, stdout);
+  if (Args.Mode == MODE_EXEC) {
+    Status = ExecSlices (fileno (fp), &Args, Header, Offsets);
+    free (Offsets);
+    fclose (fp);
+    return (Status);
+  }
+
+  if (Args.Mode == MODE_SPLIT) {
+    Status = SplitSlices (fileno (fp), &Args, Header, Offsets);
+    free (Offsets);
+    fclose (fp);
+    return (Status);
+  }
+
+  Head = Offsets [Args.SliceToDump - FirstSlice];
+  Tail = Offsets [Args.SliceToDump - FirstSlice + 1];
+  free (Offsets);
 
-  ReadLen = Tail - Head;
-  fseeko (fp, Head, SEEK_SET);
-  for (i = 0; i < ReadLen; i++) {
-    c = fgetc (fp);
-	 fputc (c, stdout);
+  if (WriteSlice (fileno (fp), &Args, Header, Args.SliceToDump, Head, Tail, fileno (stdout)) != 0) {
+    perror ("fslicer: writing slice");
+    fclose (fp);
+    return (-1);
   }
+
+  fclose (fp);
+  return (0);
 }
 
 int ParseArgs (struct ProgramArgs *Args, int argc, char **argv)
@@ -74,10 +265,36 @@ int ParseArgs (struct ProgramArgs *Args, int argc, char **argv)
   FILE *fp;
   int j;
   int nr;
+  int NumPositional;
+  int KeyGiven = 0;
+  int DelimGiven = 0;
   char *p;
 
+  Args -> Mode = MODE_DUMP;
+  Args -> MaxJobs = 0;
   Args -> DupeHeader = 0;
   Args -> HeaderFile = 0;
+  Args -> CsvBoundaries = 0;
+  Args -> BalanceLines = 0;
+  Args -> NumSamples = DEFAULT_BALANCE_SAMPLES;
+  Args -> NoCache = 0;
+  Args -> Direct = 0;
+  Args -> DirectFd = -1;
+  Args -> ExecCmd = NULL;
+  Args -> OutputTemplate = NULL;
+  Args -> IndexName = NULL;
+  Args -> MemberIndexName = NULL;
+  Args -> FileListName = NULL;
+  Args -> GlobPattern = NULL;
+  Args -> DelimChrs = "\t";
+  Args -> PartitionFields = NULL;
+  Args -> NumPartitionFields = 0;
+  Args -> RangeLo = NULL;
+  Args -> RangeHi = NULL;
+  Args -> KeyField = 0;
+  Args -> Members = NULL;
+  Args -> NumMembers = 0;
+  Args -> Parts.NumFiles = 0;
 
   for (j = 1; j < argc; j++)
   {
@@ -102,43 +319,275 @@ int ParseArgs (struct ProgramArgs *Args, int argc, char **argv)
           return (-2);
         }
       }
+      else if (strcasecmp(argv[j], "--exec") == 0)
+      {
+        if (j + 1 >= argc)
+        {
+          fprintf(stderr, "--exec needs a command.\n");
+          return (-1);
+        }
+        Args -> Mode = MODE_EXEC;
+        Args -> ExecCmd = argv[++j];
+      }
+      else if (strcasecmp(argv[j], "--split-all") == 0)
+        Args -> Mode = MODE_SPLIT;
+      else if (strcasecmp(argv[j], "--nocache") == 0)
+        Args -> NoCache = 1;
+      else if (strcasecmp(argv[j], "--direct") == 0)
+      {
+        Args -> NoCache = 1;
+        Args -> Direct = 1;
+      }
+      else if (strcasecmp(argv[j], "--csv") == 0)
+        Args -> CsvBoundaries = 1;
+      else if (strcasecmp(argv[j], "--balance=lines") == 0)
+        Args -> BalanceLines = 1;
+      else if (strcasecmp(argv[j], "--balance=bytes") == 0)
+        Args -> BalanceLines = 0;
+      else if (strncasecmp(argv[j], "--samples=", 10) == 0)
+      {
+        Args -> NumSamples = atoi(argv[j] + 10);
+        if (Args -> NumSamples <= 0)
+        {
+          fprintf(stderr, "--samples must be larger than 0.\n");
+          return (-1);
+        }
+      }
+      else if (strncasecmp(argv[j], "--member-index=", 15) == 0)
+        Args -> MemberIndexName = argv[j] + 15;
+      else if (strcasecmp(argv[j], "--emit-index") == 0)
+        Args -> Mode = MODE_EMIT_INDEX;
+      else if (strncasecmp(argv[j], "--filelist=", 11) == 0)
+        Args -> FileListName = argv[j] + 11;
+      else if (strncasecmp(argv[j], "--glob=", 7) == 0)
+        Args -> GlobPattern = argv[j] + 7;
+      else if (strncasecmp(argv[j], "--partition-by=", 15) == 0)
+      {
+        if (ParseFieldList(argv[j] + 15, &Args -> PartitionFields, &Args -> NumPartitionFields) != 0)
+        {
+          fprintf(stderr, "--partition-by needs a list of field numbers (from 0), e.g. --partition-by=0,3\n");
+          return (-1);
+        }
+        Args -> Mode = MODE_PARTITION;
+      }
+      else if (strcasecmp(argv[j], "--range") == 0)
+      {
+        if (j + 2 >= argc)
+        {
+          fprintf(stderr, "--range needs a low and a high key.\n");
+          return (-1);
+        }
+        Args -> Mode = MODE_RANGE;
+        Args -> RangeLo = argv[++j];
+        Args -> RangeHi = argv[++j];
+      }
+      else if (strcasecmp(argv[j], "--index") == 0)
+      {
+        if (j + 1 >= argc)
+        {
+          fprintf(stderr, "--index needs an index file.\n");
+          return (-1);
+        }
+        Args -> IndexName = argv[++j];
+      }
+      else if (strncasecmp(argv[j], "--jobs=", 7) == 0)
+        Args -> MaxJobs = atoi(argv[j] + 7);
+      else if (strncasecmp(argv[j], "--output=", 9) == 0)
+        Args -> OutputTemplate = argv[j] + 9;
       else
       {
         printf("Unknown option: [%s]\n", argv[j]);
         return (-1);
       }
     }
+    else if ((strcmp(argv[j], "-d") == 0) && (j + 1 < argc))
+    {
+      Args -> DelimChrs = argv[++j];
+      DelimGiven = 1;
+    }
+    else if ((strcmp(argv[j], "-k") == 0) && (j + 1 < argc))
+    {
+      Args -> KeyField = atoi(argv[++j]);
+      KeyGiven = 1;
+      if (Args -> KeyField < 0)
+      {
+        fprintf(stderr, "-k takes a field number from 0.\n");
+        return (-1);
+      }
+    }
     else
       break;
   }
 
-  if (j + 3 != argc)
+  if ((Args -> IndexName != NULL) && (Args -> Mode == MODE_EMIT_INDEX))
+  {
+    fprintf(stderr, "--index and --emit-index don't mix.\n");
+    return (-1);
+  }
+
+  if (Args -> PartitionFields != NULL)
+  {
+    if ((Args -> Mode != MODE_PARTITION) || (Args -> IndexName != NULL) || (Args -> ExecCmd != NULL) || (Args -> CsvBoundaries) || (Args -> BalanceLines) ||
+        (Args -> MemberIndexName != NULL) || (Args -> OutputTemplate != NULL))
+    {
+      fprintf(stderr, "--partition-by doesn't mix with --exec, --emit-index, --index, --csv, --balance=lines, --member-index or --output.\n");
+      return (-1);
+    }
+  }
+
+  if (Args -> RangeLo != NULL)
+  {
+    if ((Args -> Mode != MODE_RANGE) || (Args -> IndexName != NULL) || (Args -> ExecCmd != NULL) || (Args -> CsvBoundaries) ||
+        (Args -> BalanceLines) || (Args -> MemberIndexName != NULL) || (Args -> OutputTemplate != NULL) ||
+        (Args -> PartitionFields != NULL) || (Args -> FileListName != NULL) || (Args -> GlobPattern != NULL))
+    {
+      fprintf(stderr, "--range only takes --header, --headerfile, -k and -d.\n");
+      return (-1);
+    }
+  }
+
+  // a plain slice never looks at fields, so a stray -k or -d is a mistake, not a no-op
+  if (KeyGiven && (Args -> Mode != MODE_RANGE))
+  {
+    fprintf(stderr, "-k only works with --range.\n");
+    return (-1);
+  }
+  if (DelimGiven && (Args -> Mode != MODE_PARTITION) && (Args -> Mode != MODE_RANGE))
+  {
+    fprintf(stderr, "-d only works with --partition-by or --range.\n");
+    return (-1);
+  }
+
+  if ((Args -> FileListName != NULL) || (Args -> GlobPattern != NULL))
+  {
+    if ((Args -> FileListName != NULL) && (Args -> GlobPattern != NULL))
+    {
+      fprintf(stderr, "--filelist and --glob don't mix.\n");
+      return (-1);
+    }
+    if ((Args -> IndexName != NULL) || (Args -> Mode == MODE_EMIT_INDEX) || (Args -> CsvBoundaries) ||
+        (Args -> BalanceLines) || (Args -> MemberIndexName != NULL))
+    {
+      fprintf(stderr, "--filelist and --glob only cut at plain line ends, without --index, --emit-index, --csv, --balance=lines or --member-index.\n");
+      return (-1);
+    }
+  }
+
+  // with --index the infile and num-slices come out of the index, with --filelist or --glob there is no infile.
+  // the last positional is slice-to-dump, or outprefix for --partition-by and --split-all
+  NumPositional = ((Args -> Mode == MODE_DUMP) || (Args -> Mode == MODE_PARTITION) || (Args -> Mode == MODE_SPLIT)) ? 3 : 2;
+  if (Args -> Mode == MODE_RANGE)
+    NumPositional = 1;
+  else if (Args -> IndexName != NULL)
+    NumPositional -= 2;
+  else if ((Args -> FileListName != NULL) || (Args -> GlobPattern != NULL))
+    NumPositional -= 1;
+
+  if (j + NumPositional != argc)
   {
     fprintf(stderr, "Usage: %s {opts} [infile] [num-slices] [slice-to-dump]\n", argv[0]);
+    fprintf(stderr, "       %s {opts} --exec 'cmd' [infile] [num-slices]\n", argv[0]);
+    fprintf(stderr, "       %s {opts} --split-all [infile] [num-slices] [outprefix]\n", argv[0]);
+    fprintf(stderr, "       %s --emit-index [infile] [num-slices] > slices.idx\n", argv[0]);
+    fprintf(stderr, "       %s {opts} --index slices.idx [slice-to-dump]\n", argv[0]);
+    fprintf(stderr, "       %s {opts} --index slices.idx --exec 'cmd'\n", argv[0]);
+    fprintf(stderr, "       %s {opts} --glob='part-*' [num-slices] [slice-to-dump]\n", argv[0]);
+    fprintf(stderr, "       %s {opts} --filelist=xxxx --exec 'cmd' [num-slices]\n", argv[0]);
+    fprintf(stderr, "       %s {opts} --partition-by=x,y [-d xyz] [infile] [num-slices] [outprefix]\n", argv[0]);
+    fprintf(stderr, "       %s {opts} --range lo hi [-k x] [-d xyz] [infile]\n", argv[0]);
     fprintf(stderr, "  {opts} :: --header - show header each slice.\n");
-    fprintf(stderr, "            --headerfile=xxxx - replicate the contents of headerfile on top of each slice. max 128k\n\n");
+    fprintf(stderr, "            --headerfile=xxxx - replicate the contents of headerfile on top of each slice. max 128k\n");
+    fprintf(stderr, "            --csv - cut at csv record ends, never inside a quoted field.\n");
+    fprintf(stderr, "            --balance=lines - put about the same number of lines, not bytes, in each slice.\n");
+    fprintf(stderr, "            --samples=x - with --balance=lines, sample x line lengths to estimate them. default %d\n", DEFAULT_BALANCE_SAMPLES);
+    fprintf(stderr, "            --member-index=xxxx - bgzip .gzi index of a gzip input's member offsets.\n");
+    fprintf(stderr, "            --exec 'cmd' - run cmd (via /bin/sh) once per slice with the slice on its stdin.\n");
+    fprintf(stderr, "            --jobs=x - with --exec, --split-all or --partition-by, run at most x workers at a time. default is one per cpu\n");
+    fprintf(stderr, "            --output=xxxx - with --exec, send each worker's stdout to xxxx, {} becomes the slice number\n");
+    fprintf(stderr, "            --split-all - write every slice to its own file, outprefix{}, in one run.\n");
+    fprintf(stderr, "            --nocache - stream the slices without filling the page cache (drop pages behind the read).\n");
+    fprintf(stderr, "            --direct - like --nocache, but read the infile with O_DIRECT where the filesystem allows.\n");
+    fprintf(stderr, "            --emit-index - write every slice boundary to stdout instead of a slice.\n");
+    fprintf(stderr, "            --index xxxx - take infile, num-slices and the boundaries from an --emit-index file.\n");
+    fprintf(stderr, "            --filelist=xxxx - slice the files named in xxxx, one per line, as if they were cat'ed together.\n");
+    fprintf(stderr, "            --glob='xxxx' - slice the files matching xxxx, in sorted order, as if they were cat'ed together.\n");
+    fprintf(stderr, "            --partition-by=x,y - send each line to outprefix{} by a hash of fields x,y (from 0), in one pass.\n");
+    fprintf(stderr, "            --range lo hi - write the lines with lo <= key <= hi from a file sorted on that key (LC_ALL=C order).\n");
+    fprintf(stderr, "            -k x - with --range, the key is field x (from 0). default 0\n");
+    fprintf(stderr, "            -d xyz - with --partition-by or --range, fields are delimited by any of xyz. default tab\n\n");
     fprintf(stderr, "  num-slices      how many slices to make of the file\n");
     fprintf(stderr, "  slice-to-dump   which slice number to dump (0 .. num-slices - 1)\n");
     return (0);
   }
 
-  Args -> InfileName = argv[j];
-  Args -> NumSlices = atoi(argv[j + 1]);
-  Args -> SliceToDump = atoi(argv[j + 2]);
+  if (Args -> Mode == MODE_RANGE)
+  {
+    Args -> InfileName = argv[j];
+    return (1);
+  }
+
+  if ((Args -> FileListName != NULL) || (Args -> GlobPattern != NULL))
+  {
+    Args -> InfileName = (Args -> FileListName != NULL) ? Args -> FileListName : Args -> GlobPattern;
+    Args -> NumSlices = atoi(argv[j++]);
 
-  if (Args -> NumSlices <= 0)
+    if (Args -> NumSlices <= 0)
+    {
+      fprintf(stderr, "num-slices must be larger than 0.\n");
+      return (0);
+    }
+  }
+  else if (Args -> IndexName == NULL)
   {
-    fprintf(stderr, "num-slices must be larger than 0.\n");
+    Args -> InfileName = argv[j++];
+    Args -> NumSlices = atoi(argv[j++]);
+
+    if (Args -> NumSlices <= 0)
+    {
+      fprintf(stderr, "num-slices must be larger than 0.\n");
+      return (0);
+    }
+  }
+
+  if (Args -> Mode == MODE_EMIT_INDEX)
+    return (1);
+
+  if ((Args -> Mode == MODE_EXEC) || (Args -> Mode == MODE_PARTITION) || (Args -> Mode == MODE_SPLIT))
+  {
+    if (Args -> MaxJobs <= 0)
+      Args -> MaxJobs = (int) sysconf(_SC_NPROCESSORS_ONLN);
+    if (Args -> MaxJobs <= 0)
+      Args -> MaxJobs = 1;
+    if (Args -> Mode == MODE_SPLIT)
+    {
+      if (Args -> OutputTemplate != NULL)
+      {
+        fprintf(stderr, "--output only applies to --exec, --split-all takes outprefix.\n");
+        return (0);
+      }
+      Args -> OutputTemplate = argv[j];
+    }
+    if (Args -> Mode == MODE_PARTITION)
+      Args -> OutputTemplate = argv[j];
+    return (1);
+  }
+
+  if (Args -> OutputTemplate != NULL)
+  {
+    fprintf(stderr, "--output only applies to --exec.\n");
     return (0);
   }
 
+  Args -> SliceToDump = atoi(argv[j]);
+
   if (Args -> SliceToDump < 0)
   {
     fprintf(stderr, "slice-to-dump must be larger than 0.\n");
     return (0);
   }
 
-  if (Args -> SliceToDump >= Args -> NumSlices)
+  // with --index main checks this once the index is read
+  if ((Args -> IndexName == NULL) && (Args -> SliceToDump >= Args -> NumSlices))
   {
     fprintf(stderr, "slice-to-dump must be smaller than num-slices.\n");
     return (0);
@@ -147,32 +596,1017 @@ int ParseArgs (struct ProgramArgs *Args, int argc, char **argv)
   return (1);
 }
 
-void GetSliceOffsets(FILE *fp, off_t SliceSize, int NumSlices, int SliceToDump, off_t *Head, off_t *Tail)
+void GetSliceOffset(FILE *fp, off_t SliceSize, int NumSlices, int SliceToDump, off_t *Boundary)
 {
-  GetSliceOffset(fp, SliceSize, NumSlices, SliceToDump, Head);
-  GetSliceOffset(fp, SliceSize, NumSlices, SliceToDump + 1, Tail);
+  GetLineBoundary(fp, SliceSize * SliceToDump, Boundary);
 }
 
-void GetSliceOffset(FILE *fp, off_t SliceSize, int NumSlices, int SliceToDump, off_t *Boundary)
+/*
+   Fills Offsets[0 .. Count - 1] with where slices FirstSlice .. FirstSlice + Count - 1
+   begin, "slice" NumSlices being the end of the file. Depending on the input
+   a boundary is the next line, the next csv record or the next compressed
+   member after the even byte split. Returns 0 on success, -1 on a read error.
+*/
+int GetSliceBounds(FILE *fp, struct ProgramArgs *Args, int FirstSlice, int Count, off_t *Offsets)
 {
-  int c;
+  int i;
+  int Slice;
+  off_t SliceSize;
+  off_t FileSize;
+
+  FileSize = Args -> InfileSize;
+  SliceSize = FileSize / Args -> NumSlices;
+
+  if (Args -> BalanceLines)
+  {
+    // raw cuts where the estimated line count splits evenly, aligned below like byte cuts
+    if (EstimateLineCuts(fp, FileSize, Args -> NumSlices, Args -> NumSamples, FirstSlice, Count, Offsets) != 0)
+      return (-1);
+    if (!Args -> CsvBoundaries)
+    {
+      for (i = 0; i < Count; i++)
+      {
+        if (FirstSlice + i < Args -> NumSlices)
+          GetLineBoundary(fp, Offsets[i], &Offsets[i]);
+        if (Offsets[i] > FileSize)
+          Offsets[i] = FileSize;
+      }
+    }
+  }
+  else
+  {
+    for (i = 0; i < Count; i++)
+    {
+      Slice = FirstSlice + i;
+      if (Slice >= Args -> NumSlices)
+        Offsets[i] = FileSize;
+      else if ((Args -> Compression != VZ_PLAIN) || (Args -> CsvBoundaries))
+        Offsets[i] = SliceSize * Slice;
+      else
+      {
+        GetSliceOffset(fp, SliceSize, Args -> NumSlices, Slice, &Offsets[i]);
+        if (Offsets[i] > FileSize)
+          Offsets[i] = FileSize;
+      }
+    }
+  }
+
+  if (Args -> Compression != VZ_PLAIN)
+    return (ResolveMemberBoundaries(fileno(fp), Args -> Compression, FileSize, Args -> Members, Args -> NumMembers, Offsets, Count));
+  if (Args -> CsvBoundaries)
+    return (ResolveCsvBoundaries(fileno(fp), FileSize, Offsets, Count));
+  return (0);
+}
+
+/*
+   Gets a gzip or zstd input ready for slicing: checks this build can read
+   it, loads the member list from --member-index or a zstd seek table if
+   there is one, and reads the header line out of the first member.
+   Returns 0 when ready, -1 after saying what is wrong.
+*/
+int OpenCompressedInput(int Fd, struct ProgramArgs *Args, char *Header)
+{
+  int Status;
+
+  if (!CompressionSupported(Args -> Compression))
+  {
+    fprintf(stderr, "[%s] is %s compressed and this fslicer was built without %s support.\n", Args -> InfileName,
+            CompressionName(Args -> Compression), CompressionName(Args -> Compression));
+    return (-1);
+  }
+
+  if ((Args -> CsvBoundaries) || (Args -> BalanceLines))
+  {
+    fprintf(stderr, "--csv and --balance=lines only work on uncompressed input.\n");
+    return (-1);
+  }
+
+  if (Args -> MemberIndexName != NULL)
+  {
+    if (LoadMemberIndex(Args -> MemberIndexName, &Args -> Members, &Args -> NumMembers) != 0)
+      return (-1);
+  }
+  else if (Args -> Compression == VZ_ZSTD)
+  {
+    Status = LoadZstdSeekTable(Fd, Args -> InfileSize, &Args -> Members, &Args -> NumMembers);
+    if (Status < 0)
+    {
+      perror("fslicer: reading zstd seek table");
+      return (-1);
+    }
+  }
+
+  if (ReadCompressedLine(Fd, Args -> Compression, Args -> InfileSize, Header, STRLEN) != 0)
+  {
+    perror("fslicer: reading header");
+    return (-1);
+  }
+  return (0);
+}
+
+/*
+   Writes the optional header lines followed by bytes [Head, Tail) of InFd to OutFd.
+*/
+int WriteSlice(int InFd, struct ProgramArgs *Args, char *Header, int Slice, off_t Head, off_t Tail, int OutFd)
+{
+  int Status;
+
+  if ((Slice != 0) && (Args -> DupeHeader))
+  {
+    if (WriteAll(OutFd, Header, strlen(Header)) != 0)
+      return (-1);
+  }
+
+  if (Args -> HeaderFile)
+  {
+    if (WriteAll(OutFd, Args -> HeaderFileContents, strlen(Args -> HeaderFileContents)) != 0)
+      return (-1);
+  }
+
+  if (Args -> Parts.NumFiles > 0)
+    return (FileSetCopyRange(&Args -> Parts, Head, Tail - Head, OutFd));
+
+  if (Args -> Compression != VZ_PLAIN)
+  {
+    Status = WriteCompressedSlice(InFd, Args -> Compression, Args -> InfileSize, Head, Tail, Slice != 0, OutFd);
+    if (Args -> NoCache)
+      DropFileCache(InFd, Head, Tail - Head);
+    return (Status);
+  }
+
+  if (Args -> NoCache)
+    return (StreamFileRange(InFd, Args -> DirectFd, Head, Tail - Head, OutFd));
+
+  return (CopyFileRange(InFd, Head, Tail - Head, OutFd));
+}
 
-  off_t SliceOffset = 0;
-  off_t SliceBlockStart;
+/*
+   Forks one worker per slice, never more than Args -> MaxJobs at a time, and
+   waits for all of them. Returns 0 when every worker exited 0, 1 otherwise,
+   after listing the failed slices on stderr.
+*/
+int ExecSlices(int InFd, struct ProgramArgs *Args, char *Header, off_t *Offsets)
+{
+  pid_t *Pids;
+  pid_t pid;
+  int *ExitCodes;
+  int NumSlices;
+  int Running = 0;
+  int Next = 0;
+  int Failed = 0;
+  int status;
+  int k;
 
-  SliceBlockStart = SliceSize * SliceToDump;
+  NumSlices = Args -> NumSlices;
+  Pids = (pid_t *) calloc(NumSlices, sizeof(pid_t));
+  ExitCodes = (int *) calloc(NumSlices, sizeof(int));
+  if ((Pids == NULL) || (ExitCodes == NULL))
+  {
+    fprintf(stderr, "Out of memory for %d workers\n", NumSlices);
+    return (-1);
+  }
 
-  fseeko(fp, SliceBlockStart, SEEK_SET);
-  if (SliceBlockStart > 0)
+  fflush(stdout);
+  fflush(stderr);
+
+  while ((Next < NumSlices) || (Running > 0))
   {
-    while (!feof(fp))
+    while ((Running < Args -> MaxJobs) && (Next < NumSlices))
+    {
+      pid = fork();
+      if (pid < 0)
+      {
+        perror("fslicer: fork");
+        break;
+      }
+      if (pid == 0)
+        _exit(RunSliceWorker(InFd, Args, Header, Next, Offsets[Next], Offsets[Next + 1]));
+      Pids[Next++] = pid;
+      Running++;
+    }
+
+    if (Running == 0)
+    {
+      // fork keeps failing and nothing is left to reap, give up on the rest
+      for (; Next < NumSlices; Next++)
+        ExitCodes[Next] = -1;
+      break;
+    }
+
+    pid = wait(&status);
+    if (pid < 0)
     {
-      c = fgetc(fp);
-      SliceOffset++;
-      if (c == '\n')
+      if (errno == EINTR)
+        continue;
+      perror("fslicer: wait");
+      break;
+    }
+
+    for (k = 0; k < Next; k++)
+    {
+      if (Pids[k] == pid)
+      {
+        ExitCodes[k] = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+        Running--;
         break;
+      }
+    }
+  }
+
+  for (k = 0; k < NumSlices; k++)
+  {
+    if (ExitCodes[k] != 0)
+    {
+      if (ExitCodes[k] < 0)
+        fprintf(stderr, "slice %d: not started\n", k);
+      else
+        fprintf(stderr, "slice %d: exit status %d\n", k, ExitCodes[k]);
+      Failed++;
+    }
+  }
+
+  free(Pids);
+  free(ExitCodes);
+  return (Failed ? 1 : 0);
+}
+
+/*
+   Body of one forked worker: runs Args -> ExecCmd through /bin/sh with the
+   slice on a pipe as its stdin and feeds it from here. The worker also gets
+   FSLICER_SLICE and FSLICER_NUM_SLICES in its environment. Returns the
+   command's exit status (128 + signal if it was killed).
+*/
+int RunSliceWorker(int InFd, struct ProgramArgs *Args, char *Header, int Slice, off_t Head, off_t Tail)
+{
+  int Pipe[2];
+  int OutFd = -1;
+  int status;
+  pid_t pid;
+  char OutName[PATH_MAX];
+  char Env[32];
+
+  if (Args -> OutputTemplate != NULL)
+  {
+    ExpandTemplate(OutName, PATH_MAX, Args -> OutputTemplate, Slice, Args -> NumSlices);
+    OutFd = open(OutName, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (OutFd < 0)
+    {
+      fprintf(stderr, "Can't open [%s]\n", OutName);
+      return (126);
+    }
+  }
+
+  if (pipe(Pipe) != 0)
+  {
+    perror("fslicer: pipe");
+    return (126);
+  }
+
+  pid = fork();
+  if (pid < 0)
+  {
+    perror("fslicer: fork");
+    return (126);
+  }
+
+  if (pid == 0)
+  {
+    dup2(Pipe[0], 0);
+    close(Pipe[0]);
+    close(Pipe[1]);
+    if (OutFd >= 0)
+    {
+      dup2(OutFd, 1);
+      close(OutFd);
+    }
+    close(InFd);
+
+    snprintf(Env, sizeof(Env), "%d", Slice);
+    setenv("FSLICER_SLICE", Env, 1);
+    snprintf(Env, sizeof(Env), "%d", Args -> NumSlices);
+    setenv("FSLICER_NUM_SLICES", Env, 1);
+
+    execl("/bin/sh", "sh", "-c", Args -> ExecCmd, (char *) NULL);
+    _exit(127);
+  }
+
+  close(Pipe[0]);
+  if (OutFd >= 0)
+    close(OutFd);
+
+  // a worker may stop reading early (head, grep -m), that is its business, not an error
+  signal(SIGPIPE, SIG_IGN);
+  if ((WriteSlice(InFd, Args, Header, Slice, Head, Tail, Pipe[1]) != 0) && (errno != EPIPE))
+    fprintf(stderr, "slice %d: feeding worker: %s\n", Slice, strerror(errno));
+  close(Pipe[1]);
+
+  while (waitpid(pid, &status, 0) < 0)
+  {
+    if (errno != EINTR)
+      return (126);
+  }
+
+  return (WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status));
+}
+
+/*
+   Copies Template to d replacing each {} with the slice number, zero padded
+   to the width of the largest slice number (like seq -w).
+*/
+void ExpandTemplate(char *d, int maxlen, char *Template, int Slice, int NumSlices)
+{
+  int Width;
+  int n = 0;
+  char *p;
+
+  Width = snprintf(NULL, 0, "%d", NumSlices - 1);
+
+  for (p = Template; (*p) && (n < maxlen - 1); p++)
+  {
+    if ((p[0] == '{') && (p[1] == '}'))
+    {
+      n += snprintf(d + n, maxlen - n, "%0*d", Width, Slice);
+      if (n > maxlen - 1)
+        n = maxlen - 1;
+      p++;
+    }
+    else
+      d[n++] = *p;
+  }
+  d[n] = '\0';
+}
+
+/*
+   Index layout, one item per line: magic and version, then "file", "size",
+   "mtime" and "slices" tagged with a tab, then the NumSlices + 1 boundaries.
+*/
+void WriteSliceIndex(FILE *out, struct SliceIndex *Index)
+{
+  int k;
+
+  fprintf(out, "%s\t%d\n", INDEX_MAGIC, INDEX_VERSION);
+  fprintf(out, "file\t%s\n", Index -> InfileName);
+  fprintf(out, "size\t%lld\n", (long long) Index -> FileSize);
+  fprintf(out, "mtime\t%lld\n", (long long) Index -> MTime);
+  fprintf(out, "slices\t%d\n", Index -> NumSlices);
+  for (k = 0; k <= Index -> NumSlices; k++)
+    fprintf(out, "%lld\n", (long long) Index -> Offsets[k]);
+}
+
+/*
+   Loads an index written by WriteSliceIndex. Returns 0 on success, -1 after
+   saying what was wrong with it.
+*/
+int ReadSliceIndex(char *IndexName, struct SliceIndex *Index)
+{
+  FILE *fp;
+  char Line[PATH_MAX + 16];
+  char *p;
+  long long Size;
+  long long MTime;
+  long long Offset;
+  int Version;
+  int k;
+
+  fp = fopen(IndexName, "r");
+  if (!fp)
+  {
+    fprintf(stderr, "Can't open [%s]\n", IndexName);
+    return (-1);
+  }
+
+  Index -> Offsets = NULL;
+  if ((fgets(Line, sizeof(Line), fp) == NULL) || (sscanf(Line, INDEX_MAGIC "\t%d", &Version) != 1) ||
+      (Version != INDEX_VERSION))
+    goto bad_index;
+
+  if ((fgets(Line, sizeof(Line), fp) == NULL) || (strncmp(Line, "file\t", 5) != 0))
+    goto bad_index;
+  p = strpbrk(Line, "\n\r");
+  if (p != NULL)
+    *p = '\0';
+  strncpy(Index -> InfileName, Line + 5, PATH_MAX - 1);
+  Index -> InfileName[PATH_MAX - 1] = '\0';
+
+  if ((fgets(Line, sizeof(Line), fp) == NULL) || (sscanf(Line, "size\t%lld", &Size) != 1))
+    goto bad_index;
+  if ((fgets(Line, sizeof(Line), fp) == NULL) || (sscanf(Line, "mtime\t%lld", &MTime) != 1))
+    goto bad_index;
+  if ((fgets(Line, sizeof(Line), fp) == NULL) || (sscanf(Line, "slices\t%d", &Index -> NumSlices) != 1) ||
+      (Index -> NumSlices <= 0))
+    goto bad_index;
+  Index -> FileSize = Size;
+  Index -> MTime = MTime;
+
+  Index -> Offsets = (off_t *) malloc((Index -> NumSlices + 1) * sizeof(off_t));
+  if (Index -> Offsets == NULL)
+    goto bad_index;
+  for (k = 0; k <= Index -> NumSlices; k++)
+  {
+    if ((fgets(Line, sizeof(Line), fp) == NULL) || (sscanf(Line, "%lld", &Offset) != 1) ||
+        (Offset < 0) || (Offset > Size) || ((k > 0) && (Offset < Index -> Offsets[k - 1])))
+      goto bad_index;
+    Index -> Offsets[k] = Offset;
+  }
+
+  fclose(fp);
+  return (0);
+
+bad_index:
+  fprintf(stderr, "[%s] is not a valid fslicer index\n", IndexName);
+  free(Index -> Offsets);
+  Index -> Offsets = NULL;
+  fclose(fp);
+  return (-1);
+}
+
+/*
+   Collects the --filelist or --glob names into a malloc'ed array, or just
+   the infile without either. A file list has one name per line, blank lines
+   are skipped. Returns 0 on success, -1 after saying what is wrong.
+*/
+int LoadPartNames(struct ProgramArgs *Args, char ***Names, int *NumNames)
+{
+  FILE *fp;
+  glob_t Matches;
+  char Line[PATH_MAX];
+  char **List = NULL;
+  int Count = 0;
+  int Size = 0;
+  int Status;
+  size_t i;
+  size_t len;
+
+  if ((Args -> GlobPattern == NULL) && (Args -> FileListName == NULL))
+  {
+    List = (char **) malloc(sizeof(char *));
+    if (List == NULL)
+      return (-1);
+    List[0] = strdup(Args -> InfileName);
+    *Names = List;
+    *NumNames = 1;
+    return (0);
+  }
+
+  if (Args -> GlobPattern != NULL)
+  {
+    Status = glob(Args -> GlobPattern, 0, NULL, &Matches);
+    if (Status != 0)
+    {
+      fprintf(stderr, "No files match [%s]\n", Args -> GlobPattern);
+      return (-1);
+    }
+    List = (char **) malloc(Matches.gl_pathc * sizeof(char *));
+    if (List == NULL)
+    {
+      globfree(&Matches);
+      fprintf(stderr, "Out of memory for %d file names\n", (int) Matches.gl_pathc);
+      return (-1);
+    }
+    for (i = 0; i < Matches.gl_pathc; i++)
+      List[i] = strdup(Matches.gl_pathv[i]);
+    *Names = List;
+    *NumNames = (int) Matches.gl_pathc;
+    globfree(&Matches);
+    return (0);
+  }
+
+  fp = fopen(Args -> FileListName, "r");
+  if (!fp)
+  {
+    fprintf(stderr, "Can't open [%s]\n", Args -> FileListName);
+    return (-1);
+  }
+  while (fgets(Line, PATH_MAX, fp) != NULL)
+  {
+    len = strlen(Line);
+    while ((len > 0) && ((Line[len - 1] == '\n') || (Line[len - 1] == '\r')))
+      Line[--len] = '\0';
+    if (len == 0)
+      continue;
+    if (Count == Size)
+    {
+      Size = Size ? Size * 2 : 256;
+      List = (char **) realloc(List, Size * sizeof(char *));
+      if (List == NULL)
+      {
+        fprintf(stderr, "Out of memory for %d file names\n", Size);
+        fclose(fp);
+        return (-1);
+      }
+    }
+    List[Count++] = strdup(Line);
+  }
+  fclose(fp);
+
+  if (Count == 0)
+  {
+    fprintf(stderr, "[%s] names no files\n", Args -> FileListName);
+    free(List);
+    return (-1);
+  }
+  *Names = List;
+  *NumNames = Count;
+  return (0);
+}
+
+/*
+   GetLineBoundary for the concatenated parts. The newline ending the line
+   may sit in a later part than the cut, or the cut may fall right on a part
+   edge; either way the boundary is where the line ends in the whole stream.
+*/
+void GetPartsLineBoundary(struct FileSet *Parts, off_t SliceBlockStart, off_t *Boundary)
+{
+  char Buf[65536];
+  char *nl;
+  ssize_t n;
+  off_t Offset = SliceBlockStart;
+
+  if (SliceBlockStart <= 0)
+  {
+    *Boundary = 0;
+    return;
+  }
+
+  while ((n = FileSetPread(Parts, Buf, sizeof(Buf), Offset)) > 0)
+  {
+    nl = (char *) memchr(Buf, '\n', n);
+    if (nl != NULL)
+    {
+      *Boundary = Offset + (nl - Buf) + 1;
+      return;
+    }
+    Offset += n;
+  }
+  *Boundary = Parts -> Starts[Parts -> NumFiles];
+}
+
+/*
+   Opens the input as Args -> Parts and reads the header line, the first
+   line of the first part. Compressed parts are refused: the parts are
+   sliced and read as raw bytes. Returns 0 when ready, -1 after saying what
+   is wrong.
+*/
+int OpenParts(struct ProgramArgs *Args, char *Header)
+{
+  char **Names;
+  char *nl;
+  ssize_t n;
+  int NumNames;
+  int i;
+
+  if (LoadPartNames(Args, &Names, &NumNames) != 0)
+    return (-1);
+  if (FileSetOpen(&Args -> Parts, Names, NumNames) != 0)
+  {
+    for (i = 0; i < NumNames; i++)
+      free(Names[i]);
+    free(Names);
+    return (-1);
+  }
+  Args -> Parts.NoCache = Args -> NoCache;
+
+  for (i = 0; i < NumNames; i++)
+  {
+    if (DetectCompression(Args -> Parts.Fds[i]) != VZ_PLAIN)
+    {
+      fprintf(stderr, "[%s] is compressed, --filelist, --glob and --partition-by only read uncompressed files.\n", Names[i]);
+      CloseParts(Args);
+      return (-1);
+    }
+  }
+
+  Args -> Compression = VZ_PLAIN;
+  Args -> InfileSize = Args -> Parts.Starts[NumNames];
+
+  n = FileSetPread(&Args -> Parts, Header, STRLEN - 1, 0);
+  if (n < 0)
+    n = 0;
+  Header[n] = '\0';
+  nl = strchr(Header, '\n');
+  if (nl != NULL)
+    nl[1] = '\0';
+  return (0);
+}
+
+void CloseParts(struct ProgramArgs *Args)
+{
+  char **Names;
+  int NumNames;
+  int i;
+
+  Names = Args -> Parts.Names;
+  NumNames = Args -> Parts.NumFiles;
+  FileSetClose(&Args -> Parts);
+  for (i = 0; i < NumNames; i++)
+    free(Names[i]);
+  free(Names);
+}
+
+/*
+   main for --filelist and --glob: the parts are one stream, split at line
+   ends into even byte slices which may start in one part and end in another.
+*/
+int SliceParts(struct ProgramArgs *Args)
+{
+  char Header[STRLEN];
+  off_t *Offsets;
+  off_t SliceSize;
+  int FirstSlice = 0;
+  int NumOffsets;
+  int Status;
+  int i;
+
+  if (OpenParts(Args, Header) != 0)
+    return (-1);
+
+  if (Args -> Mode == MODE_DUMP)
+  {
+    FirstSlice = Args -> SliceToDump;
+    NumOffsets = 2;
+  }
+  else
+    NumOffsets = Args -> NumSlices + 1;
+
+  Offsets = (off_t *) malloc(NumOffsets * sizeof(off_t));
+  if (Offsets == NULL)
+  {
+    fprintf(stderr, "Out of memory for %d slice offsets\n", Args -> NumSlices);
+    CloseParts(Args);
+    return (-1);
+  }
+
+  SliceSize = Args -> InfileSize / Args -> NumSlices;
+  for (i = 0; i < NumOffsets; i++)
+  {
+    if (FirstSlice + i >= Args -> NumSlices)
+      Offsets[i] = Args -> InfileSize;
+    else
+      GetPartsLineBoundary(&Args -> Parts, SliceSize * (FirstSlice + i), &Offsets[i]);
+  }
+
+  if (Args -> Mode == MODE_EXEC)
+    Status = ExecSlices(-1, Args, Header, Offsets);
+  else if (Args -> Mode == MODE_SPLIT)
+    Status = SplitSlices(-1, Args, Header, Offsets);
+  else
+  {
+    Status = WriteSlice(-1, Args, Header, Args -> SliceToDump, Offsets[0], Offsets[1], fileno(stdout));
+    if (Status != 0)
+      perror("fslicer: writing slice");
+  }
+
+  free(Offsets);
+  CloseParts(Args);
+  return (Status);
+}
+
+/*
+   main for --partition-by: reads the input once, split at line ends into
+   one range per job, and appends every line to output file
+   hash(key) % num-slices. With --header the header line goes on top of
+   every output instead of into one of them.
+*/
+int PartitionInput(struct ProgramArgs *Args)
+{
+  char Header[STRLEN];
+  char OutName[PATH_MAX];
+  char Template[PATH_MAX];
+  off_t *Ranges;
+  off_t Start = 0;
+  off_t RangeSize;
+  int *OutFds;
+  int NumRanges;
+  int Status = -1;
+  int k;
+
+  if (OpenParts(Args, Header) != 0)
+    return (-1);
+
+  if (Args -> DupeHeader)
+    Start = strlen(Header);
+
+  NumRanges = Args -> MaxJobs;
+  if ((Args -> InfileSize - Start) / NumRanges < PARTITION_MIN_RANGE)
+    NumRanges = (int) ((Args -> InfileSize - Start) / PARTITION_MIN_RANGE);
+  if (NumRanges > PartitionMaxThreads(Args -> NumSlices))
+    NumRanges = PartitionMaxThreads(Args -> NumSlices);
+  if (NumRanges < 1)
+    NumRanges = 1;
+
+  Ranges = (off_t *) malloc((NumRanges + 1) * sizeof(off_t));
+  OutFds = (int *) malloc(Args -> NumSlices * sizeof(int));
+  if ((Ranges == NULL) || (OutFds == NULL))
+  {
+    fprintf(stderr, "Out of memory for %d partitions\n", Args -> NumSlices);
+    free(Ranges);
+    free(OutFds);
+    CloseParts(Args);
+    return (-1);
+  }
+
+  RangeSize = (Args -> InfileSize - Start) / NumRanges;
+  Ranges[0] = Start;
+  for (k = 1; k < NumRanges; k++)
+    GetPartsLineBoundary(&Args -> Parts, Start + RangeSize * k, &Ranges[k]);
+  Ranges[NumRanges] = Args -> InfileSize;
+
+  OutputPrefixTemplate(Template, Args -> OutputTemplate);
+
+  for (k = 0; k < Args -> NumSlices; k++)
+  {
+    ExpandTemplate(OutName, PATH_MAX, Template, k, Args -> NumSlices);
+    OutFds[k] = open(OutName, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if (OutFds[k] < 0)
+    {
+      fprintf(stderr, "Can't open [%s] for writing\n", OutName);
+      break;
+    }
+    if (((Args -> DupeHeader) && (WriteAll(OutFds[k], Header, strlen(Header)) != 0)) ||
+        ((Args -> HeaderFile) && (WriteAll(OutFds[k], Args -> HeaderFileContents, strlen(Args -> HeaderFileContents)) != 0)))
+    {
+      perror("fslicer: writing header");
+      close(OutFds[k]);
+      break;
+    }
+  }
+
+  if (k == Args -> NumSlices)
+  {
+    Status = PartitionLines(&Args -> Parts, Ranges, NumRanges, Args -> PartitionFields, Args -> NumPartitionFields,
+                            Args -> DelimChrs, OutFds, Args -> NumSlices);
+    if (Status != 0)
+      perror("fslicer: partitioning");
+  }
+
+  while (--k >= 0)
+  {
+    if ((close(OutFds[k]) != 0) && (Status == 0))
+    {
+      perror("fslicer: closing partition");
+      Status = -1;
+    }
+  }
+
+  free(Ranges);
+  free(OutFds);
+  CloseParts(Args);
+  return (Status);
+}
+
+/*
+   Compares field Args -> KeyField of Line with Key byte by byte, the order
+   of LC_ALL=C sort. A line without that field has an empty key.
+*/
+int CompareLineKey(char *Line, struct ProgramArgs *Args, char *Key)
+{
+  size_t Len;
+  size_t KeyLen;
+  int Field;
+  int c;
+
+  for (Field = 0; Field < Args -> KeyField; Field++)
+  {
+    Line += strcspn(Line, Args -> DelimChrs);
+    if (*Line == '\0')
+      break;
+    Line++;
+  }
+  if (Field < Args -> KeyField)
+    Len = 0;
+  else
+    Len = strcspn(Line, Args -> DelimChrs);
+  if ((Len > 0) && (Line[Len - 1] == '\n'))
+    Len--;
+  if ((Len > 0) && (Line[Len - 1] == '\r'))
+    Len--;
+
+  KeyLen = strlen(Key);
+  c = memcmp(Line, Key, (Len < KeyLen) ? Len : KeyLen);
+  if (c != 0)
+    return (c);
+  return ((Len > KeyLen) - (Len < KeyLen));
+}
+
+/*
+   Binary search over [Start, End), a line aligned stretch of a file sorted
+   on the key. Returns the start of the first line whose key is >= Key, or
+   > Key with PastKey, End if there is none. Probe x looks at the first line
+   starting at or after x, found the way GetSliceOffset aligns a cut, so the
+   search takes about log2(End - Start) seeks of a line or two each.
+*/
+off_t FindKeyBound(FILE *fp, struct ProgramArgs *Args, off_t Start, off_t End, char *Key, int PastKey)
+{
+  char Line[STRLEN];
+  off_t lo = Start;
+  off_t hi = End;
+  off_t mid;
+  off_t LineStart;
+  int c;
+
+  while (lo < hi)
+  {
+    mid = lo + (hi - lo) / 2;
+    if (mid == Start)
+    {
+      LineStart = Start;
+      fseeko(fp, Start, SEEK_SET);
+    }
+    else
+      GetLineBoundary(fp, mid - 1, &LineStart);   // leaves fp at LineStart
+
+    if ((LineStart >= End) || (fgets(Line, STRLEN, fp) == NULL))
+      hi = mid;
+    else
+    {
+      c = CompareLineKey(Line, Args, Key);
+      if ((c > 0) || ((c == 0) && (!PastKey)))
+        hi = mid;
+      else
+        lo = mid + 1;
+    }
+  }
+
+  if (lo == Start)
+    return (Start);
+  GetLineBoundary(fp, lo - 1, &LineStart);
+  return ((LineStart > End) ? End : LineStart);
+}
+
+/*
+   main for --range: finds where the key range starts and ends with two
+   binary searches and writes just that span.
+*/
+int ExtractKeyRange(struct ProgramArgs *Args)
+{
+  FILE *fp;
+  char Header[STRLEN];
+  struct stat statbuf;
+  off_t Start = 0;
+  off_t Head;
+  off_t Tail;
+
+  fp = fopen(Args -> InfileName, "r");
+  if (!fp)
+  {
+    fprintf(stderr, "Can't open [%s]\n", Args -> InfileName);
+    return (-1);
+  }
+  fstat(fileno(fp), &statbuf);
+  Args -> InfileSize = statbuf.st_size;
+
+  if (DetectCompression(fileno(fp)) != VZ_PLAIN)
+  {
+    fprintf(stderr, "--range needs an uncompressed file to seek in.\n");
+    fclose(fp);
+    return (-1);
+  }
+
+  Header[0] = '\0';
+  if (Args -> DupeHeader)
+  {
+    if (fgets(Header, STRLEN, fp) != NULL)
+      Start = ftello(fp);
+  }
+
+  Head = FindKeyBound(fp, Args, Start, Args -> InfileSize, Args -> RangeLo, 0);
+  Tail = FindKeyBound(fp, Args, Head, Args -> InfileSize, Args -> RangeHi, 1);
+
+  if (((Args -> DupeHeader) && (WriteAll(fileno(stdout), Header, strlen(Header)) != 0)) ||
+      ((Args -> HeaderFile) && (WriteAll(fileno(stdout), Args -> HeaderFileContents, strlen(Args -> HeaderFileContents)) != 0)) ||
+      (CopyFileRange(fileno(fp), Head, Tail - Head, fileno(stdout)) != 0))
+  {
+    perror("fslicer: writing range");
+    fclose(fp);
+    return (-1);
+  }
+
+  fclose(fp);
+  return (0);
+}
+
+/*
+   outprefix is a --output style template; without {} the slice or
+   partition number goes on the end.
+*/
+void OutputPrefixTemplate(char *Template, char *Prefix)
+{
+  if (strstr(Prefix, "{}") != NULL)
+    snprintf(Template, PATH_MAX, "%s", Prefix);
+  else
+    snprintf(Template, PATH_MAX, "%s{}", Prefix);
+}
+
+void *SplitThread(void *arg)
+{
+  struct SplitJob *Job = (struct SplitJob *) arg;
+  char OutName[PATH_MAX];
+  int OutFd;
+  int Slice;
+
+  Job -> Status = 0;
+  for (;;)
+  {
+    pthread_mutex_lock(Job -> Lock);
+    Slice = (*Job -> Next)++;
+    pthread_mutex_unlock(Job -> Lock);
+    if (Slice >= Job -> Args -> NumSlices)
+      break;
+
+    ExpandTemplate(OutName, PATH_MAX, Job -> Template, Slice, Job -> Args -> NumSlices);
+    OutFd = open(OutName, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if (OutFd < 0)
+    {
+      fprintf(stderr, "Can't open [%s] for writing\n", OutName);
+      Job -> Status = -1;
+      continue;
+    }
+    if ((WriteSlice(Job -> InFd, Job -> Args, Job -> Header, Slice, Job -> Offsets[Slice], Job -> Offsets[Slice + 1], OutFd) != 0) ||
+        (close(OutFd) != 0))
+    {
+      fprintf(stderr, "slice %d: writing [%s]: %s\n", Slice, OutName, strerror(errno));
+      Job -> Status = -1;
     }
   }
+  return (NULL);
+}
+
+/*
+   Writes every slice to its own file from a pool of Args -> MaxJobs threads.
+   The boundaries are already known, so the threads only copy; for plain
+   input that is copy_file_range, which a reflink capable filesystem turns
+   into a metadata update. Returns 0 when every slice was written, -1 otherwise.
+*/
+int SplitSlices(int InFd, struct ProgramArgs *Args, char *Header, off_t *Offsets)
+{
+  struct SplitJob *Jobs;
+  pthread_t *Threads;
+  pthread_mutex_t Lock;
+  char Template[PATH_MAX];
+  int NumThreads;
+  int Next = 0;
+  int Status = 0;
+  int t;
+
+  NumThreads = Args -> MaxJobs;
+  if (NumThreads > Args -> NumSlices)
+    NumThreads = Args -> NumSlices;
+
+  Jobs = (struct SplitJob *) calloc(NumThreads, sizeof(struct SplitJob));
+  Threads = (pthread_t *) calloc(NumThreads, sizeof(pthread_t));
+  if ((Jobs == NULL) || (Threads == NULL))
+  {
+    fprintf(stderr, "Out of memory for %d writers\n", NumThreads);
+    free(Jobs);
+    free(Threads);
+    return (-1);
+  }
 
-  *Boundary = (SliceBlockStart + SliceOffset);
-}
\ No newline at end of file
+  OutputPrefixTemplate(Template, Args -> OutputTemplate);
+  pthread_mutex_init(&Lock, NULL);
+  for (t = 0; t < NumThreads; t++)
+  {
+    Jobs[t].InFd = InFd;
+    Jobs[t].Args = Args;
+    Jobs[t].Header = Header;
+    Jobs[t].Offsets = Offsets;
+    Jobs[t].Template = Template;
+    Jobs[t].Next = &Next;
+    Jobs[t].Lock = &Lock;
+  }
+
+  // thread 0's share runs right here, a writer that fails to start just leaves its slices to the others
+  for (t = 1; t < NumThreads; t++)
+    Jobs[t].Started = (pthread_create(&Threads[t], NULL, SplitThread, &Jobs[t]) == 0);
+  SplitThread(&Jobs[0]);
+
+  for (t = 1; t < NumThreads; t++)
+  {
+    if (Jobs[t].Started)
+      pthread_join(Threads[t], NULL);
+  }
+  for (t = 0; t < NumThreads; t++)
+  {
+    if (Jobs[t].Status != 0)
+      Status = -1;
+  }
+
+  pthread_mutex_destroy(&Lock);
+  free(Jobs);
+  free(Threads);
+  return (Status);
+}
+
+/*
+   For --direct: opens the infile a second time with O_DIRECT for the slice
+   copies. Filesystems without O_DIRECT (tmpfs, some network filesystems)
+   get plain --nocache instead.
+*/
+void OpenDirectInput(struct ProgramArgs *Args)
+{
+#ifdef O_DIRECT
+  Args -> DirectFd = open(Args -> InfileName, O_RDONLY | O_DIRECT | O_CLOEXEC);
+#endif
+  if (Args -> DirectFd < 0)
+    fprintf(stderr, "fslicer: can't open [%s] with O_DIRECT, using --nocache\n", Args -> InfileName);
+}
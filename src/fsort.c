@@ -0,0 +1,818 @@
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include "vcount.h"
+#include "vfileio.h"
+#include "vslice.h"
+#include "vstrutils.h"
+#include "vzio.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+
+#define STRLEN (131072)
+
+#define DEFAULT_MEMORY   ((off_t) 1024 * 1024 * 1024)   // -S default
+#define MIN_MEMORY       ((off_t) 16 * 1024 * 1024)
+#define MAX_MERGE_FAN    (256)                          // runs merged at once, more take an extra pass
+#define MIN_RUN_BUF      (64 * 1024)                    // read buffer per run while merging
+#define OUT_BUF          (1024 * 1024)                  // write buffer of a merge or a spill
+#define SAMPLE_BLOCKS    (64)                           // blocks read to guess the line length
+#define SAMPLE_BLOCK     (64 * 1024)
+#define NUM_KEY          (64)                           // numeric keys this long are parsed on the stack
+
+/*
+   One input line. Line points into a chunk or a run buffer and Len leaves
+   out the newline. The first key field is found once, when the line is
+   loaded, since nearly every compare stops there; its first 8 bytes, big
+   endian, settle most of those compares with one integer compare.
+*/
+struct SortLine {
+  char *Line;
+  size_t Len;
+  char *Key;
+  size_t KeyLen;
+  uint64_t Prefix;
+  double Num;
+};
+
+// what a loaded line costs besides its bytes: its SortLine, and the index glibc's qsort sorts big elements through
+#define LINE_COST        (sizeof (struct SortLine) + 2 * sizeof (void *))
+
+/*
+   A sorted run: a chunk kept in memory, or spilled to an unlinked temp
+   file when the input doesn't fit the memory budget.
+*/
+struct SortRun {
+  char *Data;
+  struct SortLine *Lines;
+  size_t NumLines;
+  int Fd;
+};
+
+// a run being merged, with its current line
+struct RunReader {
+  struct SortRun *Run;
+  int Index;
+  size_t Next;
+  char *Buf;
+  size_t BufSize;
+  size_t Have;
+  size_t Pos;
+  int Eof;
+  struct SortLine Cur;
+};
+
+struct SortArgs {
+  char *InfileName;
+  char *OutfileName;
+  char *TempDir;
+  char *DelimChrs;
+  int *Fields;
+  int NumFields;
+  int Numeric;
+  int Reverse;
+  int Stable;
+  int DupeHeader;
+  int NumThreads;
+  off_t Memory;
+  // filled in by main
+  char IsDelim[256];
+  int InFd;
+  off_t *Offsets;
+  int NumChunks;
+  int Spill;
+  struct SortRun *Runs;
+  int NextChunk;
+  pthread_mutex_t Lock;
+};
+
+struct SortJob {
+  struct SortArgs *Args;
+  int Started;
+  int Status;
+};
+
+// the comparison reads these, qsort gives it no other way in
+static struct SortArgs *SortOpts;
+
+int ParseArgs (struct SortArgs *Args, int argc, char **argv);
+off_t ParseSize (char *s);
+double LineCost (int Fd, off_t Start, off_t End);
+void FindField (char *Line, size_t Len, int Field, char **Start, size_t *FieldLen);
+double FieldNumber (char *Field, size_t Len);
+void SetLineKey (struct SortLine *sl);
+int CompareBytes (char *a, size_t alen, char *b, size_t blen);
+int CompareField (char *a, size_t alen, char *b, size_t blen);
+int CompareKeys (const struct SortLine *a, const struct SortLine *b);
+int CompareLines (const void *a, const void *b);
+size_t SplitLines (char *Data, size_t Len, struct SortLine *Lines);
+void *SortChunks (void *arg);
+int SortChunk (struct SortArgs *Args, int Chunk);
+int SpillRun (struct SortRun *Run);
+int OpenTempFile (struct SortArgs *Args);
+int ReaderNext (struct RunReader *r);
+int ReaderLess (struct RunReader *a, struct RunReader *b);
+void SiftDown (struct RunReader **Heap, int n, int i);
+int MergeRuns (struct SortArgs *Args, struct SortRun *Runs, int NumRuns, int OutFd);
+int MergeAll (struct SortArgs *Args, int OutFd);
+
+
+
+int main (int argc, char **argv)
+{
+  FILE *fp;
+  struct SortArgs Args;
+  struct SortJob *Jobs;
+  pthread_t *Threads;
+  struct stat statbuf;
+  char Header[STRLEN];
+  off_t Start = 0;
+  off_t ChunkSize;
+  double Cost;
+  int OutFd;
+  int Status = 0;
+  int i;
+  int t;
+
+  if (ParseArgs (&Args, argc, argv) < 1)
+    return (-1);
+  SortOpts = &Args;
+#ifdef M_MMAP_THRESHOLD
+  // freed chunks would otherwise raise the threshold and stay in the threads' arenas, past -S
+  mallopt (M_MMAP_THRESHOLD, MIN_RUN_BUF);
+#endif
+
+  fp = fopen (Args.InfileName, "r");
+  if (!fp) {
+    fprintf (stderr, "Can't open [%s]\n", Args.InfileName);
+    return (-1);
+  }
+  Args.InFd = fileno (fp);
+  fstat (Args.InFd, &statbuf);
+  if (!S_ISREG (statbuf.st_mode) || (DetectCompression (Args.InFd) != VZ_PLAIN)) {
+    fprintf (stderr, "[%s] isn't a plain file, fsort slices its input and needs to seek in it.\n", Args.InfileName);
+    fclose (fp);
+    return (-1);
+  }
+
+  Header[0] = '\0';
+  if (Args.DupeHeader) {
+    if (fgets (Header, STRLEN, fp) != NULL) Start = ftello (fp);
+  }
+
+  /*
+     A chunk in memory costs its bytes plus LINE_COST per line, Cost bytes
+     per input byte. If the whole input fits, every chunk stays in
+     memory and the merge reads them there; otherwise each thread has one
+     chunk and a spill buffer at a time, and the sorted chunks are spilled
+     to temp files and merged from those.
+  */
+  Cost = LineCost (Args.InFd, Start, statbuf.st_size);
+  Args.Spill = ((statbuf.st_size - Start) * Cost > Args.Memory - OUT_BUF);
+  if (Args.Spill) {
+    if (Args.NumThreads > Args.Memory / (4 * OUT_BUF)) Args.NumThreads = (int) (Args.Memory / (4 * OUT_BUF));
+    ChunkSize = (off_t) ((Args.Memory / Args.NumThreads - OUT_BUF) / Cost);
+    Args.NumChunks = (int) ((statbuf.st_size - Start + ChunkSize - 1) / ChunkSize);
+  } else
+    Args.NumChunks = Args.NumThreads;
+  if (Args.NumChunks < 1) Args.NumChunks = 1;
+  ChunkSize = (statbuf.st_size - Start) / Args.NumChunks;
+
+  Args.Offsets = (off_t *) malloc ((Args.NumChunks + 1) * sizeof (off_t));
+  Args.Runs = (struct SortRun *) calloc (Args.NumChunks, sizeof (struct SortRun));
+  Jobs = (struct SortJob *) calloc (Args.NumThreads, sizeof (struct SortJob));
+  Threads = (pthread_t *) calloc (Args.NumThreads, sizeof (pthread_t));
+  if ((Args.Offsets == NULL) || (Args.Runs == NULL) || (Jobs == NULL) || (Threads == NULL)) {
+    fprintf (stderr, "Out of memory for %d chunks\n", Args.NumChunks);
+    fclose (fp);
+    return (-1);
+  }
+
+  // the same line aligned cuts fslicer makes
+  Args.Offsets [0] = Start;
+  for (i = 1; i < Args.NumChunks; i++) {
+    GetLineBoundary (fp, Start + ChunkSize * i, &Args.Offsets [i]);
+    if (Args.Offsets [i] > statbuf.st_size) Args.Offsets [i] = statbuf.st_size;
+  }
+  Args.Offsets [Args.NumChunks] = statbuf.st_size;
+  for (i = 0; i < Args.NumChunks; i++) Args.Runs [i].Fd = -1;
+
+  Args.NextChunk = 0;
+  pthread_mutex_init (&Args.Lock, NULL);
+  for (t = 0; t < Args.NumThreads; t++) Jobs [t].Args = &Args;
+
+  // thread 0's share runs right here, a thread that fails to start leaves its chunks to the others
+  for (t = 1; t < Args.NumThreads; t++)
+    Jobs [t].Started = (pthread_create (&Threads [t], NULL, SortChunks, &Jobs [t]) == 0);
+  SortChunks (&Jobs [0]);
+  for (t = 1; t < Args.NumThreads; t++) {
+    if (Jobs [t].Started) pthread_join (Threads [t], NULL);
+  }
+  for (t = 0; t < Args.NumThreads; t++) {
+    if (Jobs [t].Status != 0) Status = -1;
+  }
+  pthread_mutex_destroy (&Args.Lock);
+  fclose (fp);
+
+  if (Status != 0) {
+    perror ("fsort: sorting");
+    return (-1);
+  }
+
+  // the input is all read by now, so -o may name the infile
+  if (Args.OutfileName != NULL) {
+    OutFd = open (Args.OutfileName, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (OutFd < 0) {
+      fprintf (stderr, "Can't open [%s] for writing\n", Args.OutfileName);
+      return (-1);
+    }
+  } else
+    OutFd = fileno (stdout);
+
+  if ((WriteAll (OutFd, Header, strlen (Header)) != 0) || (MergeAll (&Args, OutFd) != 0)) {
+    perror ("fsort: writing");
+    return (-1);
+  }
+  if ((Args.OutfileName != NULL) && (close (OutFd) != 0)) {
+    perror ("fsort: writing");
+    return (-1);
+  }
+  return (0);
+}
+
+int ParseArgs (struct SortArgs *Args, int argc, char **argv)
+{
+  int j;
+  char *p;
+
+  Args -> OutfileName = NULL;
+  Args -> TempDir = getenv ("TMPDIR");
+  if ((Args -> TempDir == NULL) || (*Args -> TempDir == '\0')) Args -> TempDir = "/tmp";
+  Args -> DelimChrs = "\t";
+  Args -> Fields = NULL;
+  Args -> NumFields = 0;
+  Args -> Numeric = 0;
+  Args -> Reverse = 0;
+  Args -> Stable = 0;
+  Args -> DupeHeader = 0;
+  Args -> NumThreads = 0;
+  Args -> Memory = DEFAULT_MEMORY;
+
+  for (j = 1; (j < argc) && (argv [j][0] == '-') && (argv [j][1] != '\0'); j++) {
+    if (strcmp (argv [j], "--header") == 0) Args -> DupeHeader = 1;
+    else if (strcmp (argv [j], "-n") == 0) Args -> Numeric = 1;
+    else if (strcmp (argv [j], "-r") == 0) Args -> Reverse = 1;
+    else if (strcmp (argv [j], "-s") == 0) Args -> Stable = 1;
+    else if ((j + 1 < argc) && (strcmp (argv [j], "-k") == 0)) {
+      if (ParseFieldList (argv [++j], &Args -> Fields, &Args -> NumFields) != 0) {
+        fprintf (stderr, "-k needs a list of field numbers (from 0), e.g. -k 0,3\n");
+        return (-1);
+      }
+    }
+    else if ((j + 1 < argc) && (strcmp (argv [j], "-d") == 0)) Args -> DelimChrs = argv [++j];
+    else if ((j + 1 < argc) && (strcmp (argv [j], "-j") == 0)) Args -> NumThreads = atoi (argv [++j]);
+    else if ((j + 1 < argc) && (strcmp (argv [j], "-S") == 0)) {
+      Args -> Memory = ParseSize (argv [++j]);
+      if (Args -> Memory < MIN_MEMORY) {
+        fprintf (stderr, "-S must be at least %dM.\n", (int) (MIN_MEMORY >> 20));
+        return (-1);
+      }
+    }
+    else if ((j + 1 < argc) && (strcmp (argv [j], "-T") == 0)) Args -> TempDir = argv [++j];
+    else if ((j + 1 < argc) && (strcmp (argv [j], "-o") == 0)) Args -> OutfileName = argv [++j];
+    else {
+      j = argc;
+      break;
+    }
+  }
+
+  if (j + 1 != argc) {
+    fprintf (stderr, "Usage: %s {opts} [infile] > outfile\n", argv [0]);
+    fprintf (stderr, "  {opts} :: -k x,y - sort on fields x, then y (from 0). default is the whole line\n");
+    fprintf (stderr, "            -d xyz - fields are delimited by any of xyz. default tab\n");
+    fprintf (stderr, "            -n - compare the keys as numbers.\n");
+    fprintf (stderr, "            -r - reverse the order.\n");
+    fprintf (stderr, "            -s - stable, lines with equal keys keep their input order.\n");
+    fprintf (stderr, "            --header - keep the first line on top.\n");
+    fprintf (stderr, "            -j x - sort on x threads. default is one per cpu\n");
+    fprintf (stderr, "            -S x - use about x bytes of memory, K/M/G suffixes work. default 1G\n");
+    fprintf (stderr, "            -T dir - put the sorted runs in dir. default $TMPDIR or /tmp\n");
+    fprintf (stderr, "            -o outfile - write to outfile, which may be the infile, instead of stdout.\n");
+    return (0);
+  }
+  Args -> InfileName = argv [j];
+
+  if (Args -> NumThreads <= 0) Args -> NumThreads = (int) sysconf (_SC_NPROCESSORS_ONLN);
+  if (Args -> NumThreads <= 0) Args -> NumThreads = 1;
+
+  memset (Args -> IsDelim, 0, sizeof (Args -> IsDelim));
+  for (p = Args -> DelimChrs; *p; p++) Args -> IsDelim [(unsigned char) *p] = 1;
+  return (1);
+}
+
+off_t ParseSize (char *s)
+{
+  char *end;
+  off_t Size;
+
+  Size = (off_t) strtoll (s, &end, 10);
+  switch (*end) {
+    case 'g': case 'G': Size <<= 10;
+      /* fall through */
+    case 'm': case 'M': Size <<= 10;
+      /* fall through */
+    case 'k': case 'K': Size <<= 10;
+  }
+  return (Size);
+}
+
+/*
+   Memory per input byte of a chunk with its line table, from the lines
+   counted in SAMPLE_BLOCKS blocks spread over Start..End.
+*/
+double LineCost (int Fd, off_t Start, off_t End)
+{
+  char *Buf;
+  off_t Step;
+  int64_t Lines = 0;
+  size_t Bytes = 0;
+  ssize_t n;
+  int b;
+
+  Buf = (char *) malloc (SAMPLE_BLOCK);
+  if (Buf == NULL) return (1.0 + LINE_COST);
+  Step = (End - Start) / SAMPLE_BLOCKS;
+  if (Step < SAMPLE_BLOCK) Step = SAMPLE_BLOCK;
+  for (b = 0; (b < SAMPLE_BLOCKS) && (Start + Step * b < End); b++) {
+    n = pread (Fd, Buf, SAMPLE_BLOCK, Start + Step * b);
+    if (n <= 0) break;
+    Lines += CountNewlinesBuf (Buf, n);
+    Bytes += n;
+  }
+  free (Buf);
+
+  // a sample without a newline still has the line it is part of
+  if (Bytes == 0) return (1.0);
+  return (1.0 + (double) LINE_COST * (Lines + 1) / Bytes);
+}
+
+/*
+   Field Field of a line, cut at every delimiter character the way Tokenize
+   cuts. A line with fewer fields has an empty one.
+*/
+void FindField (char *Line, size_t Len, int Field, char **Start, size_t *FieldLen)
+{
+  size_t i = 0;
+  size_t f;
+
+  while ((Field > 0) && (i < Len)) {
+    if (SortOpts -> IsDelim [(unsigned char) Line [i]]) Field--;
+    i++;
+  }
+  if (Field > 0) {
+    *Start = Line + Len;
+    *FieldLen = 0;
+    return;
+  }
+  for (f = i; (f < Len) && (!SortOpts -> IsDelim [(unsigned char) Line [f]]); f++);
+  *Start = Line + i;
+  *FieldLen = f - i;
+}
+
+/*
+   The number a field starts with, parsed from its Len bytes only: strtod
+   on the field itself would run on into the next field, and past the end
+   of a chunk's last line.
+*/
+double FieldNumber (char *Field, size_t Len)
+{
+  char Buf[NUM_KEY];
+  char *Copy = Buf;
+  double Num;
+
+  if (Len >= NUM_KEY) {
+    Copy = (char *) malloc (Len + 1);
+    if (Copy == NULL) return (0);
+  }
+  memcpy (Copy, Field, Len);
+  Copy [Len] = '\0';
+  Num = strtod (Copy, NULL);
+  if (Copy != Buf) free (Copy);
+  return (Num);
+}
+
+void SetLineKey (struct SortLine *sl)
+{
+  size_t Len = sl -> Len;
+  size_t i;
+
+  if ((Len > 0) && (sl -> Line [Len - 1] == '\r')) Len--;
+  if (SortOpts -> NumFields == 0) {
+    sl -> Key = sl -> Line;
+    sl -> KeyLen = Len;
+  } else
+    FindField (sl -> Line, Len, SortOpts -> Fields [0], &sl -> Key, &sl -> KeyLen);
+  sl -> Num = SortOpts -> Numeric ? FieldNumber (sl -> Key, sl -> KeyLen) : 0;
+
+  // zero padded, so a shorter key still sorts before a longer one it prefixes
+  sl -> Prefix = 0;
+  for (i = 0; i < 8; i++) {
+    sl -> Prefix <<= 8;
+    if (i < sl -> KeyLen) sl -> Prefix |= (unsigned char) sl -> Key [i];
+  }
+}
+
+int CompareBytes (char *a, size_t alen, char *b, size_t blen)
+{
+  int c;
+
+  c = memcmp (a, b, (alen < blen) ? alen : blen);
+  if (c != 0) return (c);
+  return ((alen > blen) - (alen < blen));
+}
+
+int CompareField (char *a, size_t alen, char *b, size_t blen)
+{
+  double x;
+  double y;
+
+  if (!SortOpts -> Numeric) return (CompareBytes (a, alen, b, blen));
+  x = FieldNumber (a, alen);
+  y = FieldNumber (b, blen);
+  return ((x > y) - (x < y));
+}
+
+/*
+   Key order, then (unless -s) the whole line as the last resort, so equal
+   keys still come out in a fixed order. 0 means the lines are the same to
+   us and the caller breaks the tie by input order.
+*/
+int CompareKeys (const struct SortLine *a, const struct SortLine *b)
+{
+  char *ka;
+  char *kb;
+  size_t la;
+  size_t lb;
+  int c;
+  int k;
+
+  if (SortOpts -> Numeric) c = (a -> Num > b -> Num) - (a -> Num < b -> Num);
+  else if (a -> Prefix != b -> Prefix) c = (a -> Prefix > b -> Prefix) ? 1 : -1;
+  else c = CompareBytes (a -> Key, a -> KeyLen, b -> Key, b -> KeyLen);
+
+  for (k = 1; (c == 0) && (k < SortOpts -> NumFields); k++) {
+    FindField (a -> Line, a -> Len, SortOpts -> Fields [k], &ka, &la);
+    FindField (b -> Line, b -> Len, SortOpts -> Fields [k], &kb, &lb);
+    c = CompareField (ka, la, kb, lb);
+  }
+  if ((c == 0) && (!SortOpts -> Stable)) c = CompareBytes (a -> Line, a -> Len, b -> Line, b -> Len);
+  return (SortOpts -> Reverse ? -c : c);
+}
+
+// qsort comparison, lines of one chunk: a tie keeps input order
+int CompareLines (const void *a, const void *b)
+{
+  const struct SortLine *x = (const struct SortLine *) a;
+  const struct SortLine *y = (const struct SortLine *) b;
+  int c;
+
+  c = CompareKeys (x, y);
+  if (c != 0) return (c);
+  return ((x -> Line > y -> Line) - (x -> Line < y -> Line));
+}
+
+/*
+   Fills Lines with the lines of Data (Lines == NULL just counts them). The
+   last line may lack its newline.
+*/
+size_t SplitLines (char *Data, size_t Len, struct SortLine *Lines)
+{
+  char *p = Data;
+  char *end = Data + Len;
+  char *nl;
+  size_t n = 0;
+
+  while (p < end) {
+    nl = (char *) memchr (p, '\n', end - p);
+    if (nl == NULL) nl = end;
+    if (Lines != NULL) {
+      Lines [n].Line = p;
+      Lines [n].Len = nl - p;
+      SetLineKey (&Lines [n]);
+    }
+    n++;
+    p = nl + 1;
+  }
+  return (n);
+}
+
+/*
+   Reads chunk Chunk, sorts its lines and either keeps it as a run in
+   memory or spills it. Returns 0 on success, -1 with errno set on failure.
+*/
+int SortChunk (struct SortArgs *Args, int Chunk)
+{
+  struct SortRun *Run = &Args -> Runs [Chunk];
+  off_t Len;
+  ssize_t n;
+  off_t Done = 0;
+
+  Len = Args -> Offsets [Chunk + 1] - Args -> Offsets [Chunk];
+  Run -> Data = (char *) malloc (Len + 1);
+  if (Run -> Data == NULL) return (-1);
+  while (Done < Len) {
+    n = pread (Args -> InFd, Run -> Data + Done, Len - Done, Args -> Offsets [Chunk] + Done);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      return (-1);
+    }
+    if (n == 0) break;
+    Done += n;
+  }
+  Run -> Data [Done] = '\0';
+
+  Run -> NumLines = SplitLines (Run -> Data, Done, NULL);
+  Run -> Lines = (struct SortLine *) malloc ((Run -> NumLines + 1) * sizeof (struct SortLine));
+  if (Run -> Lines == NULL) return (-1);
+  SplitLines (Run -> Data, Done, Run -> Lines);
+  qsort (Run -> Lines, Run -> NumLines, sizeof (struct SortLine), CompareLines);
+
+  if (!Args -> Spill) return (0);
+
+  Run -> Fd = OpenTempFile (Args);
+  if ((Run -> Fd < 0) || (SpillRun (Run) != 0)) return (-1);
+  free (Run -> Lines);
+  free (Run -> Data);
+  Run -> Lines = NULL;
+  Run -> Data = NULL;
+  return (0);
+}
+
+void *SortChunks (void *arg)
+{
+  struct SortJob *Job = (struct SortJob *) arg;
+  struct SortArgs *Args = Job -> Args;
+  int Chunk;
+
+  Job -> Status = 0;
+  for (;;) {
+    pthread_mutex_lock (&Args -> Lock);
+    Chunk = Args -> NextChunk++;
+    pthread_mutex_unlock (&Args -> Lock);
+    if (Chunk >= Args -> NumChunks) break;
+    if (SortChunk (Args, Chunk) != 0) {
+      Job -> Status = -1;
+      break;
+    }
+  }
+  return (NULL);
+}
+
+/*
+   A temp file in -T that is gone as soon as it is closed, or as soon as
+   fsort exits however it exits.
+*/
+int OpenTempFile (struct SortArgs *Args)
+{
+  char Name[PATH_MAX];
+  int Fd;
+
+  snprintf (Name, PATH_MAX, "%s/fsort-XXXXXX", Args -> TempDir);
+  Fd = mkstemp (Name);
+  if (Fd < 0) {
+    fprintf (stderr, "Can't make a temp file in [%s]\n", Args -> TempDir);
+    return (-1);
+  }
+  unlink (Name);
+  return (Fd);
+}
+
+// writes Run's sorted lines to its temp file
+int SpillRun (struct SortRun *Run)
+{
+  char *Buf;
+  size_t Used = 0;
+  size_t k;
+  int Status = 0;
+
+  Buf = (char *) malloc (OUT_BUF);
+  if (Buf == NULL) return (-1);
+
+  for (k = 0; (k < Run -> NumLines) && (Status == 0); k++) {
+    if (Used + Run -> Lines [k].Len + 1 > OUT_BUF) {
+      Status = WriteAll (Run -> Fd, Buf, Used);
+      Used = 0;
+    }
+    if (Run -> Lines [k].Len + 1 > OUT_BUF) {
+      if (Status == 0) Status = WriteAll (Run -> Fd, Run -> Lines [k].Line, Run -> Lines [k].Len);
+      if (Status == 0) Status = WriteAll (Run -> Fd, "\n", 1);
+      continue;
+    }
+    memcpy (Buf + Used, Run -> Lines [k].Line, Run -> Lines [k].Len);
+    Used += Run -> Lines [k].Len;
+    Buf [Used++] = '\n';
+  }
+  if (Status == 0) Status = WriteAll (Run -> Fd, Buf, Used);
+  if ((Status == 0) && (lseek (Run -> Fd, 0, SEEK_SET) != 0)) Status = -1;
+
+  free (Buf);
+  return (Status);
+}
+
+/*
+   Moves r to its run's next line. Returns 1 with r -> Cur set, 0 at the
+   end of the run, -1 on a read error.
+*/
+int ReaderNext (struct RunReader *r)
+{
+  char *nl;
+  char *p;
+  ssize_t n;
+
+  if (r -> Run -> Fd < 0) {
+    if (r -> Next >= r -> Run -> NumLines) return (0);
+    r -> Cur = r -> Run -> Lines [r -> Next++];
+    return (1);
+  }
+
+  for (;;) {
+    nl = (char *) memchr (r -> Buf + r -> Pos, '\n', r -> Have - r -> Pos);
+    if (nl != NULL) break;
+    if (r -> Eof) return (0);   // runs always end in a newline
+
+    // keep the partial line, make room for more
+    memmove (r -> Buf, r -> Buf + r -> Pos, r -> Have - r -> Pos);
+    r -> Have -= r -> Pos;
+    r -> Pos = 0;
+    if (r -> Have == r -> BufSize) {
+      p = (char *) realloc (r -> Buf, r -> BufSize * 2);
+      if (p == NULL) return (-1);
+      r -> Buf = p;
+      r -> BufSize *= 2;
+    }
+    n = read (r -> Run -> Fd, r -> Buf + r -> Have, r -> BufSize - r -> Have);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      return (-1);
+    }
+    if (n == 0) r -> Eof = 1;
+    r -> Have += n;
+  }
+
+  r -> Cur.Line = r -> Buf + r -> Pos;
+  r -> Cur.Len = nl - r -> Cur.Line;
+  SetLineKey (&r -> Cur);
+  r -> Pos += r -> Cur.Len + 1;
+  return (1);
+}
+
+// heap order of two readers: their lines, ties to the earlier run
+int ReaderLess (struct RunReader *a, struct RunReader *b)
+{
+  int c;
+
+  c = CompareKeys (&a -> Cur, &b -> Cur);
+  if (c != 0) return (c < 0);
+  return (a -> Index < b -> Index);
+}
+
+void SiftDown (struct RunReader **Heap, int n, int i)
+{
+  struct RunReader *tmp;
+  int Child;
+
+  for (;;) {
+    Child = 2 * i + 1;
+    if (Child >= n) break;
+    if ((Child + 1 < n) && ReaderLess (Heap [Child + 1], Heap [Child])) Child++;
+    if (!ReaderLess (Heap [Child], Heap [i])) break;
+    tmp = Heap [i];
+    Heap [i] = Heap [Child];
+    Heap [Child] = tmp;
+    i = Child;
+  }
+}
+
+/*
+   k-way merge of NumRuns sorted runs into OutFd through a binary heap of
+   their current lines. Runs are given in input order, so a tie goes to the
+   line that came first. Returns 0 on success, -1 with errno set on failure.
+*/
+int MergeRuns (struct SortArgs *Args, struct SortRun *Runs, int NumRuns, int OutFd)
+{
+  struct RunReader *Readers;
+  struct RunReader **Heap;
+  struct RunReader *r;
+  char *Out;
+  size_t Used = 0;
+  size_t BufSize;
+  int NumHeap = 0;
+  int Status = 0;
+  int i;
+
+  // the runs were all spilled or all kept, and kept runs need no buffer
+  BufSize = (size_t) ((Args -> Memory - OUT_BUF) / NumRuns);
+  if (BufSize < MIN_RUN_BUF) BufSize = MIN_RUN_BUF;
+
+  Readers = (struct RunReader *) calloc (NumRuns, sizeof (struct RunReader));
+  Heap = (struct RunReader **) calloc (NumRuns, sizeof (struct RunReader *));
+  Out = (char *) malloc (OUT_BUF);
+  if ((Readers == NULL) || (Heap == NULL) || (Out == NULL)) {
+    free (Readers);
+    free (Heap);
+    free (Out);
+    errno = ENOMEM;
+    return (-1);
+  }
+
+  for (i = 0; (i < NumRuns) && (Status == 0); i++) {
+    Readers [i].Run = &Runs [i];
+    Readers [i].Index = i;
+    if (Runs [i].Fd >= 0) {
+      Readers [i].BufSize = BufSize;
+      Readers [i].Buf = (char *) malloc (BufSize);
+      if (Readers [i].Buf == NULL) {
+        errno = ENOMEM;
+        Status = -1;
+        break;
+      }
+    }
+    switch (ReaderNext (&Readers [i])) {
+      case 1: Heap [NumHeap++] = &Readers [i]; break;
+      case -1: Status = -1; break;
+    }
+  }
+  for (i = NumHeap / 2 - 1; i >= 0; i--) SiftDown (Heap, NumHeap, i);
+
+  while ((NumHeap > 0) && (Status == 0)) {
+    r = Heap [0];
+    if (Used + r -> Cur.Len + 1 > OUT_BUF) {
+      Status = WriteAll (OutFd, Out, Used);
+      Used = 0;
+    }
+    if (r -> Cur.Len + 1 > OUT_BUF) {
+      if (Status == 0) Status = WriteAll (OutFd, r -> Cur.Line, r -> Cur.Len);
+      if (Status == 0) Status = WriteAll (OutFd, "\n", 1);
+    } else {
+      memcpy (Out + Used, r -> Cur.Line, r -> Cur.Len);
+      Used += r -> Cur.Len;
+      Out [Used++] = '\n';
+    }
+
+    switch (ReaderNext (r)) {
+      case 0: Heap [0] = Heap [--NumHeap]; break;
+      case -1: Status = -1; break;
+    }
+    SiftDown (Heap, NumHeap, 0);
+  }
+  if ((Status == 0) && (Used > 0)) Status = WriteAll (OutFd, Out, Used);
+
+  for (i = 0; i < NumRuns; i++) free (Readers [i].Buf);
+  free (Readers);
+  free (Heap);
+  free (Out);
+  return (Status);
+}
+
+/*
+   Merges every run into OutFd. More runs than fit MAX_MERGE_FAN, or than
+   -S holds MIN_RUN_BUF buffers for, are first merged in groups into bigger
+   runs, so neither the open files nor the per-run buffers get out of hand.
+*/
+int MergeAll (struct SortArgs *Args, int OutFd)
+{
+  struct SortRun *Runs = Args -> Runs;
+  int NumRuns = Args -> NumChunks;
+  int Fan = MAX_MERGE_FAN;
+  int Group;
+  int Fd;
+  int i;
+  int k;
+
+  if ((Args -> Memory - OUT_BUF) / MIN_RUN_BUF < Fan) Fan = (int) ((Args -> Memory - OUT_BUF) / MIN_RUN_BUF);
+  while (NumRuns > Fan) {
+    for (i = 0, k = 0; i < NumRuns; i += Fan, k++) {
+      Group = (NumRuns - i > Fan) ? Fan : NumRuns - i;
+      Fd = OpenTempFile (Args);
+      if ((Fd < 0) || (MergeRuns (Args, Runs + i, Group, Fd) != 0)) return (-1);
+      if (lseek (Fd, 0, SEEK_SET) != 0) return (-1);
+      for (; Group > 0; Group--) close (Runs [i + Group - 1].Fd);
+      Runs [k].Fd = Fd;
+    }
+    NumRuns = k;
+  }
+  return (MergeRuns (Args, Runs, NumRuns, OutFd));
+}
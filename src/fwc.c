@@ -1,3 +1,4 @@
+#include "vcount.h"
 #include "vstrutils.h"
 
 #include <stdio.h>
@@ -6,11 +7,51 @@
 #include <sys/time.h>
 #include <sys/stat.h>
 #include <ctype.h>
+#include <errno.h>
+#include <math.h>
 #include <unistd.h>
 
 
 #define MAXLINE (128 * 1024)
 
+#define MIN_ADAPTIVE_SAMPLES      (64)       // before the variance is worth trusting
+#define DEFAULT_MAX_SAMPLES       (100000)   // --rel-err gives up here unless {samples} says otherwise
+#define DEFAULT_CONFIDENCE        (95.0)
+
+/*
+   What the sampled lines looked like. Everything is a sum over the samples
+   so the per line averages and the file totals both fall out of it.
+*/
+struct SampleShape {
+  int64_t Lines;
+  int64_t Bytes;
+  int64_t Words;
+  int64_t Fields;       // only with a delimiter
+  int64_t FieldBytes;   // bytes that are not delimiters or the newline
+  int MinFields;
+  int MaxFields;
+};
+
+/*
+   What --cache remembers about one file. The file is known by device and
+   inode, and the entry only counts while size and mtime still match.
+*/
+struct CacheEntry {
+  off_t Size;
+  int64_t MtimeSec;
+  int64_t MtimeNsec;
+  int Samples;        // the estimate came from this many samples
+  int64_t Estimate;   // -1 when not known
+  int64_t Exact;      // -1 when not known
+};
+
+double NormalQuantile (double p);
+void TallyLine (struct SampleShape *Shape, char *Line, int Len, char *DelimChrs);
+void PrintShape (struct SampleShape *Shape, off_t filelen, char *DelimChrs);
+char *CacheDefaultDir (void);
+int CachePath (char *Dir, struct stat *St, char *Path, size_t PathLen);
+int CacheLoad (char *Dir, struct stat *St, struct CacheEntry *Entry);
+int CacheStore (char *Dir, struct stat *St, struct CacheEntry *Entry);
 
 
 int main (int argc, char **argv)
@@ -19,57 +60,370 @@ int main (int argc, char **argv)
   off_t filelen;
   int ctr = 1000; // good enough for sampling in most cases
   int i;
-  int state;
-  int ctr_lines = 0;
-  int ctr_words = 0;
-  int ctr_bytes = 0;
-  char *p;
   char Line [MAXLINE + 1];
+  int j;
+  int Exact = 0;
+  int NumThreads = 0;
+  int64_t Lines;
+  double RelErr = 0;
+  double Confidence = DEFAULT_CONFIDENCE;
+  char *RelErrArg = NULL;
+  char *ConfidenceArg = NULL;
+  double Mean = 0;
+  double M2 = 0;
+  double Delta;
+  double SE = 0;
+  double z;
+  int Len;
+  int MaxSamples = DEFAULT_MAX_SAMPLES;
+  int ShowShape = 0;
+  char *DelimChrs = NULL;
+  struct SampleShape Shape;
+  char *CacheDir = NULL;
+  struct stat St;
+  struct CacheEntry Cached;
+
+  memset (&Shape, 0, sizeof (Shape));
+
+  for (j = 1; (j < argc) && (argv [j][0] == '-') && (argv [j][1] != '\0'); j++) {
+    if (strcmp (argv [j], "--exact") == 0) Exact = 1;
+    else if (strcmp (argv [j], "--shape") == 0) ShowShape = 1;
+    else if (strcmp (argv [j], "--cache") == 0) CacheDir = CacheDefaultDir ();
+    else if (strncmp (argv [j], "--cache-dir=", 12) == 0) CacheDir = argv [j] + 12;
+    else if ((j + 1 < argc) && (strcmp (argv [j], "-d") == 0)) {
+      DelimChrs = argv [++j];
+      ShowShape = 1;
+    }
+    else if (strncmp (argv [j], "--jobs=", 7) == 0) NumThreads = atoi (argv [j] + 7);
+    else if (strncmp (argv [j], "--rel-err=", 10) == 0) RelErrArg = argv [j] + 10;
+    else if (strncmp (argv [j], "--confidence=", 13) == 0) ConfidenceArg = argv [j] + 13;
+    else {
+      j = argc;
+      break;
+    }
+  }
+
+  // out of range says why; a bare 1 or 95 is most likely a percentage missing its %
+  if (RelErrArg != NULL) {
+    RelErr = ParsePercent (RelErrArg);
+    if ((RelErr <= 0) || (RelErr >= 1)) {
+      fprintf (stderr, "--rel-err=%s: the error must be a fraction between 0 and 1, or a percentage like 1%%\n", RelErrArg);
+      return (-1);
+    }
+  }
+  if (ConfidenceArg != NULL) {
+    Confidence = ParsePercent (ConfidenceArg) * 100;
+    if ((Confidence <= 0) || (Confidence >= 100)) {
+      fprintf (stderr, "--confidence=%s: the confidence must be a percentage between 0%% and 100%% like 95%%, or a fraction like 0.95\n", ConfidenceArg);
+      return (-1);
+    }
+  }
 
-  if (argc < 2) {
-    fprintf (stderr, "Usage: %s [file]\n\n", argv [0]);
+  if ((j >= argc) || (j + 2 < argc)) {
+    fprintf (stderr, "Usage: %s {opts} [file] {samples}\n", argv [0]);
+    fprintf (stderr, "  {opts} :: --exact - count every line instead of estimating, like wc -l.\n");
+    fprintf (stderr, "            --jobs=x - with --exact, count on x threads. default is one per cpu\n");
+    fprintf (stderr, "            --rel-err=x%% - sample until the estimate is within x%%, then print it with its interval.\n");
+    fprintf (stderr, "            --confidence=x%% - with --rel-err, the confidence of the interval. default %.0f%%\n", DEFAULT_CONFIDENCE);
+    fprintf (stderr, "            --shape - also estimate words, bytes per line and, with -d, fields per line.\n");
+    fprintf (stderr, "            -d xyz - field delimiters for --shape, any of the characters. implies --shape\n");
+    fprintf (stderr, "            --cache - remember the count per file (by inode, size and mtime) and answer\n");
+    fprintf (stderr, "                      repeat calls from it. plain and --exact counts only\n");
+    fprintf (stderr, "            --cache-dir=dir - like --cache, in dir instead of $XDG_CACHE_HOME/fwc or ~/.cache/fwc\n");
+    fprintf (stderr, "  samples   how many lines to sample, 1000 by default. With --rel-err the most it may sample, default %d\n\n", DEFAULT_MAX_SAMPLES);
     return (-1);
   }
 
-  if (argc == 3) {
-    ctr = atoi (argv [2]);
+  if (j + 2 == argc) {
+    ctr = atoi (argv [j + 1]);
+    MaxSamples = ctr;
+  }
+
+  // --rel-err and --shape print more than a count, so the cache stays out of it
+  if ((RelErr > 0) || ShowShape) CacheDir = NULL;
+  if ((CacheDir != NULL) && (stat (argv [j], &St) == 0) && S_ISREG (St.st_mode)) {
+    if (CacheLoad (CacheDir, &St, &Cached) == 0) {
+      if (Cached.Exact >= 0) {
+        printf ("%lld\n", (long long) Cached.Exact);
+        return (0);
+      }
+      if ((!Exact) && (Cached.Estimate >= 0) && (Cached.Samples >= ctr)) {
+        printf ("%lld\n", (long long) Cached.Estimate);
+        return (0);
+      }
+    }
+    else {
+      Cached.Size = St.st_size;
+      Cached.MtimeSec = St.st_mtim.tv_sec;
+      Cached.MtimeNsec = St.st_mtim.tv_nsec;
+      Cached.Samples = 0;
+      Cached.Estimate = -1;
+      Cached.Exact = -1;
+    }
   }
+  else CacheDir = NULL;
 
-  fp = fopen (argv [1], "rb");
+  fp = fopen (argv [j], "rb");
   if (!fp) {
-    fprintf (stderr, "Can't open [%s]\n", argv [1]);
+    fprintf (stderr, "Can't open [%s]\n", argv [j]);
     perror (NULL);
     return (-1);
   } 
+
+  if (Exact) {
+    fseeko (fp, 0, SEEK_END);
+    filelen = ftello (fp);
+    if (NumThreads <= 0) NumThreads = (int) sysconf (_SC_NPROCESSORS_ONLN);
+    if (CountNewlines (fileno (fp), 0, filelen, NumThreads, &Lines) != 0) {
+      perror ("fwc: counting lines");
+      fclose (fp);
+      return (-1);
+    }
+    fclose (fp);
+    printf ("%lld\n", (long long) Lines);
+    if (CacheDir != NULL) {
+      Cached.Exact = Lines;
+      CacheStore (CacheDir, &St, &Cached);
+    }
+    return (0);
+  }
   
   srandom (time(NULL) ^ getpid());
 
   fseeko (fp, 0, SEEK_END);
   filelen = ftello (fp);
 
+  if ((RelErr > 0) && (filelen > 0)) {
+    /*
+       The estimate is filelen / mean line length, so its relative error is
+       that of the mean: z * stddev / sqrt(n) / mean. Sample (keeping a
+       running mean and variance) until that is within RelErr.
+    */
+    z = NormalQuantile (0.5 + Confidence / 200.0);
+    for (i = 1; i <= MaxSamples; i++) {
+      Len = SampleLine (Line, MAXLINE, fp, 0, filelen);
+      TallyLine (&Shape, Line, Len, DelimChrs);
+      Delta = Len - Mean;
+      Mean += Delta / i;
+      M2 += Delta * (Len - Mean);
+      if (i >= 2) SE = sqrt (M2 / (i - 1) / i);
+      if ((i >= MIN_ADAPTIVE_SAMPLES) && (z * SE <= RelErr * Mean)) break;
+    }
+    fclose (fp);
+    if (i > MaxSamples) {
+      i = MaxSamples;
+      fprintf (stderr, "fwc: stopped after %d samples at +/- %.3g%%, not the %.3g%% asked for\n", i,
+               (Mean > 0) ? 100 * z * SE / Mean : 100.0, 100 * RelErr);
+    }
+    if (Mean <= 0) return (-1);
+
+    // estimate, then the interval: the line count is filelen over the interval of the mean, flipped
+    if (ShowShape) printf ("lines\t");
+    printf ("%.0f\t%.0f\t", filelen / Mean, filelen / (Mean + z * SE));
+    if (Mean > z * SE) printf ("%.0f\n", filelen / (Mean - z * SE));
+    else printf ("%lld\n", (long long) filelen);
+    if (ShowShape) PrintShape (&Shape, filelen, DelimChrs);
+    return (0);
+  }
+
   for (i = 0; i < ctr; i++) {
-    ctr_bytes += SampleLine (Line, MAXLINE, fp, 0, filelen);
-    ctr_lines++;
-
-    state = 0;
-    p = (char *) Line;
-    while (*p) {
-      if (state == 0) {
-        if (!isspace (*p)) {
-            ctr_words++;
-            state = 1;
-        }
-      } else if (state == 1) {
-        if (isspace (*p)) state = 0;
+    Len = SampleLine (Line, MAXLINE, fp, 0, filelen);
+    TallyLine (&Shape, Line, Len, DelimChrs);
+  }
+  fclose (fp);
+
+  if ((ctr != 0) && (Shape.Bytes != 0)) {
+     // filelen over the mean sampled line, rounded, whichever way it gets printed
+     Lines = (int64_t) ((double) filelen * Shape.Lines / Shape.Bytes + 0.5);
+     if (ShowShape) {
+       printf ("lines\t%lld\n", (long long) Lines);
+       PrintShape (&Shape, filelen, DelimChrs);
+     }
+     else printf ("%lld\n", (long long) Lines);
+     if (CacheDir != NULL) {
+       Cached.Samples = ctr;
+       Cached.Estimate = Lines;
+       CacheStore (CacheDir, &St, &Cached);
+     }
+  }
+
+}
+
+/*
+   Adds one sampled line (newline included, as SampleLine returns it) to
+   the running shape.
+*/
+void TallyLine (struct SampleShape *Shape, char *Line, int Len, char *DelimChrs)
+{
+  int state = 0;
+  int Fields = 1;
+  int Delims = 0;
+  char *p;
+
+  Shape -> Lines++;
+  Shape -> Bytes += Len;
+
+  for (p = Line; *p; p++) {
+    if (state == 0) {
+      if (!isspace ((unsigned char) *p)) {
+          Shape -> Words++;
+          state = 1;
       }
-      p++;
+    } else if (state == 1) {
+      if (isspace ((unsigned char) *p)) state = 0;
+    }
+    if ((DelimChrs != NULL) && (strchr (DelimChrs, *p) != NULL)) {
+      Fields++;
+      Delims++;
     }
   }
-  fclose (fp);
 
-  if ((ctr != 0) && (ctr_bytes != 0)) {
-     printf ("%.0qd\n", (int64_t) filelen / (int64_t) (ctr_bytes / ctr));
+  if (DelimChrs == NULL) return;
+  if ((Len > 0) && (Line [Len - 1] == '\n')) Len--;
+  Shape -> Fields += Fields;
+  Shape -> FieldBytes += Len - Delims;
+  if ((Shape -> Lines == 1) || (Fields < Shape -> MinFields)) Shape -> MinFields = Fields;
+  if (Fields > Shape -> MaxFields) Shape -> MaxFields = Fields;
+}
+
+/*
+   The rest of the --shape report, after the lines line: totals scaled up
+   from the sample by bytes, and the per line figures as sampled.
+*/
+void PrintShape (struct SampleShape *Shape, off_t filelen, char *DelimChrs)
+{
+  double Scale;
+
+  if (Shape -> Bytes == 0) return;
+  Scale = (double) filelen / Shape -> Bytes;
+  printf ("words\t%.0f\n", Shape -> Words * Scale);
+  printf ("bytes/line\t%.1f\n", (double) Shape -> Bytes / Shape -> Lines);
+  if (DelimChrs == NULL) return;
+  printf ("fields\t%.0f\n", Shape -> Fields * Scale);
+  printf ("fields/line\t%.2f\t%d\t%d\n", (double) Shape -> Fields / Shape -> Lines, Shape -> MinFields, Shape -> MaxFields);
+  printf ("bytes/field\t%.1f\n", (double) Shape -> FieldBytes / Shape -> Fields);
+}
+
+/*
+   z with P(Z <= z) = p for a standard normal Z, by bisection on erfc. It
+   only runs once, so there is no point in anything cleverer.
+*/
+double NormalQuantile (double p)
+{
+  double lo = -10;
+  double hi = 10;
+  double mid;
+  int i;
+
+  for (i = 0; i < 100; i++) {
+    mid = (lo + hi) / 2;
+    if (0.5 * erfc (-mid / sqrt (2.0)) < p) lo = mid;
+    else hi = mid;
   }
+  return ((lo + hi) / 2);
+}
+
+/*
+   $XDG_CACHE_HOME/fwc, or ~/.cache/fwc without it. NULL if neither can be
+   worked out, which leaves the cache off.
+*/
+char *CacheDefaultDir (void)
+{
+  static char Dir [4096];
+  char *Base;
+
+  Base = getenv ("XDG_CACHE_HOME");
+  if ((Base != NULL) && (*Base == '/')) {
+    snprintf (Dir, sizeof (Dir), "%s/fwc", Base);
+    return (Dir);
+  }
+  Base = getenv ("HOME");
+  if ((Base == NULL) || (*Base == '\0')) return (NULL);
+  snprintf (Dir, sizeof (Dir), "%s/.cache/fwc", Base);
+  return (Dir);
+}
+
+/*
+   One small file per input, named for its device and inode.
+*/
+int CachePath (char *Dir, struct stat *St, char *Path, size_t PathLen)
+{
+  int n;
+
+  n = snprintf (Path, PathLen, "%s/%llx-%llx", Dir, (unsigned long long) St -> st_dev, (unsigned long long) St -> st_ino);
+  if ((n < 0) || ((size_t) n >= PathLen)) return (-1);
+  return (0);
+}
+
+/*
+   Reads the entry for St. -1 if there is none, or the file has changed
+   since it was written (the stale entry is simply overwritten later).
+*/
+int CacheLoad (char *Dir, struct stat *St, struct CacheEntry *Entry)
+{
+  char Path [4200];
+  FILE *fp;
+  long long Size, Sec, Nsec, Estimate, Exact;
+  int Samples;
+  int n;
+
+  if (CachePath (Dir, St, Path, sizeof (Path)) != 0) return (-1);
+  fp = fopen (Path, "r");
+  if (fp == NULL) return (-1);
+  n = fscanf (fp, "fwc1 %lld %lld %lld %d %lld %lld", &Size, &Sec, &Nsec, &Samples, &Estimate, &Exact);
+  fclose (fp);
+  if (n != 6) return (-1);
+  if ((Size != (long long) St -> st_size) || (Sec != (long long) St -> st_mtim.tv_sec) ||
+      (Nsec != (long long) St -> st_mtim.tv_nsec)) return (-1);
 
+  Entry -> Size = Size;
+  Entry -> MtimeSec = Sec;
+  Entry -> MtimeNsec = Nsec;
+  Entry -> Samples = Samples;
+  Entry -> Estimate = Estimate;
+  Entry -> Exact = Exact;
+  return (0);
 }
 
+/*
+   Writes the entry to a temp file and renames it over the old one, so a
+   concurrent fwc reads either entry whole. Failing to cache is not worth
+   failing the count for, so the caller may ignore the result.
+*/
+int CacheStore (char *Dir, struct stat *St, struct CacheEntry *Entry)
+{
+  char Path [4200];
+  char TmpPath [4300];
+  char Parent [4200];
+  char *Slash;
+  FILE *fp;
+  int Fd;
+
+  if (CachePath (Dir, St, Path, sizeof (Path)) != 0) return (-1);
+
+  // like mkdir -p, ~/.cache may not be there yet either
+  snprintf (Parent, sizeof (Parent), "%s", Dir);
+  for (Slash = strchr (Parent + 1, '/'); Slash != NULL; Slash = strchr (Slash + 1, '/')) {
+    *Slash = '\0';
+    if ((mkdir (Parent, 0700) != 0) && (errno != EEXIST)) return (-1);
+    *Slash = '/';
+  }
+  if ((mkdir (Parent, 0700) != 0) && (errno != EEXIST)) return (-1);
+
+  snprintf (TmpPath, sizeof (TmpPath), "%s.XXXXXX", Path);
+  Fd = mkstemp (TmpPath);
+  if (Fd < 0) return (-1);
+  fp = fdopen (Fd, "w");
+  if (fp == NULL) {
+    close (Fd);
+    unlink (TmpPath);
+    return (-1);
+  }
+  fprintf (fp, "fwc1 %lld %lld %lld %d %lld %lld\n", (long long) Entry -> Size, (long long) Entry -> MtimeSec,
+           (long long) Entry -> MtimeNsec, Entry -> Samples, (long long) Entry -> Estimate, (long long) Entry -> Exact);
+  if ((fclose (fp) != 0) || (rename (TmpPath, Path) != 0)) {
+    unlink (TmpPath);
+    return (-1);
+  }
+  return (0);
+}
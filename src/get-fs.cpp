@@ -30,6 +30,11 @@
  * for performance, reuse string, get rid of silly command line options [-1] [-t], and add one case
  * of no sampling to improve performance.
  * add [-T] [-t] options for trimming, [-e] for escape character choice for csv format [-d $',']
+ *
+ * [-j N] profiles a regular file on stdin with N threads: the file is cut at line boundaries,
+ * every thread keeps its own Profile (counters and samples) for its part, and the profiles
+ * are merged at the end, so the counts come out exactly as a single pass gives them.
+ * get-fs -j 8 < file
  */
 
 #include <cstdio>
@@ -68,6 +73,12 @@
 #include <unistd.h>
 #include <getopt.h>
 #include <limits.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "vcsv.h"
+#include "vhll.h"
 
 using namespace std;
 
@@ -77,8 +88,11 @@ constexpr const char Quote = '"';
 
 const int DefaultSampleRecs = 10;
 const int DefaultSampleCols = 5;
+const size_t ReadBufSize = 1024 * 1024;            // bytes each -j thread reads at a time
+const int64_t MinChunkSize = 16 * 1024 * 1024;     // don't start a -j thread for less than this
 
 int verbose_flag = 0;
+int distinct_flag = 0;  // --distinct, keep a HyperLogLog sketch per field
 char delim = '\t';
 bool needTrim = true;   // can be reset from command line option -T
 char EscapeChar = '"';  // can be set from command line option -e, for csv input
@@ -87,31 +101,55 @@ string headerFile;
 bool inFileHeader = true;
 int numSampleRec = DefaultSampleRecs;
 int numSampleCol = DefaultSampleCols;
+int numJobs = 1;
 
 bool needSampleRow;
 bool needSampleCol;
 
-// file size, line size and line count
-int64_t fsize = 0;  // real file size, so including all CR
-int64_t lmax = 0;   // line (record) maximal length, counting ending CR
-int64_t lmin = INT64_MAX;
-int64_t lcnt = 0;   // record number
-
-// field count per record, and total fields
-int64_t minfpl = INT64_MAX;     // minimal field number per line (record)
-int64_t maxfpl = 0;
-int64_t fieldtotal = 0;
-
-// property related to each field, like field length
-vector <int64_t> minfl;     // one field's minimal length, cross all records
-vector <int64_t> maxfl;     // one field's maximal length, cross all records
-vector <int64_t> fieldcount;        // it should all be lcnt, but not necessarily for jagged record
-vector <int64_t> fieldfillcount;     // a field can be empty, then it's not counted
-vector <int64_t> fieldtotalbytes;   // old code has both ByteCtr and TTLFldLen, with later one not counting "0", "0.0".
+/**
+ * One field of a line. Usually it's just a view into the line buffer, start and length, with
+ * trimming done by moving the ends. Only when characters have to be taken out of the middle
+ * (csv quotes, escaped quotes) is it copied into copy, and then data points there.
+ */
+struct Field {
+    const char *data = nullptr;
+    size_t size = 0;
+    bool copied = false;
+    string copy;    // reused from line to line, so it keeps its capacity
+};
 
-// sampling for records and fields
-vector <string> sampleRecs;
-vector <vector<string>> sampleFields;
+/**
+ * Everything gathered from the records. A serial run has one, with -j every thread has
+ * its own for its part of the file, and mergeProfile folds them into one.
+ */
+struct Profile {
+    // file size, line size and line count
+    int64_t fsize = 0;  // real file size, so including all CR
+    int64_t lmax = 0;   // line (record) maximal length, counting ending CR
+    int64_t lmin = INT64_MAX;
+    int64_t lcnt = 0;   // record number
+
+    // field count per record, and total fields
+    int64_t minfpl = INT64_MAX;     // minimal field number per line (record)
+    int64_t maxfpl = 0;
+    int64_t fieldtotal = 0;
+
+    // property related to each field, like field length
+    vector <int64_t> minfl;     // one field's minimal length, cross all records
+    vector <int64_t> maxfl;     // one field's maximal length, cross all records
+    vector <int64_t> fieldcount;        // it should all be lcnt, but not necessarily for jagged record
+    vector <int64_t> fieldfillcount;     // a field can be empty, then it's not counted
+    vector <int64_t> fieldtotalbytes;   // old code has both ByteCtr and TTLFldLen, with later one not counting "0", "0.0".
+
+    // sampling for records and fields
+    vector <string> sampleRecs;
+    vector <vector<string>> sampleFields;
+    vector <Hll> distinct;      // with --distinct, the values of each field, about 1.5KB each
+    mt19937 rng{random_device()()};     // each its own, mt19937 isn't thread safe
+};
+
+// csv or general field splitting, chosen by delim
+int (*pprocess)(const char *, size_t, vector <Field> &);
 
 const char *usage = R"END(
   Usage: %s [-d delim] [-t | -T] [-e escape char] [-h HEADER-FILE.txt] [-s SAMPLE-SIZE] [-n SAMPLE-COLUMNS-NUM]
@@ -122,6 +160,8 @@ const char *usage = R"END(
   -h -- read headerfile (tab separated or newline separated) and inject field names into output. Omitting this means first line is header.
   -s -- include sample records at bottom of report.
   -n -- include column samples on right of report.
+  -j -- profile a regular file on stdin with this many threads, 0 is one per cpu. default 1
+  --distinct -- add the approximate number of distinct values of each field (HyperLogLog, about 2% off).
 
 )END";
 
@@ -205,12 +245,15 @@ int getCmdOptions(int argc, char **argv) {
             {"header",  required_argument, nullptr,       'h'},
             {"recs",    required_argument, nullptr,       's'},
             {"cols",    required_argument, nullptr,       'n'},
+            {"jobs",    required_argument, nullptr,       'j'},
+            {"distinct", no_argument,      &distinct_flag, 1},
             // {"shortoutput",  no_argument,       nullptr,       't'},
             // {"infileheader", no_argument,       nullptr,       '1'},
+            {nullptr,   0,                 nullptr,       0},
     };
     while (true) {
         int option_index = 0;
-        c = getopt_long(argc, argv, "?tTh:d:s:n:e:", long_options, &option_index);
+        c = getopt_long(argc, argv, "?tTh:d:s:n:e:j:", long_options, &option_index);
         // printf("getopt_long: 0x%0x\n", c);
         if (c == -1) break;     // end of processing
         switch (c) {
@@ -242,6 +285,10 @@ int getCmdOptions(int argc, char **argv) {
             case 'e':
                 EscapeChar = optarg[0];
                 break;
+            case 'j':
+                numJobs = atoi(optarg);
+                if (numJobs <= 0) numJobs = (int) sysconf(_SC_NPROCESSORS_ONLN);
+                break;
                 // case '1':
                 // inFileHeader = true;
                 // break;
@@ -262,19 +309,30 @@ int getCmdOptions(int argc, char **argv) {
 }
 
 /**
- * Get the n-th string from a vector, if n equals size, append one new empty string and return it
+ * Get the n-th field from a vector, if n equals size, append one new field, and reset it to empty
  * We assume n can't exceed size, so it should be called continuously, be careful
- * Note in C++, reference can be initialized, but then can't be reassigned, if you
- * do the assignment again, it's actually value copying, it still references to
- * the old variable through initialization.
- * So this function has to pass back a pointer
+ * The field's copy keeps its capacity, so it's only allocated again for a longer field.
  * @param v
  * @param n
- * @return reference to the n-th string from the vector, starting from 0, till size of the vector
+ * @param line the field starts out as an empty view into line
+ * @return pointer to the n-th field from the vector, starting from 0, till size of the vector
  */
-inline string *get_nth(vector <string> &v, int n) {
-    if (n >= v.size()) v.push_back("");
-    return &v[n];
+inline Field *get_nth(vector <Field> &v, int n, const char *line) {
+    if (n >= v.size()) {
+        size_t capacity = v.capacity();
+        v.emplace_back();
+        // growing moves the fields, and a short copy's characters move along with it
+        if (v.capacity() != capacity) {
+            for (int k = 0; k < n; k++) {
+                if (v[k].copied) v[k].data = v[k].copy.data();
+            }
+        }
+    }
+    Field *f = &v[n];
+    f->data = line;
+    f->size = 0;
+    f->copied = false;
+    return f;
 }
 
 /**
@@ -283,16 +341,21 @@ inline string *get_nth(vector <string> &v, int n) {
  * minfl, maxfl, fieldcount, fieldfillcount, fieldtotalbyts, sampleFields
  * all are vectors with same size, this function will add one more element
  * to each of them with proper initial value.
+ * @param p
  * @param count
  */
-inline void initializeFieldCounters(size_t count) {
-    for (int k = minfl.size(); k < count; k++) {
-        minfl.push_back(INT64_MAX);
-        maxfl.push_back(0);
-        fieldcount.push_back(0);
-        fieldfillcount.push_back(0);
-        fieldtotalbytes.push_back(0);
-        if (needSampleCol) sampleFields.push_back({});
+inline void initializeFieldCounters(Profile &p, size_t count) {
+    for (int k = p.minfl.size(); k < count; k++) {
+        p.minfl.push_back(INT64_MAX);
+        p.maxfl.push_back(0);
+        p.fieldcount.push_back(0);
+        p.fieldfillcount.push_back(0);
+        p.fieldtotalbytes.push_back(0);
+        if (needSampleCol) p.sampleFields.push_back({});
+        if (distinct_flag) {
+            p.distinct.push_back({});
+            HllInit(&p.distinct.back());
+        }
     }
 }
 
@@ -303,56 +366,116 @@ inline void initializeFieldCounters(size_t count) {
  * Otherwise, suppose we now have a total number of elements, use a random
  * number to judge if we should add it to samples (replace one of them).
  * and if yes, use another random number to tell which one to replace.
- * looks like we should use move(element) for efficiency, but then after
- * return element is restored to empty (capacity very short), causing further performance issue.
- * I tried s1.swap(s2) or swap(s1, s2), but only one c_str() is reused, the other
- * got reallocated, so there's a copying, which is also a waste.
- * so we skipped the idea.
+ * The element is a view, it only becomes a string here, when it's kept, and assign()
+ * reuses the capacity of the sample it replaces.
  * @param samples is the input vector of string as the samples
  * @param sampleCnt is the supposed size of the samples
- * @param element is the new one to be added or skipped
+ * @param data, size is the new one to be added or skipped
  * @param total is the current total number, it's already increased (including this element)
+ * @param rng is the random generator of the profile the samples belong to
  */
-inline void tryAddSample(vector <string> &samples, int sampleCnt, string &element, int64_t total) {
-    static random_device dev;
-    static mt19937 rng(dev());
-    if (samples.size() < sampleCnt) samples.push_back(element);
+inline void tryAddSample(vector <string> &samples, int sampleCnt, const char *data, size_t size, int64_t total,
+                         mt19937 &rng) {
+    if (samples.size() < sampleCnt) samples.emplace_back(data, size);
     else {
         auto index = rng() % total;
-        if (index < sampleCnt) samples[index] = element;    // should we use move() for efficiency? NO.
+        if (index < sampleCnt) samples[index].assign(data, size);
+    }
+}
+
+/**
+ * add line[from, to) to the end of field f. While the field is still one piece of the line,
+ * that's just moving its end, the first gap (a quote taken out) copies it into f->copy.
+ * @param f
+ * @param line
+ * @param from
+ * @param to
+ */
+inline void appendToField(Field *f, const char *line, size_t from, size_t to) {
+    if (from == to) return;
+    if (!f->copied && (f->size == 0 || f->data + f->size == line + from)) {
+        if (f->size == 0) f->data = line + from;
+        f->size += to - from;
+        return;
+    }
+    if (!f->copied) {
+        f->copy.assign(f->data, f->size);
+        f->copied = true;
+    }
+    f->copy.append(line + from, to - from);
+    f->data = f->copy.data();
+    f->size = f->copy.size();
+}
+
+/**
+ * take line[from, to), which holds no quote or delimiter, into field f. When trimming, the
+ * blanks before the field's first non blank are left out.
+ * @param f
+ * @param line
+ * @param from
+ * @param to
+ * @param gotNonBlank
+ */
+inline void takeRun(Field *f, const char *line, size_t from, size_t to, bool &gotNonBlank) {
+    if (needTrim && !gotNonBlank) {
+        while (from < to && isspace(line[from])) from++;
+    }
+    if (from < to) {
+        gotNonBlank = true;
+        appendToField(f, line, from, to);
+    }
+}
+
+/**
+ * trim the ending blanks of a finished field, by shortening it
+ * @param f
+ */
+inline void trimFieldEnd(Field *f) {
+    if (needTrim) {
+        while (f->size > 0 && isspace(f->data[f->size - 1])) f->size--;
+    }
+}
+
+/**
+ * make field f line[from, to), trimmed at both ends if we need to trim
+ * @param f
+ * @param line
+ * @param from
+ * @param to
+ */
+inline void setTrimmedField(Field *f, const char *line, size_t from, size_t to) {
+    if (needTrim) {
+        while (from < to && isspace(line[from])) from++;
     }
+    f->data = line + from;
+    f->size = to - from;
+    trimFieldEnd(f);
 }
 
 /**
- * process input line, transforming from csv to tsv, into fields,
+ * parse one csv field, starting at index, into pfield
  * (this is copied from tsv2csv2.cpp, with just one change, skipping the pSubst use)
- * First, just process character by character,
  * if a field starts with double quote (except whitespace?), then it enters quote mode,
  * the quote mode will be ended with a matching double quote, note
  * the quote mode can be partial in a field.
  * if we need to trim, then trim all leading as we process, don't trim afterwards,
  * but at the end trim the endings, the complexity will be O(1).
+ * The text between quotes, escapes and commas is taken as whole runs, not character by
+ * character, and a field stays a view into line unless a quote is taken out of its middle.
  * @param line
- * @param fields
- * @return
+ * @param index
+ * @param size
+ * @param pfield
+ * @return index of the comma ending the field, or size for the last field
  */
-inline int processCsvFields(string &line, vector <string> &fields) {
-    int fieldCnt = 0;
+inline size_t parseCsvField(const char *line, size_t index, size_t size, Field *pfield) {
     bool gotNonBlank;   // true whenever: encountered a none whitespace
     bool quoteMode;     // true when leading (non-white?) character is a double quote, flipped by another standalone double quote
 
-    int index = 0;
-    size_t size = line.size();
-
-    string *pfield = get_nth(fields, fieldCnt++);
-    pfield->clear();
     // peek one to check if it's quoteMode
     // but first, if needTrim, let's trim first, this takes care of $',   "real thing" ...,' case.
     if (needTrim) {
-        while (index < size) {
-            if (isspace(line[index])) index++;
-            else break;
-        }
+        while (index < size && isspace(line[index])) index++;
     }
     if (index < size && line[index] == Quote) {
         quoteMode = true;
@@ -361,156 +484,387 @@ inline int processCsvFields(string &line, vector <string> &fields) {
     gotNonBlank = false;
 
     while (index < size) {
-        char cc = line[index++];
         if (quoteMode) {
+            // take everything up to the next quote or escape
+            size_t next = index;
+            while (next < size && line[next] != Quote && line[next] != EscapeChar) next++;
+            takeRun(pfield, line, index, next, gotNonBlank);
+            index = next;
+            if (index == size) break;
+
+            char cc = line[index++];
             // be careful, now usually the EscapeChar is same as Quote
             if (cc == EscapeChar) {
-                // if (!isspace(EscapeChar)) gotNonBlank = true;
                 // peek one more character, see if we should escape
                 if (index < size && line[index] == Quote) {
                     // yes, escape, consume it and advance
-                    index++;
                     gotNonBlank = true;     // sure Quote is non-space, otherwise ...
-                    pfield->push_back(Quote);
+                    appendToField(pfield, line, index, index + 1);
+                    index++;
+                } else if (EscapeChar == Quote) {
+                    // no escape, but it's Quote itself, don't modify gotNonBlank yet, one trivial case
+                    quoteMode = false;
                 } else {
-                    // no escape, but it may be Quote itself
-                    if (EscapeChar == Quote) {
-                        // don't modify gotNonBlank yet, one trivial case
-                        quoteMode = false;
-                    } else {
-                        gotNonBlank = true;     // sure EscapeChar is non-space, otherwise ...
-                        pfield->push_back(cc);
-                    }
-                }
-            } else {
-                if (cc == Quote) quoteMode = false;
-                else {
-                    // take it
-                    if (isspace(cc)) {
-                        if (!needTrim || gotNonBlank) {
-                            // if (cc == TAB) pfield->append(pSubst);
-                            // else pfield->push_back(cc);
-                            pfield->push_back(cc);
-                        }
-                    } else {
-                        gotNonBlank = true;
-                        pfield->push_back(cc);
-                    }
+                    gotNonBlank = true;     // sure EscapeChar is non-space, otherwise ...
+                    appendToField(pfield, line, index - 1, index);
                 }
-            }
+            } else quoteMode = false;   // cc == Quote
         } else {
             // just charge on till separator, COMMA
-            if (cc == COMMA) {
-                // end of field, trimming (just end)
-                if (needTrim)
-                    pfield->erase(find_if(pfield->rbegin(), pfield->rend(), [](int ch) { return !isspace(ch); }).base(),
-                                  pfield->end());
-                // start new field
-                pfield = get_nth(fields, fieldCnt++);
-                pfield->clear();
-                // peek one to check if it's quoteMode
-                // but first, if needTrim, let's trim first, this takes care of $',   "real thing" ...,' case.
-                if (needTrim) {
-                    while (index < size) {
-                        if (isspace(line[index])) index++;
-                        else break;
-                    }
-                }
-                if (index < size && line[index] == Quote) {
-                    quoteMode = true;
-                    index++;
-                } else quoteMode = false;
-                gotNonBlank = false;
-            } else {
-                // take it
-                if (isspace(cc)) {
-                    if (!needTrim || gotNonBlank) {
-                        // if (cc == TAB) pfield->append(pSubst);
-                        // else pfield->push_back(cc);
-                        pfield->push_back(cc);
-                    }
-                } else {
-                    gotNonBlank = true;
-                    pfield->push_back(cc);
-                }
-            }
+            const char *comma = (const char *) memchr(line + index, COMMA, size - index);
+            size_t next = comma != nullptr ? comma - line : size;
+            takeRun(pfield, line, index, next, gotNonBlank);
+            index = next;
+            break;
         }
     }
 
-    // fix last field, trimming (just end)
-    if (needTrim)
-        pfield->erase(find_if(pfield->rbegin(), pfield->rend(), [](int ch) { return !isspace(ch); }).base(),
-                      pfield->end());
+    // end of field, trimming (just end)
+    trimFieldEnd(pfield);
+    return index;
+}
+
+/**
+ * process input line, transforming from csv to tsv, into fields, one parseCsvField after another
+ * @param line
+ * @param size
+ * @param fields
+ * @return
+ */
+inline int processCsvFieldsScalar(const char *line, size_t size, vector <Field> &fields) {
+    int fieldCnt = 0;
+    size_t index = 0;
+
+    while (true) {
+        Field *pfield = get_nth(fields, fieldCnt++, line + index);
+        index = parseCsvField(line, index, size, pfield);
+        if (index == size) break;
+        index++;    // the comma
+    }
     return fieldCnt;
 }
 
+/**
+ * process input line, transforming from csv to tsv, into fields, the structural way:
+ * CsvSeparators finds the commas outside quotes from SIMD bit masks of commas and quotes,
+ * the fields without a quote are just trimmed views, and only fields with a quote go
+ * through parseCsvField, for the escapes.
+ * The quote parity doesn't always agree with parseCsvField: to it a quote that doesn't
+ * start a field is just a character, and so is a quote after a -e escape. So each quoted
+ * field has to end right where the scan said, otherwise the line is done again by
+ * processCsvFieldsScalar, and the fields always come out the same as from it.
+ * @param line
+ * @param size
+ * @param fields
+ * @return
+ */
+inline int processCsvFields(const char *line, size_t size, vector <Field> &fields) {
+    static thread_local vector <size_t> separators(256);
+    int quoted;
+    size_t num;
+    while ((num = CsvSeparators(line, size, COMMA, Quote, separators.data(), separators.size(), &quoted)) ==
+           separators.size())
+        separators.resize(separators.size() * 2);
+
+    size_t index = 0;
+    for (size_t k = 0; k <= num; k++) {
+        size_t end = k < num ? separators[k] : size;
+        Field *pfield = get_nth(fields, k, line + index);
+        if (quoted && memchr(line + index, Quote, end - index) != nullptr) {
+            if (parseCsvField(line, index, size, pfield) != end) return processCsvFieldsScalar(line, size, fields);
+        } else setTrimmedField(pfield, line, index, end);
+        index = end + 1;
+    }
+    return num + 1;
+}
+
 /**
  * copied from processTsvFields, but simply just separate and construct fields
  * Turns out to be exactly the same as processTsvFields
  * let's use global delim instead of passing it
  * without any special caring.
+ * Every field is a view into line, trimming just moves its ends.
  * @param line
+ * @param size
  * @param fields
  * @return
  */
-inline int processGeneralFields(string &line, vector <string> &fields) {
+inline int processGeneralFields(const char *line, size_t size, vector <Field> &fields) {
     int fieldCnt = 0;
-    bool gotNonBlank;   // true whenever: encountered a none whitespace
-
-    string *pfield = get_nth(fields, fieldCnt++);
-    pfield->clear();
-    gotNonBlank = false;
+    size_t index = 0;
 
-    int index = 0;
-    size_t size = line.size();
-    while (index < size) {
-        char cc = line[index++];
-        if (cc == delim) {
-            // end of current field, fix the field, trimming (just end)
-            if (needTrim)
-                pfield->erase(find_if(pfield->rbegin(), pfield->rend(), [](int ch) { return !isspace(ch); }).base(),
-                              pfield->end());
-
-            // start new field
-            pfield = get_nth(fields, fieldCnt++);
-            pfield->clear();
-            gotNonBlank = false;
-        } else {
-            if (isspace(cc)) {
-                if (!needTrim || gotNonBlank) pfield->push_back(cc);
-            } else {
-                gotNonBlank = true;
-                pfield->push_back(cc);
-            }
-        }
+    while (true) {
+        const char *end = (const char *) memchr(line + index, delim, size - index);
+        size_t next = end != nullptr ? end - line : size;
+        setTrimmedField(get_nth(fields, fieldCnt++, line + index), line, index, next);
+        if (end == nullptr) break;
+        index = next + 1;
     }
-
-    // fix last field, trimming (just end) and/or quoting
-    if (needTrim)
-        pfield->erase(find_if(pfield->rbegin(), pfield->rend(), [](int ch) { return !isspace(ch); }).base(),
-                      pfield->end());
     return fieldCnt;
 }
 
 /**
  * process the fields to update minfl, maxfl, fieldcount and fieldtotalbytes vectors
- * Note fields will be destroyed if it's taken as a sample. So be careful!
+ * @param p
  * @param fields
  * @param row_count the actual count of fields, not the size, since it's reused.
  */
-inline void processFields(vector <string> &fields, int row_count) {
+inline void processFields(Profile &p, vector <Field> &fields, int row_count) {
     for (int k = 0; k < row_count; k++) {
-        size_t size = fields[k].size();
-        if (minfl[k] > size) minfl[k] = size;
-        if (maxfl[k] < size) maxfl[k] = size;
-        fieldcount[k]++;
-        if (!fields[k].empty()) fieldfillcount[k]++;
-        fieldtotalbytes[k] += size;
+        size_t size = fields[k].size;
+        if (p.minfl[k] > size) p.minfl[k] = size;
+        if (p.maxfl[k] < size) p.maxfl[k] = size;
+        p.fieldcount[k]++;
+        if (size != 0) p.fieldfillcount[k]++;
+        p.fieldtotalbytes[k] += size;
+        if (distinct_flag) HllAdd(&p.distinct[k], HllHash(fields[k].data, size));
         // vector <string> &samples = sampleFields[k];
-        if (needSampleCol) tryAddSample(sampleFields[k], numSampleCol, fields[k], fieldcount[k]);
+        if (needSampleCol) tryAddSample(p.sampleFields[k], numSampleCol, fields[k].data, size, p.fieldcount[k], p.rng);
+    }
+}
+
+/**
+ * process one input line (record), without its ending newline, into p
+ * @param p
+ * @param line
+ * @param length
+ * @param fields reused between calls, the fields are views into line
+ */
+inline void processLine(Profile &p, const char *line, size_t length, vector <Field> &fields) {
+    // process file size, line length min/max, line count
+    size_t size = length + 1;
+    p.fsize += size;
+    if (p.lmax < size) p.lmax = size;
+    if (p.lmin > size) p.lmin = size;
+    p.lcnt++;
+
+    // explode line into fields
+    int row_count = pprocess(line, length, fields);
+
+    // process field per line min/max, total fields
+    // size_t num = fields.size();
+    if (p.minfpl > row_count) p.minfpl = row_count;
+    if (p.maxfpl < row_count) p.maxfpl = row_count;
+    p.fieldtotal += row_count;
+    if (row_count > p.minfl.size()) initializeFieldCounters(p, row_count);
+    // in case we have more fields
+
+    // process each field, also gather the sample of fields.
+    processFields(p, fields, row_count);
+
+    // gather sample records.
+    if (needSampleRow) tryAddSample(p.sampleRecs, numSampleRec, line, length, p.lcnt, p.rng);
+}
+
+/**
+ * merge reservoir b, a sample of bTotal elements, into reservoir a, a sample of aTotal,
+ * so a becomes a sample of all aTotal + bTotal. Each pick is taken out of a or b with
+ * probability in proportion to how many elements that side still stands for, which keeps
+ * every element equally likely, as if one reservoir had seen them all.
+ * @param a
+ * @param aTotal
+ * @param b is emptied
+ * @param bTotal
+ * @param sampleCnt is the supposed size of the samples
+ * @param rng
+ */
+void mergeSamples(vector <string> &a, int64_t aTotal, vector <string> &b, int64_t bTotal, int sampleCnt,
+                  mt19937 &rng) {
+    vector <string> merged;
+    while (merged.size() < sampleCnt && (!a.empty() || !b.empty())) {
+        bool fromA = b.empty() ||
+                     (!a.empty() && uniform_int_distribution<int64_t>(0, aTotal + bTotal - 1)(rng) < aTotal);
+        vector <string> &from = fromA ? a : b;
+        size_t index = uniform_int_distribution<size_t>(0, from.size() - 1)(rng);
+        merged.push_back(move(from[index]));
+        from[index].swap(from.back());
+        from.pop_back();
+        if (fromA) aTotal--;
+        else bTotal--;
+    }
+    a.swap(merged);
+    b.clear();
+}
+
+/**
+ * fold profile b, of another part of the input, into a. The counters are exact,
+ * the samples are merged with mergeSamples, the distinct sketches register by register.
+ * @param a
+ * @param b is left without its samples
+ */
+void mergeProfile(Profile &a, Profile &b) {
+    if (needSampleRow) mergeSamples(a.sampleRecs, a.lcnt, b.sampleRecs, b.lcnt, numSampleRec, a.rng);
+    a.fsize += b.fsize;
+    a.lmax = max(a.lmax, b.lmax);
+    a.lmin = min(a.lmin, b.lmin);
+    a.lcnt += b.lcnt;
+    a.minfpl = min(a.minfpl, b.minfpl);
+    a.maxfpl = max(a.maxfpl, b.maxfpl);
+    a.fieldtotal += b.fieldtotal;
+
+    initializeFieldCounters(a, b.minfl.size());
+    for (int k = 0; k < b.minfl.size(); k++) {
+        if (needSampleCol)
+            mergeSamples(a.sampleFields[k], a.fieldcount[k], b.sampleFields[k], b.fieldcount[k], numSampleCol,
+                         a.rng);
+        a.minfl[k] = min(a.minfl[k], b.minfl[k]);
+        a.maxfl[k] = max(a.maxfl[k], b.maxfl[k]);
+        a.fieldcount[k] += b.fieldcount[k];
+        a.fieldfillcount[k] += b.fieldfillcount[k];
+        a.fieldtotalbytes[k] += b.fieldtotalbytes[k];
+        if (distinct_flag) HllMerge(&a.distinct[k], &b.distinct[k]);
     }
 }
 
+/**
+ * one -j thread's part of the file, [start, end), starting at a line start
+ */
+struct ProfileJob {
+    int fd;
+    int64_t start;
+    int64_t end;
+    Profile prof;
+    int status = 0;
+    bool started = false;
+    pthread_t thread;
+};
+
+/**
+ * find the first newline at or after offset from
+ * @param fd
+ * @param from
+ * @param end where to give up
+ * @return offset of the newline, end if there's none before it, -1 on read error
+ */
+int64_t findNewline(int fd, int64_t from, int64_t end) {
+    char buf[64 * 1024];
+    while (from < end) {
+        ssize_t n = pread(fd, buf, min((int64_t) sizeof(buf), end - from), from);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return n < 0 ? -1 : end;
+        char *nl = (char *) memchr(buf, '\n', n);
+        if (nl != nullptr) return from + (nl - buf);
+        from += n;
+    }
+    return end;
+}
+
+/**
+ * thread body for -j, read the lines of [start, end) with pread and profile them into job->prof
+ * @param arg ProfileJob
+ * @return nullptr
+ */
+void *profileChunk(void *arg) {
+    ProfileJob *job = (ProfileJob *) arg;
+    vector<char> buf(ReadBufSize);
+    vector <Field> fields;
+    size_t have = 0;
+    int64_t offset = job->start;
+
+    while (offset < job->end || have > 0) {
+        if (offset < job->end) {
+            if (have == buf.size()) buf.resize(buf.size() * 2);     // a line longer than the buffer
+            ssize_t n = pread(job->fd, buf.data() + have, min((int64_t) (buf.size() - have), job->end - offset),
+                              offset);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) {
+                if (n < 0) perror("get-fs");
+                job->status = -1;
+                break;
+            }
+            offset += n;
+            have += n;
+        }
+
+        char *p = buf.data();
+        char *bufEnd = p + have;
+        char *nl;
+        while ((nl = (char *) memchr(p, '\n', bufEnd - p)) != nullptr) {
+            processLine(job->prof, p, nl - p, fields);
+            p = nl + 1;
+        }
+        if (offset == job->end && p < bufEnd) {
+            // the last line of the file, without a newline, counts like getline counts it
+            processLine(job->prof, p, bufEnd - p, fields);
+            p = bufEnd;
+        }
+        have = bufEnd - p;
+        memmove(buf.data(), p, have);
+    }
+    return nullptr;
+}
+
+/**
+ * read the first line of the regular file fd, from its current offset, the way getline would
+ * @param fd
+ * @param line
+ * @return offset of the line after it, -1 on read error
+ */
+int64_t readFirstLine(int fd, string &line) {
+    struct stat st;
+    if (fstat(fd, &st) != 0) return -1;
+    int64_t start = lseek(fd, 0, SEEK_CUR);     // what's before was read by someone else
+    if (start < 0 || start > st.st_size) start = 0;
+    int64_t nl = findNewline(fd, start, st.st_size);
+    if (nl < 0) return -1;
+    line.resize(nl - start);
+    if (nl > start && pread(fd, &line[0], nl - start, start) != nl - start) return -1;
+    return min(nl + 1, (int64_t) st.st_size);
+}
+
+/**
+ * the -j pass: cut the regular file fd from start on at line boundaries into one part
+ * per thread, profile the parts and merge them into prof. The first part runs on this
+ * thread, a part whose thread fails to start runs here too.
+ * @param fd
+ * @param start offset of the first record, past the header
+ * @param prof
+ * @return 0 on success, -1 on read error
+ */
+int profileFile(int fd, int64_t start, Profile &prof) {
+    struct stat st;
+    if (fstat(fd, &st) != 0) return -1;
+    int64_t size = st.st_size;
+    if (start < 0 || start > size) start = size;
+
+    int numThreads = numJobs;
+    if (numThreads > (size - start) / MinChunkSize) numThreads = (int) ((size - start) / MinChunkSize);
+    if (numThreads < 1) numThreads = 1;
+    vector <ProfileJob> jobs(numThreads);
+    int64_t begin = start;
+    for (int t = 0; t < numThreads; t++) {
+        int64_t end = size;
+        if (t + 1 < numThreads) {
+            end = start + (size - start) / numThreads * (t + 1);
+            if (end <= begin) end = begin;
+            else {
+                end = findNewline(fd, end - 1, size);
+                if (end < 0) return -1;
+                end = min(end + 1, size);
+            }
+        }
+        jobs[t].fd = fd;
+        jobs[t].start = begin;
+        jobs[t].end = end;
+        begin = end;
+    }
+
+    for (int t = 1; t < numThreads; t++)
+        jobs[t].started = pthread_create(&jobs[t].thread, nullptr, profileChunk, &jobs[t]) == 0;
+    profileChunk(&jobs[0]);
+    for (int t = 1; t < numThreads; t++) {
+        if (jobs[t].started) pthread_join(jobs[t].thread, nullptr);
+        else profileChunk(&jobs[t]);
+    }
+
+    int status = 0;
+    for (int t = 0; t < numThreads; t++) {
+        if (jobs[t].status != 0) status = -1;
+        mergeProfile(prof, jobs[t].prof);
+    }
+    return status;
+}
+
 int main(int argc, char **argv) {
     if (getCmdOptions(argc, argv) != 0 || (headerFile.empty() && !inFileHeader)) {
         printf(usage, argv[0]);
@@ -519,7 +873,6 @@ int main(int argc, char **argv) {
     needSampleRow = numSampleRec != 0;
     needSampleCol = numSampleCol != 0;
 
-    int (*pprocess)(string &, vector <string> &);
     if (delim == COMMA) pprocess = processCsvFields;
     else pprocess = processGeneralFields;
 
@@ -532,7 +885,12 @@ int main(int argc, char **argv) {
 
     string line;
     vector <string> header;
-    vector <string> fields;
+    vector <Field> fields;
+    Profile prof;
+    // -j reads stdin with pread, so it has to be a regular file, anything else is read serially
+    struct stat st;
+    bool parallel = numJobs > 1 && fstat(0, &st) == 0 && S_ISREG(st.st_mode);
+    int64_t dataStart = parallel ? lseek(0, 0, SEEK_CUR) : 0;
     // read the header
     if (!inFileHeader) {
         ifstream hFile(headerFile);
@@ -544,10 +902,17 @@ int main(int argc, char **argv) {
         }
         getline(hFile, line);
         hFile.close();
+    } else if (parallel) {
+        dataStart = readFirstLine(0, line);
     } else {
         getline(cin, line);
     }
-    pprocess(line, header);
+    if (dataStart < 0) {
+        perror("failed to read stdin");
+        return -1;
+    }
+    int headerCnt = pprocess(line.data(), line.size(), fields);
+    for (int k = 0; k < headerCnt; k++) header.emplace_back(fields[k].data, fields[k].size);
 
     size_t fieldNum = header.size();
     // note for (auto f:header) still copies, it's also with for (auto &f:header).
@@ -557,47 +922,30 @@ int main(int argc, char **argv) {
             return 0;
         }
     }
-    initializeFieldCounters(fieldNum);
+    initializeFieldCounters(prof, fieldNum);
 
     // process input, line (record) by line (record)
-    while (getline(cin, line)) {
-        // process file size, line length min/max, line count
-        size_t size = line.size() + 1;
-        fsize += size;
-        if (lmax < size) lmax = size;
-        if (lmin > size) lmin = size;
-        lcnt++;
-
-        // explode line into fields
-        int row_count = pprocess(line, fields);
-
-        // process field per line min/max, total fields
-        // size_t num = fields.size();
-        if (minfpl > row_count) minfpl = row_count;
-        if (maxfpl < row_count) maxfpl = row_count;
-        fieldtotal += row_count;
-        if (row_count > minfl.size()) initializeFieldCounters(row_count);
-        // in case we have more fields
-
-        // process each field, also gather the sample of fields.
-        processFields(fields, row_count);
-
-        // gather sample records.
-        if (needSampleRow) tryAddSample(sampleRecs, numSampleRec, line, lcnt);
+    if (parallel) {
+        if (profileFile(0, dataStart, prof) != 0) {
+            perror("failed to read stdin");
+            return -1;
+        }
+    } else {
+        while (getline(cin, line)) processLine(prof, line.data(), line.size(), fields);
     }
 
     // let's shuffle the samples
-    if (needSampleRow) shuffle(sampleRecs.begin(), sampleRecs.end(), mt19937(random_device()()));
+    if (needSampleRow) shuffle(prof.sampleRecs.begin(), prof.sampleRecs.end(), mt19937(random_device()()));
     if (needSampleCol) {
-        for (int k = 0; k < sampleFields.size(); k++)
-            shuffle(sampleFields[k].begin(), sampleFields[k].end(), mt19937(random_device()()));
+        for (int k = 0; k < prof.sampleFields.size(); k++)
+            shuffle(prof.sampleFields[k].begin(), prof.sampleFields[k].end(), mt19937(random_device()()));
     }
     // duration time
     // chrono::time_point <chrono::system_clock> end = chrono::system_clock::now();
     // auto millis = chrono::duration_cast<chrono::milliseconds>(end - start).count();
     time(&endtime);
 
-    if (lcnt < 1) {
+    if (prof.lcnt < 1) {
         cout << "There's no record at all" << endl;
     } else {
         printf("** File Report **\n");
@@ -605,37 +953,39 @@ int main(int argc, char **argv) {
         printf("Processor: [%s]\n", hostname);
         printf("-----------------\n");
         printf("Lines\tBytes\n");
-        printf("%lld\t%lld\n\n", lcnt, fsize);
+        printf("%lld\t%lld\n\n", prof.lcnt, prof.fsize);
 
         printf("** Line Length Report **\n");
         printf("------------------------\n");
         printf("Min\tMax\tAvg\n");
-        printf("%lld\t%lld\t%-.02f\n\n", lmin, lmax, (double) fsize / lcnt);
+        printf("%lld\t%lld\t%-.02f\n\n", prof.lmin, prof.lmax, (double) prof.fsize / prof.lcnt);
 
         printf("** Field Inspection Report (FPL = Fields Per Line) **\n");
         printf("----------------------------------------------------\n");
         printf("MinFPL\tMaxFPL\tAvgFPL\n");
-        printf("%lld\t%lld\t%-.02f\n\n", minfpl, maxfpl, (double) fieldtotal / lcnt);
+        printf("%lld\t%lld\t%-.02f\n\n", prof.minfpl, prof.maxfpl, (double) prof.fieldtotal / prof.lcnt);
 
         printf("** Field Content Report (Asterisk next to Ctr means field is same length in all lines; FR=Fill Rate) **\n");
         printf("-----------------------------------------------------------------------------------------\n");
-        printf("FieldNum\tColName\tMinLen\tMaxLen\tAvgLen\tFRCtr\tFRPctg\tByteCtr\tBytePctg\n\n");
+        printf("FieldNum\tColName\tMinLen\tMaxLen\tAvgLen\tFRCtr\tFRPctg\tByteCtr\tBytePctg%s\n\n",
+               distinct_flag ? "\tDistinct" : "");
 
         int k;
-        for (int i = 0; i < maxfpl; i++) {
-            printf("%d%c\t", i + 1, minfl[i] == maxfl[i] ? '*' : ' ');
+        for (int i = 0; i < prof.maxfpl; i++) {
+            printf("%d%c\t", i + 1, prof.minfl[i] == prof.maxfl[i] ? '*' : ' ');
             if (i < header.size()) cout << header[i];
             cout << "\t";
-            printf("%lld\t%lld\t%-.02f\t%lld\t%-.02f", minfl[i], maxfl[i], (double) fieldtotalbytes[i] / lcnt,
-                   fieldfillcount[i], (double) fieldfillcount[i] / lcnt * 100.0);
-            printf("\t%lld\t%-.02f", fieldtotalbytes[i], (double) fieldtotalbytes[i] / fsize * 100);
+            printf("%lld\t%lld\t%-.02f\t%lld\t%-.02f", prof.minfl[i], prof.maxfl[i],
+                   (double) prof.fieldtotalbytes[i] / prof.lcnt, prof.fieldfillcount[i], (double) prof.fieldfillcount[i] / prof.lcnt * 100.0);
+            printf("\t%lld\t%-.02f", prof.fieldtotalbytes[i], (double) prof.fieldtotalbytes[i] / prof.fsize * 100);
+            if (distinct_flag) printf("\t%.0f", HllEstimate(&prof.distinct[i]));
             if (needSampleCol) {
                 cout << "\t<=>\t";
                 k = 0;
-                for (; k < sampleFields[i].size() - 1; k++) {
-                    cout << sampleFields[i][k] << TAB;
+                for (; k < prof.sampleFields[i].size() - 1; k++) {
+                    cout << prof.sampleFields[i][k] << TAB;
                 }
-                if (k < sampleFields[i].size()) cout << sampleFields[i][k];
+                if (k < prof.sampleFields[i].size()) cout << prof.sampleFields[i][k];
             };
             cout << endl;
         }
@@ -648,7 +998,7 @@ int main(int argc, char **argv) {
             }
             if (k < header.size()) cout << header[k];
             cout << endl;
-            for (k = 0; k < sampleRecs.size(); k++) cout << sampleRecs[k] << endl;
+            for (k = 0; k < prof.sampleRecs.size(); k++) cout << prof.sampleRecs[k] << endl;
         }
     }
     cout << endl << "Processing time: " << difftime(endtime, starttime) << " seconds." << endl;
@@ -1,35 +1,275 @@
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include "vcount.h"
+#include "vlineidx.h"
+#include "vsample.h"
+#include "vstrata.h"
 #include "vstrutils.h"
 
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
 #include <sys/time.h>
+#include <sys/stat.h>
 
 #define MAXLINE (128 * 1024)
 
+#define SWEEP_BUFSIZE     (8 * 1024 * 1024)   // the most --batch reads at once
+#define SWEEP_MIN_READ    (64 * 1024)         // and the least, so short lines don't cost a read each
+#define STREAM_BUFSIZE    (1024 * 1024)       // read per step by --stream, grown for longer lines
+#define STREAM_MIN_SHARE  (64 * 1024 * 1024)  // don't start a --stream thread for less than this
+#define BATCH_MIN_DRAW(n) ((n) / 16 + 4096)   // the fewest bytes drawn in a round of --batch without an index
+
+/*
+   A window on the file for reading it in ascending order, as --batch
+   does. Each read covers as many of the coming samples as fit.
+*/
+struct Sweep {
+  int Fd;
+  off_t FileSize;
+  char *Buf;
+  off_t WinStart;
+  size_t WinLen;
+};
+
+/*
+   One sampled line.
+*/
+struct Pick {
+  off_t Start;
+  off_t Len;
+};
+
+/*
+   One --stream reader: a reservoir over the lines that start in
+   [Start, End) of the file, or over all of a pipe when End is -1.
+*/
+struct StreamJob {
+  int Fd;
+  off_t Start;
+  off_t End;
+  uint64_t Rng;
+  struct Reservoir R;
+  int Started;
+  int Status;
+};
+
+int PrintRange (int Fd, off_t Start, off_t Len, char *Buf, size_t BufLen);
+uint64_t RandomBelow (uint64_t n);
+int BatchSample (int Fd, off_t FileSize, struct LineIndex *Idx, int64_t Count, int Shuffle);
+int64_t DrawDistinct (uint64_t *Draws, int64_t Count, uint64_t Range);
+int64_t PickIndexedLines (struct LineIndex *Idx, int64_t Count, struct Pick *Picks);
+int64_t PickSeekLines (struct Sweep *S, int64_t Count, struct Pick *Picks);
+char *SweepFetch (struct Sweep *S, off_t Off, size_t Need, off_t Through, size_t *Avail);
+off_t SweepFindNewline (struct Sweep *S, off_t From, off_t Through);
+int StreamSample (int Fd, int NumThreads, int Count);
+int FractionSample (int Fd, double Fraction, uint64_t *Rng);
+int StrataSample (int Fd, int *Fields, int NumFields, char *DelimChrs, int K, uint64_t *Rng);
+int StrataKey (char *Line, size_t Len, int *Fields, int NumFields, char *IsDelim, char **Key, size_t *KeyCap, size_t *KeyLen);
+void *StreamThread (void *arg);
+int CompareOffsets (const void *a, const void *b);
+int ComparePicks (const void *a, const void *b);
+
 int main (int argc, char **argv)
 {
   FILE *fp;
   off_t filelen;
   int i;
-  int ctr;
+  int j;
+  int ctr = 0;
   char Line [MAXLINE + 1];
+  int BuildIndex = 0;
+  int Batch = 0;
+  int Shuffle = 0;
+  int Stream = 0;
+  int NumThreads = 0;
+  int UseFraction = 0;
+  double Fraction = 0;
+  int Seeded = 0;
+  unsigned long long Seed = 0;
+  uint64_t Rng;
+  int *StrataFields = NULL;
+  int NumStrataFields = 0;
+  int PerKey = 0;
+  char *DelimChrs = "\t";
+  int Fd;
+  int Status;
+  char *IndexName = NULL;
+  char *DefaultIndexName;
+  struct LineIndex Idx;
+  struct stat St;
+  off_t Start;
+  off_t Len;
+
+  for (j = 1; (j < argc) && (argv [j][0] == '-') && (argv [j][1] != '\0'); j++) {
+    if (strcmp (argv [j], "--build-index") == 0) BuildIndex = 1;
+    else if (strncmp (argv [j], "--index=", 8) == 0) IndexName = argv [j] + 8;
+    else if (strcmp (argv [j], "--batch") == 0) Batch = 1;
+    else if (strcmp (argv [j], "--shuffle") == 0) Batch = Shuffle = 1;
+    else if (strcmp (argv [j], "--stream") == 0) Stream = 1;
+    else if (strncmp (argv [j], "--jobs=", 7) == 0) NumThreads = atoi (argv [j] + 7);
+    else if (strncmp (argv [j], "--fraction=", 11) == 0) {
+      UseFraction = 1;
+      Fraction = ParsePercent (argv [j] + 11);
+    }
+    else if (strncmp (argv [j], "--seed=", 7) == 0) {
+      Seeded = 1;
+      Seed = strtoull (argv [j] + 7, NULL, 0);
+    }
+    else if (strncmp (argv [j], "--strata=", 9) == 0) {
+      if (ParseFieldList (argv [j] + 9, &StrataFields, &NumStrataFields) != 0) {
+        j = argc;
+        break;
+      }
+    }
+    else if ((j + 1 < argc) && (strcmp (argv [j], "-k") == 0)) PerKey = atoi (argv [++j]);
+    else if ((j + 1 < argc) && (strcmp (argv [j], "-d") == 0)) DelimChrs = argv [++j];
+    else {
+      j = argc;
+      break;
+    }
+  }
 
-  if (argc < 3) {
-    fprintf (stderr, "Usage: %s [file] [#lines]\n\n", argv [0]);
+  if ((j >= argc) || (j + 2 < argc) || ((!BuildIndex) && (!UseFraction) && (StrataFields == NULL) && (j + 2 != argc)) ||
+      (UseFraction && ((j + 1 != argc) || (Fraction < 0) || (Fraction > 1))) ||
+      ((StrataFields != NULL) && ((j + 1 != argc) || (PerKey <= 0)))) {
+    fprintf (stderr, "Usage: %s {opts} [file] [#lines]\n", argv [0]);
+    fprintf (stderr, "  {opts} :: --build-index - write an index of line offsets next to the file (file%s), no #lines.\n", LINE_INDEX_SUFFIX);
+    fprintf (stderr, "                            later runs pick lines from it, exactly uniformly.\n");
+    fprintf (stderr, "            --index=x - the index to build or use, instead of file%s\n", LINE_INDEX_SUFFIX);
+    fprintf (stderr, "            --batch - no line twice, read in one pass through the file, output in file order.\n");
+    fprintf (stderr, "            --shuffle - like --batch, but output in random order. holds the sample in memory\n");
+    fprintf (stderr, "            --stream - read the input once, from start to end, and keep a uniform sample. works on\n");
+    fprintf (stderr, "                       pipes, file - is stdin. holds the sample in memory\n");
+    fprintf (stderr, "            --jobs=x - with --stream on a file, read it with x threads. default is one per cpu\n");
+    fprintf (stderr, "            --fraction=p - instead of #lines, each line with probability p (0.01 or 1%%), in file order.\n");
+    fprintf (stderr, "                           works on pipes, file - is stdin\n");
+    fprintf (stderr, "            --seed=x - the same x gives the same sample of the same input\n");
+    fprintf (stderr, "            --strata=x,y -k n - instead of #lines, up to n lines for each value of fields x,y (from 0),\n");
+    fprintf (stderr, "                                in one pass. works on pipes, file - is stdin\n");
+    fprintf (stderr, "            -d xyz - with --strata, fields are delimited by any of xyz. default tab\n\n");
     return (-1);
   }
 
-  ctr = atoi (argv [2]);
+  if (j + 2 == argc) ctr = atoi (argv [j + 1]);
+
+  if (Seeded) srandom ((unsigned) (Seed ^ (Seed >> 32)));
+  else srandom (time(NULL) ^ getpid());
+
+  if (StrataFields != NULL) {
+    Fd = (strcmp (argv [j], "-") == 0) ? 0 : open (argv [j], O_RDONLY);
+    if (Fd < 0) {
+      fprintf (stderr, "Can't open [%s]\n", argv [j]);
+      perror (NULL);
+      return (-1);
+    }
+    Rng = (Seeded) ? Seed : ((uint64_t) random () << 32) ^ (uint64_t) random ();
+    Status = StrataSample (Fd, StrataFields, NumStrataFields, DelimChrs, PerKey, &Rng);
+    if (Status != 0) perror ("rnd-extract");
+    if (Fd != 0) close (Fd);
+    free (StrataFields);
+    return (Status);
+  }
+
+  if (UseFraction) {
+    Fd = (strcmp (argv [j], "-") == 0) ? 0 : open (argv [j], O_RDONLY);
+    if (Fd < 0) {
+      fprintf (stderr, "Can't open [%s]\n", argv [j]);
+      perror (NULL);
+      return (-1);
+    }
+    Rng = (Seeded) ? Seed : ((uint64_t) random () << 32) ^ (uint64_t) random ();
+    Status = FractionSample (Fd, Fraction, &Rng);
+    if (Status != 0) perror ("rnd-extract");
+    if (Fd != 0) close (Fd);
+    return (Status);
+  }
 
-  fp = fopen (argv [1], "rb");
+  if (Stream) {
+    Fd = (strcmp (argv [j], "-") == 0) ? 0 : open (argv [j], O_RDONLY);
+    if (Fd < 0) {
+      fprintf (stderr, "Can't open [%s]\n", argv [j]);
+      perror (NULL);
+      return (-1);
+    }
+    if (NumThreads <= 0) NumThreads = (int) sysconf (_SC_NPROCESSORS_ONLN);
+    Status = StreamSample (Fd, NumThreads, ctr);
+    if (Status != 0) perror ("rnd-extract");
+    if (Fd != 0) close (Fd);
+    return (Status);
+  }
+
+  fp = fopen (argv [j], "rb");
   if (!fp) {
-    fprintf (stderr, "Can't open [%s]\n", argv [1]);
+    fprintf (stderr, "Can't open [%s]\n", argv [j]);
     perror (NULL);
     return (-1);
   }
 
-  srandom (time(NULL) ^ getpid());
+  DefaultIndexName = (char *) malloc (strlen (argv [j]) + strlen (LINE_INDEX_SUFFIX) + 1);
+  sprintf (DefaultIndexName, "%s%s", argv [j], LINE_INDEX_SUFFIX);
+
+  if (BuildIndex) {
+    if ((fstat (fileno (fp), &St) != 0) ||
+        (LineIndexBuild (fileno (fp), &St, (IndexName != NULL) ? IndexName : DefaultIndexName) != 0)) {
+      fprintf (stderr, "Can't build index [%s]\n", (IndexName != NULL) ? IndexName : DefaultIndexName);
+      perror (NULL);
+      fclose (fp);
+      return (-1);
+    }
+    fclose (fp);
+    return (0);
+  }
+
+  /*
+     With an index each line is equally likely. Without one it's a random
+     byte and the line after it, which favours lines that follow long ones.
+     The file's own index is used when it is there and current; one named
+     with --index has to be.
+  */
+  Idx.Map = NULL;
+  if (fstat (fileno (fp), &St) == 0) {
+    if (LineIndexOpen (&Idx, (IndexName != NULL) ? IndexName : DefaultIndexName, &St) != 0) {
+      if ((IndexName != NULL) || (errno != ENOENT)) {
+        fprintf (stderr, "Can't use index [%s]%s\n", (IndexName != NULL) ? IndexName : DefaultIndexName,
+                 (errno == ESTALE) ? ", the file changed since it was built, rerun --build-index" : "");
+        if (errno != ESTALE) perror (NULL);
+        if (IndexName != NULL) {
+          fclose (fp);
+          return (-1);
+        }
+      }
+    }
+  }
+
+  if (Batch) {
+    Status = BatchSample (fileno (fp), St.st_size, (Idx.Map != NULL) ? &Idx : NULL, ctr, Shuffle);
+    if (Status != 0) perror ("rnd-extract");
+    if (Idx.Map != NULL) LineIndexClose (&Idx);
+    fclose (fp);
+    return (Status);
+  }
+
+  if (Idx.Map != NULL) {
+    if (Idx.NumLines > 0) {
+      for (i = 0; i < ctr; i++) {
+        LineIndexLookup (&Idx, RandomBelow (Idx.NumLines), &Start, &Len);
+        if (PrintRange (fileno (fp), Start, Len, Line, MAXLINE) != 0) {
+          perror ("rnd-extract: reading line");
+          break;
+        }
+      }
+    }
+    LineIndexClose (&Idx);
+    fclose (fp);
+    return 0;
+  }
 
   fseeko (fp, 0, SEEK_END);
   filelen = ftello (fp);
@@ -38,7 +278,797 @@ int main (int argc, char **argv)
     SampleLine(Line, MAXLINE, fp, 0, filelen);
     printf ("%s", Line);
   }
-  
+
   fclose (fp);
   return 0;
-}
\ No newline at end of file
+}
+
+/*
+   Copies [Start, Start + Len) of Fd to stdout through Buf, however long,
+   and ends it with a newline if the file didn't (its last line).
+*/
+int PrintRange (int Fd, off_t Start, off_t Len, char *Buf, size_t BufLen)
+{
+  ssize_t n;
+  int Last = '\n';
+
+  while (Len > 0) {
+    n = pread (Fd, Buf, (Len > (off_t) BufLen) ? BufLen : (size_t) Len, Start);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      return (-1);
+    }
+    if (n == 0) break;
+    fwrite (Buf, 1, n, stdout);
+    Last = Buf [n - 1];
+    Start += n;
+    Len -= n;
+  }
+  if (Last != '\n') putchar ('\n');
+  return (0);
+}
+
+/*
+   Uniform in [0, n). random() gives 31 bits, two of them are plenty, and
+   draws past the last whole multiple of n are thrown back so no value is
+   favoured.
+*/
+uint64_t RandomBelow (uint64_t n)
+{
+  uint64_t Limit = ((uint64_t) 1 << 62) - (((uint64_t) 1 << 62) % n);
+  uint64_t r;
+
+  do {
+    r = (((uint64_t) random () << 31) ^ (uint64_t) random ()) & (((uint64_t) 1 << 62) - 1);
+  } while (r >= Limit);
+  return (r % n);
+}
+
+/*
+   Samples Count distinct lines (or all of them, if there are fewer) and
+   prints them. The lines are picked first, then read in file order, so
+   the reads sweep through the file instead of seeking all over it. With
+   an index the lines are uniform, without one each draw is the line after
+   a random byte, like the plain mode, redrawn when it came up before.
+   Returns 0 on success, -1 with errno set.
+*/
+int BatchSample (int Fd, off_t FileSize, struct LineIndex *Idx, int64_t Count, int Shuffle)
+{
+  struct Sweep S;
+  struct Pick *Picks;
+  int64_t NumPicks;
+  int64_t i;
+  int64_t k;
+  int64_t Ahead = 0;
+  struct Pick Tmp;
+  char *Arena = NULL;
+  char *Grown;
+  char *p;
+  size_t ArenaLen = 0;
+  size_t ArenaSize = 0;
+  size_t Avail;
+  off_t Through;
+  int Status = 0;
+
+  if ((Count <= 0) || (FileSize == 0)) return (0);
+  if ((Idx != NULL) && ((uint64_t) Count > Idx -> NumLines)) {
+    fprintf (stderr, "rnd-extract: the file has only %llu lines\n", (unsigned long long) Idx -> NumLines);
+    Count = Idx -> NumLines;
+  }
+
+  S.Fd = Fd;
+  S.FileSize = FileSize;
+  S.WinStart = 0;
+  S.WinLen = 0;
+  S.Buf = (char *) malloc (SWEEP_BUFSIZE);
+  Picks = (struct Pick *) malloc ((Count + BATCH_MIN_DRAW (Count) + 1) * sizeof (struct Pick));   // see PickSeekLines
+  if ((S.Buf == NULL) || (Picks == NULL)) {
+    free (S.Buf);
+    free (Picks);
+    errno = ENOMEM;
+    return (-1);
+  }
+
+  if (Idx != NULL) NumPicks = PickIndexedLines (Idx, Count, Picks);
+  else NumPicks = PickSeekLines (&S, Count, Picks);
+  if (NumPicks < 0) {
+    free (S.Buf);
+    free (Picks);
+    return (-1);
+  }
+  if (NumPicks < Count) fprintf (stderr, "rnd-extract: found only %lld different lines\n", (long long) NumPicks);
+
+#ifdef HAVE_POSIX_FADVISE
+  if (NumPicks > FileSize / SWEEP_BUFSIZE) posix_fadvise (Fd, 0, FileSize, POSIX_FADV_SEQUENTIAL);
+#endif
+
+  for (i = 0; (i < NumPicks) && (Status == 0); i++) {
+    // read ahead through as many of the next lines as fit the buffer
+    if (Ahead < i) Ahead = i;
+    while ((Ahead + 1 < NumPicks) && (Picks [Ahead + 1].Start + Picks [Ahead + 1].Len - Picks [i].Start <= SWEEP_BUFSIZE))
+      Ahead++;
+    Through = Picks [Ahead].Start + Picks [Ahead].Len;
+
+    if (Picks [i].Len > SWEEP_BUFSIZE) {
+      if (Shuffle) {
+        errno = EFBIG;   // it would have to be held in memory whole
+        Status = -1;
+      }
+      else Status = PrintRange (Fd, Picks [i].Start, Picks [i].Len, S.Buf, SWEEP_BUFSIZE);
+      continue;
+    }
+    p = SweepFetch (&S, Picks [i].Start, Picks [i].Len, Through, &Avail);
+    if (p == NULL) {
+      Status = -1;
+      break;
+    }
+    if (!Shuffle) {
+      fwrite (p, 1, Picks [i].Len, stdout);
+      if (p [Picks [i].Len - 1] != '\n') putchar ('\n');
+      continue;
+    }
+
+    // keep the line, newline ended, for later. From here on the pick is where it is in the arena
+    if (ArenaLen + Picks [i].Len + 1 > ArenaSize) {
+      ArenaSize = (ArenaSize == 0) ? SWEEP_BUFSIZE : ArenaSize * 2;
+      while (ArenaLen + Picks [i].Len + 1 > ArenaSize) ArenaSize *= 2;
+      Grown = (char *) realloc (Arena, ArenaSize);
+      if (Grown == NULL) {
+        errno = ENOMEM;
+        Status = -1;
+        break;
+      }
+      Arena = Grown;
+    }
+    memcpy (Arena + ArenaLen, p, Picks [i].Len);
+    if (p [Picks [i].Len - 1] != '\n') Arena [ArenaLen + Picks [i].Len++] = '\n';
+    Picks [i].Start = ArenaLen;
+    ArenaLen += Picks [i].Len;
+  }
+
+  if (Shuffle && (Status == 0)) {
+    // Fisher-Yates, printing each line as it is drawn
+    for (i = NumPicks; i > 0; i--) {
+      k = (int64_t) RandomBelow (i);
+      fwrite (Arena + Picks [k].Start, 1, Picks [k].Len, stdout);
+      Tmp = Picks [k];
+      Picks [k] = Picks [i - 1];
+      Picks [i - 1] = Tmp;
+    }
+  }
+
+  free (Arena);
+  free (S.Buf);
+  free (Picks);
+  return (Status);
+}
+
+/*
+   Count distinct values below Range, sorted, into Draws (room for Count).
+   Count must not exceed Range. Large shares of the range are picked with
+   a selection pass over it (Knuth's algorithm S), smaller ones by drawing,
+   sorting and topping up the duplicates.
+*/
+int64_t DrawDistinct (uint64_t *Draws, int64_t Count, uint64_t Range)
+{
+  uint64_t v;
+  int64_t Have = 0;
+  int64_t i;
+  int64_t k;
+
+  if ((uint64_t) Count * 8 >= Range) {
+    for (v = 0; (v < Range) && (Have < Count); v++) {
+      if (RandomBelow (Range - v) < (uint64_t) (Count - Have)) Draws [Have++] = v;
+    }
+    return (Have);
+  }
+
+  while (Have < Count) {
+    for (i = Have; i < Count; i++) Draws [i] = RandomBelow (Range);
+    qsort (Draws, Count, sizeof (uint64_t), CompareOffsets);
+    for (i = 1, k = 1; i < Count; i++) {
+      if (Draws [i] != Draws [k - 1]) Draws [k++] = Draws [i];
+    }
+    Have = k;
+  }
+  return (Have);
+}
+
+/*
+   Count distinct lines from the index, uniformly, in file order.
+*/
+int64_t PickIndexedLines (struct LineIndex *Idx, int64_t Count, struct Pick *Picks)
+{
+  uint64_t *Lines;
+  int64_t i;
+
+  // the line numbers and the picks are the same size, so draw into the picks and convert in place
+  Lines = (uint64_t *) Picks;
+  Count = DrawDistinct (Lines, Count, Idx -> NumLines);
+  for (i = Count - 1; i >= 0; i--) LineIndexLookup (Idx, Lines [i], &Picks [i].Start, &Picks [i].Len);
+  return (Count);
+}
+
+/*
+   Without an index: the line after each of Count random bytes, the last
+   line wrapping around to the first, found in one sweep. Lines that came
+   up more than once are redrawn. A round draws at least
+   BATCH_MIN_DRAW(Count) bytes so the last few lines don't take a round
+   each; when that finds more lines than wanted, a uniform subset of them
+   is kept. A round that finds nothing new means the file is out of lines,
+   and it gives back what it found. Picks has room for Count +
+   BATCH_MIN_DRAW(Count) + 1. Returns how many were picked, sorted by
+   start, or -1.
+*/
+int64_t PickSeekLines (struct Sweep *S, int64_t Count, struct Pick *Picks)
+{
+  off_t *Offsets;
+  int64_t Have = 0;
+  int64_t Want;
+  int64_t Before;
+  int64_t i;
+  int64_t k;
+  int64_t Ahead;
+  int WrapToFirst;
+  off_t Nl;
+  off_t Start;
+  off_t End;
+
+  Offsets = (off_t *) malloc ((Count + BATCH_MIN_DRAW (Count)) * sizeof (off_t));
+  if (Offsets == NULL) {
+    errno = ENOMEM;
+    return (-1);
+  }
+
+  while (Have < Count) {
+    Want = (Count - Have > BATCH_MIN_DRAW (Count)) ? Count - Have : BATCH_MIN_DRAW (Count);
+    for (i = 0; i < Want; i++) Offsets [i] = (off_t) RandomBelow (S -> FileSize);
+    qsort (Offsets, Want, sizeof (off_t), CompareOffsets);
+
+    Before = Have;
+    WrapToFirst = 0;
+    for (i = 0, Ahead = 0; i < Want; i++) {
+      if (Ahead < i) Ahead = i;
+      while ((Ahead + 1 < Want) && (Offsets [Ahead + 1] - Offsets [i] < SWEEP_BUFSIZE - SWEEP_MIN_READ)) Ahead++;
+
+      Nl = SweepFindNewline (S, Offsets [i], Offsets [Ahead] + SWEEP_MIN_READ);
+      if (Nl == -2) break;
+      if ((Nl < 0) || (Nl + 1 >= S -> FileSize)) {
+        WrapToFirst = 1;
+        continue;
+      }
+      Start = Nl + 1;
+      if ((Have > Before) && (Picks [Have - 1].Start == Start)) continue;
+      End = SweepFindNewline (S, Start, Offsets [Ahead] + SWEEP_MIN_READ);
+      if (End == -2) break;
+      Picks [Have].Start = Start;
+      Picks [Have].Len = ((End < 0) ? S -> FileSize : End + 1) - Start;
+      Have++;
+    }
+    if (i < Want) {
+      free (Offsets);
+      return (-1);
+    }
+    if (WrapToFirst) {
+      End = SweepFindNewline (S, 0, SWEEP_MIN_READ);
+      if (End == -2) {
+        free (Offsets);
+        return (-1);
+      }
+      Picks [Have].Start = 0;
+      Picks [Have].Len = ((End < 0) ? S -> FileSize : End + 1);
+      Have++;
+    }
+
+    // fold this round's lines into the earlier ones, dropping the repeats
+    qsort (Picks, Have, sizeof (struct Pick), ComparePicks);
+    for (i = 1, k = (Have > 0); i < Have; i++) {
+      if (Picks [i].Start != Picks [k - 1].Start) Picks [k++] = Picks [i];
+    }
+    Have = k;
+    if (Have == Before) break;   // nothing new, the file has run out of lines
+  }
+
+  // too many, keep a uniform Count of them in order (algorithm S again)
+  if (Have > Count) {
+    for (i = 0, k = 0; (i < Have) && (k < Count); i++) {
+      if (RandomBelow (Have - i) < (uint64_t) (Count - k)) Picks [k++] = Picks [i];
+    }
+    Have = k;
+  }
+
+  free (Offsets);
+  return (Have);
+}
+
+/*
+   Makes sure [Off, Off + Need) is in the window and returns where Off is
+   in it, with Avail set to how much of the window follows. When it has to
+   read, it reads from Off through Through (where the caller's next lines
+   end) if that fits, but never less than SWEEP_MIN_READ. Need is capped at
+   the end of the file. NULL with errno set on a read error.
+*/
+char *SweepFetch (struct Sweep *S, off_t Off, size_t Need, off_t Through, size_t *Avail)
+{
+  size_t Want;
+  size_t Got = 0;
+  ssize_t n;
+
+  if (Off + (off_t) Need > S -> FileSize) Need = S -> FileSize - Off;
+  if ((Off < S -> WinStart) || (Off + (off_t) Need > S -> WinStart + (off_t) S -> WinLen)) {
+    Want = SWEEP_MIN_READ;
+    if ((Through > Off) && (Through - Off > (off_t) Want)) Want = (Through - Off > SWEEP_BUFSIZE) ? SWEEP_BUFSIZE : (size_t) (Through - Off);
+    if (Want < Need) Want = Need;
+    if (Off + (off_t) Want > S -> FileSize) Want = S -> FileSize - Off;
+
+    while (Got < Want) {
+      n = pread (S -> Fd, S -> Buf + Got, Want - Got, Off + Got);
+      if (n < 0) {
+        if (errno == EINTR) continue;
+        S -> WinLen = 0;
+        return (NULL);
+      }
+      if (n == 0) break;
+      Got += n;
+    }
+    S -> WinStart = Off;
+    S -> WinLen = Got;
+    if (Got < Need) {
+      errno = EIO;   // the file shrank under us
+      return (NULL);
+    }
+  }
+  *Avail = S -> WinStart + S -> WinLen - Off;
+  return (S -> Buf + (Off - S -> WinStart));
+}
+
+/*
+   Where the first newline at or after From is, -1 if there is none before
+   the end of the file, -2 on a read error.
+*/
+off_t SweepFindNewline (struct Sweep *S, off_t From, off_t Through)
+{
+  char *p;
+  char *Nl;
+  size_t Avail;
+
+  while (From < S -> FileSize) {
+    p = SweepFetch (S, From, 1, Through, &Avail);
+    if (p == NULL) return (-2);
+    Nl = (char *) memchr (p, '\n', Avail);
+    if (Nl != NULL) return (From + (Nl - p));
+    From += Avail;
+  }
+  return (-1);
+}
+
+/*
+   A uniform sample of Count lines (all of them, if there are fewer) from
+   one pass over Fd, printed in random order. A pipe is read by one
+   reservoir. A regular file is split into up to NumThreads ranges, each
+   with its own reservoir, and the reservoirs are merged by drawing each
+   line from reservoir t with probability (lines of t not yet drawn) /
+   (lines not yet drawn), which makes the merged sample as uniform as one
+   reservoir over the whole file. Returns 0, or -1 with errno set.
+*/
+int StreamSample (int Fd, int NumThreads, int Count)
+{
+  struct StreamJob *Jobs;
+  pthread_t *Threads;
+  struct stat St;
+  off_t Begin = 0;
+  off_t Share = 0;
+  int64_t *Left;
+  int64_t Total = 0;
+  int64_t r;
+  uint64_t Rng;
+  int Status = 0;
+  int Regular;
+  int Slot;
+  int t;
+  int d;
+
+  if (Count <= 0) return (0);
+  Regular = (fstat (Fd, &St) == 0) && S_ISREG (St.st_mode);
+  if (Regular) {
+    Begin = lseek (Fd, 0, SEEK_CUR);
+    if (Begin < 0) Begin = 0;
+    if (NumThreads > (St.st_size - Begin) / STREAM_MIN_SHARE) NumThreads = (int) ((St.st_size - Begin) / STREAM_MIN_SHARE);
+    if (NumThreads < 1) NumThreads = 1;
+    Share = (St.st_size - Begin) / NumThreads;
+  }
+  else NumThreads = 1;
+
+  Jobs = (struct StreamJob *) calloc (NumThreads, sizeof (struct StreamJob));
+  Threads = (pthread_t *) calloc (NumThreads, sizeof (pthread_t));
+  Left = (int64_t *) calloc (NumThreads, sizeof (int64_t));
+  if ((Jobs == NULL) || (Threads == NULL) || (Left == NULL)) {
+    free (Jobs);
+    free (Threads);
+    free (Left);
+    errno = ENOMEM;
+    return (-1);
+  }
+
+  Rng = ((uint64_t) random () << 32) ^ (uint64_t) random ();
+  for (t = 0; t < NumThreads; t++) {
+    Jobs [t].Fd = Fd;
+    Jobs [t].Rng = SampleRandom (&Rng);
+    if (ReservoirInit (&Jobs [t].R, Count, &Jobs [t].Rng) != 0) Status = -1;
+    if (NumThreads == 1) {
+      Jobs [t].Start = Begin;
+      Jobs [t].End = -1;    // a single reader doesn't need pread, just read to the end
+    }
+    else {
+      Jobs [t].Start = Begin + Share * t;
+      Jobs [t].End = (t == NumThreads - 1) ? St.st_size : Begin + Share * (t + 1);
+    }
+  }
+
+  if (Status == 0) {
+    // thread 0's share runs right here
+    for (t = 1; t < NumThreads; t++) {
+      Jobs [t].Started = (pthread_create (&Threads [t], NULL, StreamThread, &Jobs [t]) == 0);
+    }
+    StreamThread (&Jobs [0]);
+    for (t = 1; t < NumThreads; t++) {
+      if (Jobs [t].Started) pthread_join (Threads [t], NULL);
+      else StreamThread (&Jobs [t]);  // couldn't start it, do it inline
+    }
+    for (t = 0; t < NumThreads; t++) {
+      if (Jobs [t].Status != 0) {
+        errno = Jobs [t].Status;
+        Status = -1;
+      }
+      Left [t] = Jobs [t].R.Seen;
+      Total += Left [t];
+    }
+  }
+
+  // draw the merged sample a line at a time, each from a random unused slot of its reservoir
+  for (d = 0; (Status == 0) && (d < Count) && (Total > 0); d++) {
+    r = (int64_t) SampleRandomBelow (&Rng, Total);
+    for (t = 0; r >= Left [t]; t++) r -= Left [t];
+    Slot = (int) SampleRandomBelow (&Rng, Jobs [t].R.Count);
+    fwrite (Jobs [t].R.Lines [Slot], 1, Jobs [t].R.Lens [Slot], stdout);
+    if (Jobs [t].R.Lines [Slot][Jobs [t].R.Lens [Slot] - 1] != '\n') putchar ('\n');
+
+    ReservoirRemove (&Jobs [t].R, Slot);
+    Left [t]--;
+    Total--;
+  }
+
+  for (t = 0; t < NumThreads; t++) ReservoirFree (&Jobs [t].R);
+  free (Jobs);
+  free (Threads);
+  free (Left);
+  return (Status);
+}
+
+/*
+   Feeds the job's lines to its reservoir. With a range, it reads with
+   pread from just before Start, drops the line that started earlier, and
+   stops at the first line starting at or after End. Lines the reservoir
+   will pass over anyway are only counted, a buffer at a time when they
+   run past it. Sets Status to 0, or an errno value.
+*/
+void *StreamThread (void *arg)
+{
+  struct StreamJob *Job = (struct StreamJob *) arg;
+  char *Buf;
+  char *Grown;
+  char *p;
+  char *Nl;
+  char *BufEnd;
+  size_t Cap = STREAM_BUFSIZE;
+  size_t Have = 0;
+  off_t Pos;                  // where Buf [0] is in the file, when ranged
+  int Ranged = (Job -> End >= 0);
+  int DropFirst = Ranged && (Job -> Start > 0);
+  int64_t Skip;
+  int64_t LinesLeft;          // newlines from p to the end of the buffer, -1 until counted
+  ssize_t Got;
+
+  Job -> Status = ENOMEM;
+  Buf = (char *) malloc (Cap);
+  if (Buf == NULL) return (NULL);
+  Pos = (DropFirst) ? Job -> Start - 1 : Job -> Start;
+
+#ifdef HAVE_POSIX_FADVISE
+  posix_fadvise (Job -> Fd, Pos, Ranged ? Job -> End - Pos : 0, POSIX_FADV_SEQUENTIAL);
+#endif
+  for (;;) {
+    if (Have == Cap) {
+      // a line longer than the buffer
+      Grown = (char *) realloc (Buf, Cap * 2);
+      if (Grown == NULL) break;
+      Buf = Grown;
+      Cap *= 2;
+    }
+    Got = (Ranged) ? pread (Job -> Fd, Buf + Have, Cap - Have, Pos + Have) : read (Job -> Fd, Buf + Have, Cap - Have);
+    if (Got < 0) {
+      if (errno == EINTR) continue;
+      Job -> Status = errno;
+      break;
+    }
+    if (Got == 0) {
+      // the last line, if it had no newline
+      if ((Have > 0) && !DropFirst && (!Ranged || (Pos < Job -> End)) && (ReservoirOffer (&Job -> R, Buf, Have) != 0)) break;
+      Job -> Status = 0;
+      break;
+    }
+    Have += Got;
+    BufEnd = Buf + Have;
+    p = Buf;
+
+    if (DropFirst) {
+      Nl = (char *) memchr (p, '\n', BufEnd - p);
+      if (Nl == NULL) {
+        Pos += Have;
+        Have = 0;
+        continue;
+      }
+      p = Nl + 1;
+      DropFirst = 0;
+    }
+
+    LinesLeft = -1;
+    while (p < BufEnd) {
+      if (Ranged && (Pos + (p - Buf) >= Job -> End)) break;
+      Skip = ReservoirSkip (&Job -> R);
+      if ((Skip > 0) && (!Ranged || (Pos + (off_t) Have <= Job -> End))) {
+        // every line ending in this buffer starts before End, so pass over all of them at once if it can
+        if (LinesLeft < 0) LinesLeft = CountNewlinesBuf (p, BufEnd - p);
+        if (LinesLeft <= Skip) {
+          if (LinesLeft > 0) {
+            ReservoirPass (&Job -> R, LinesLeft);
+            p = (char *) memrchr (p, '\n', BufEnd - p) + 1;
+          }
+          break;
+        }
+      }
+      Nl = (char *) memchr (p, '\n', BufEnd - p);
+      if (Nl == NULL) break;
+      if (Skip > 0) ReservoirPass (&Job -> R, 1);
+      else if (ReservoirOffer (&Job -> R, p, Nl - p + 1) != 0) goto done;
+      p = Nl + 1;
+      if (LinesLeft > 0) LinesLeft--;
+    }
+    if (Ranged && (Pos + (p - Buf) >= Job -> End)) {
+      Job -> Status = 0;
+      break;
+    }
+
+    // keep the unfinished line for the next read
+    Have = BufEnd - p;
+    memmove (Buf, p, Have);
+    Pos += p - Buf;
+  }
+
+done:
+  free (Buf);
+  return (NULL);
+}
+
+/*
+   Each line of Fd with probability Fraction, in file order, in one pass.
+   Instead of a random number per line it draws the gap to the next line
+   it keeps, which is geometric, and steps over the gap with SkipLines.
+   Rng fixes the sample, so a given seed and input always give the same
+   lines. Returns 0, or -1 with errno set.
+*/
+int FractionSample (int Fd, double Fraction, uint64_t *Rng)
+{
+  char *Buf;
+  char *Grown;
+  char *p;
+  char *Nl;
+  char *BufEnd;
+  size_t Cap = STREAM_BUFSIZE;
+  size_t Have = 0;
+  int64_t Gap;
+  ssize_t Got;
+
+  if (Fraction <= 0) return (0);
+
+  Buf = (char *) malloc (Cap);
+  if (Buf == NULL) {
+    errno = ENOMEM;
+    return (-1);
+  }
+
+#ifdef HAVE_POSIX_FADVISE
+  posix_fadvise (Fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+  Gap = SampleGeometric (Rng, Fraction);
+  for (;;) {
+    if (Have == Cap) {
+      // a line longer than the buffer, that we keep
+      Grown = (char *) realloc (Buf, Cap * 2);
+      if (Grown == NULL) {
+        free (Buf);
+        errno = ENOMEM;
+        return (-1);
+      }
+      Buf = Grown;
+      Cap *= 2;
+    }
+    Got = read (Fd, Buf + Have, Cap - Have);
+    if (Got < 0) {
+      if (errno == EINTR) continue;
+      free (Buf);
+      return (-1);
+    }
+    if (Got == 0) break;
+    Have += Got;
+    BufEnd = Buf + Have;
+    p = Buf;
+
+    while (p < BufEnd) {
+      if (Gap > 0) {
+        p += SkipLines (p, BufEnd - p, &Gap);
+        continue;
+      }
+      Nl = (char *) memchr (p, '\n', BufEnd - p);
+      if (Nl == NULL) break;
+      fwrite (p, 1, Nl - p + 1, stdout);
+      p = Nl + 1;
+      Gap = SampleGeometric (Rng, Fraction);
+    }
+
+    // a line being skipped needn't be kept, one to print is moved up
+    Have = (Gap > 0) ? 0 : BufEnd - p;
+    memmove (Buf, p, Have);
+  }
+
+  // the last line, if it had no newline
+  if ((Gap == 0) && (Have > 0)) {
+    fwrite (Buf, 1, Have, stdout);
+    putchar ('\n');
+  }
+  free (Buf);
+  return (0);
+}
+
+/*
+   Up to K lines for each distinct value of the key fields, from one pass
+   over Fd, each key's lines a uniform sample of that key's lines. The key
+   is the fields joined with a 0 byte; a line short of a field has it
+   empty. Returns 0, or -1 with errno set.
+*/
+int StrataSample (int Fd, int *Fields, int NumFields, char *DelimChrs, int K, uint64_t *Rng)
+{
+  struct Strata S;
+  char IsDelim [256];
+  char *Buf;
+  char *Grown;
+  char *p;
+  char *Nl;
+  char *BufEnd;
+  char *Key = NULL;
+  size_t KeyCap = 0;
+  size_t KeyLen;
+  size_t Cap = STREAM_BUFSIZE;
+  size_t Have = 0;
+  ssize_t Got;
+  int Status = 0;
+  int Eof = 0;
+
+  if (K <= 0) return (0);
+  memset (IsDelim, 0, sizeof (IsDelim));
+  for (p = DelimChrs; *p; p++) IsDelim [(unsigned char) *p] = 1;
+
+  Buf = (char *) malloc (Cap);
+  if ((Buf == NULL) || (StrataInit (&S, K, Rng) != 0)) {
+    free (Buf);
+    errno = ENOMEM;
+    return (-1);
+  }
+
+#ifdef HAVE_POSIX_FADVISE
+  posix_fadvise (Fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+  while ((Status == 0) && !Eof) {
+    if (Have == Cap) {
+      // a line longer than the buffer
+      Grown = (char *) realloc (Buf, Cap * 2);
+      if (Grown == NULL) {
+        errno = ENOMEM;
+        Status = -1;
+        break;
+      }
+      Buf = Grown;
+      Cap *= 2;
+    }
+    Got = read (Fd, Buf + Have, Cap - Have);
+    if (Got < 0) {
+      if (errno == EINTR) continue;
+      Status = -1;
+      break;
+    }
+    if (Got == 0) {
+      // the last line, if it had no newline, is handled like the others
+      if (Have == 0) break;
+      Eof = 1;
+    }
+    Have += Got;
+    BufEnd = Buf + Have;
+
+    for (p = Buf; p < BufEnd; p = Nl + 1) {
+      Nl = (char *) memchr (p, '\n', BufEnd - p);
+      if (Nl == NULL) {
+        if (!Eof) break;
+        Nl = BufEnd - 1;
+      }
+      if ((StrataKey (p, Nl + 1 - p, Fields, NumFields, IsDelim, &Key, &KeyCap, &KeyLen) != 0) ||
+          (StrataOffer (&S, Key, KeyLen, p, Nl + 1 - p) != 0)) {
+        Status = -1;
+        break;
+      }
+    }
+
+    Have = BufEnd - p;
+    memmove (Buf, p, Have);
+  }
+
+  if (Status == 0) StrataPrint (&S, stdout);
+  StrataFree (&S);
+  free (Key);
+  free (Buf);
+  return (Status);
+}
+
+/*
+   The key of Line: its fields Fields, cut at every delimiter character,
+   each followed by a 0 byte, in *Key (grown as needed). Returns 0, or -1
+   when out of memory.
+*/
+int StrataKey (char *Line, size_t Len, int *Fields, int NumFields, char *IsDelim, char **Key, size_t *KeyCap, size_t *KeyLen)
+{
+  char *Grown;
+  size_t i;
+  size_t f;
+  int Field;
+  int k;
+
+  if ((Len > 0) && (Line [Len - 1] == '\n')) Len--;
+  if (*KeyCap < Len + NumFields) {
+    *KeyCap = (Len + NumFields) * 2;
+    Grown = (char *) realloc (*Key, *KeyCap);
+    if (Grown == NULL) {
+      errno = ENOMEM;
+      return (-1);
+    }
+    *Key = Grown;
+  }
+
+  *KeyLen = 0;
+  for (k = 0; k < NumFields; k++) {
+    for (i = 0, Field = Fields [k]; (Field > 0) && (i < Len); i++) {
+      if (IsDelim [(unsigned char) Line [i]]) Field--;
+    }
+    if (Field == 0) {
+      for (f = i; (f < Len) && !IsDelim [(unsigned char) Line [f]]; f++);
+      memcpy (*Key + *KeyLen, Line + i, f - i);
+      *KeyLen += f - i;
+    }
+    (*Key) [(*KeyLen)++] = '\0';
+  }
+  return (0);
+}
+
+int CompareOffsets (const void *a, const void *b)
+{
+  uint64_t x = *(const uint64_t *) a;
+  uint64_t y = *(const uint64_t *) b;
+
+  return ((x > y) - (x < y));
+}
+
+int ComparePicks (const void *a, const void *b)
+{
+  off_t x = ((const struct Pick *) a) -> Start;
+  off_t y = ((const struct Pick *) b) -> Start;
+
+  return ((x > y) - (x < y));
+}
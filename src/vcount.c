@@ -0,0 +1,305 @@
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include "vcount.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define HAVE_X86_SIMD
+#include <immintrin.h>
+#endif
+
+#define COUNT_BUFSIZE   (8 * 1024 * 1024)   // read per step by each thread
+#define COUNT_MIN_SHARE (64 * 1024 * 1024)  // don't start a thread for less than this
+
+struct CountJob {
+  int Fd;
+  off_t Offset;
+  off_t Len;
+  int64_t Count;
+  int Started;
+  int Status;
+};
+
+typedef int64_t (*CountFn) (const char *Buf, size_t Len);
+
+static int64_t CountScalar (const char *Buf, size_t Len)
+{
+  int64_t n = 0;
+  size_t i;
+
+  for (i = 0; i < Len; i++) n += (Buf [i] == '\n');
+  return (n);
+}
+
+#ifdef HAVE_X86_SIMD
+/*
+   Both vector versions compare a block against '\n' and subtract the
+   result (0 or -1 per byte) from byte counters, which is one instruction
+   per block. The counters are folded into the total with a sum of absolute
+   differences every 255 blocks, before any of them can wrap.
+*/
+__attribute__ ((target ("avx2")))
+static int64_t CountAvx2 (const char *Buf, size_t Len)
+{
+  __m256i Nl = _mm256_set1_epi8 ('\n');
+  __m256i Zero = _mm256_setzero_si256 ();
+  __m256i Acc;
+  __m256i Sums;
+  int64_t n = 0;
+  size_t i = 0;
+  size_t Blocks;
+
+  while (Len - i >= 32) {
+    Blocks = (Len - i) / 32;
+    if (Blocks > 255) Blocks = 255;
+    Acc = Zero;
+    for (; Blocks > 0; Blocks--, i += 32)
+      Acc = _mm256_sub_epi8 (Acc, _mm256_cmpeq_epi8 (_mm256_loadu_si256 ((const __m256i *) (Buf + i)), Nl));
+    Sums = _mm256_sad_epu8 (Acc, Zero);
+    n += _mm256_extract_epi64 (Sums, 0) + _mm256_extract_epi64 (Sums, 1) +
+         _mm256_extract_epi64 (Sums, 2) + _mm256_extract_epi64 (Sums, 3);
+  }
+  return (n + CountScalar (Buf + i, Len - i));
+}
+
+__attribute__ ((target ("sse2")))
+static int64_t CountSse2 (const char *Buf, size_t Len)
+{
+  __m128i Nl = _mm_set1_epi8 ('\n');
+  __m128i Zero = _mm_setzero_si128 ();
+  __m128i Acc;
+  __m128i Sums;
+  int64_t n = 0;
+  size_t i = 0;
+  size_t Blocks;
+
+  while (Len - i >= 16) {
+    Blocks = (Len - i) / 16;
+    if (Blocks > 255) Blocks = 255;
+    Acc = Zero;
+    for (; Blocks > 0; Blocks--, i += 16)
+      Acc = _mm_sub_epi8 (Acc, _mm_cmpeq_epi8 (_mm_loadu_si128 ((const __m128i *) (Buf + i)), Nl));
+    Sums = _mm_sad_epu8 (Acc, Zero);
+    n += _mm_cvtsi128_si32 (Sums) + _mm_cvtsi128_si32 (_mm_srli_si128 (Sums, 8));
+  }
+  return (n + CountScalar (Buf + i, Len - i));
+}
+#endif
+
+/*
+   The widest version this cpu runs, picked on the first call.
+*/
+static CountFn PickCount (void)
+{
+  static CountFn Fn = NULL;
+
+  if (Fn != NULL) return (Fn);
+  Fn = CountScalar;
+#ifdef HAVE_X86_SIMD
+  __builtin_cpu_init ();
+  if (__builtin_cpu_supports ("avx2")) Fn = CountAvx2;
+  else if (__builtin_cpu_supports ("sse2")) Fn = CountSse2;
+#endif
+  return (Fn);
+}
+
+int64_t CountNewlinesBuf (const char *Buf, size_t Len)
+{
+  return (PickCount () (Buf, Len));
+}
+
+/*
+   SkipLines versions. Each takes a block, turns its newlines into a bit
+   mask and only looks for the exact one in the block where the count
+   runs out.
+*/
+typedef size_t (*SkipFn) (const char *Buf, size_t Len, int64_t *Lines);
+
+static size_t SkipScalar (const char *Buf, size_t Len, int64_t *Lines)
+{
+  const char *p = Buf;
+  const char *End = Buf + Len;
+  const char *Nl;
+
+  while ((*Lines > 0) && ((Nl = (const char *) memchr (p, '\n', End - p)) != NULL)) {
+    (*Lines)--;
+    p = Nl + 1;
+  }
+  return ((*Lines > 0) ? Len : (size_t) (p - Buf));
+}
+
+#ifdef HAVE_X86_SIMD
+/*
+   Past the n'th (from 1) set bit of Mask, which has at least n.
+*/
+static inline size_t PastNthBit (uint32_t Mask, int64_t n)
+{
+  while (--n > 0) Mask &= Mask - 1;
+  return (__builtin_ctz (Mask) + 1);
+}
+
+__attribute__ ((target ("avx2,popcnt")))
+static size_t SkipAvx2 (const char *Buf, size_t Len, int64_t *Lines)
+{
+  __m256i Nl = _mm256_set1_epi8 ('\n');
+  uint32_t Mask;
+  int Bits;
+  size_t i;
+
+  for (i = 0; (*Lines > 0) && (Len - i >= 32); i += 32) {
+    Mask = (uint32_t) _mm256_movemask_epi8 (_mm256_cmpeq_epi8 (_mm256_loadu_si256 ((const __m256i *) (Buf + i)), Nl));
+    Bits = __builtin_popcount (Mask);
+    if (Bits >= *Lines) {
+      i += PastNthBit (Mask, *Lines);
+      *Lines = 0;
+      return (i);
+    }
+    *Lines -= Bits;
+  }
+  return (i + SkipScalar (Buf + i, Len - i, Lines));
+}
+
+__attribute__ ((target ("sse2,popcnt")))
+static size_t SkipSse2 (const char *Buf, size_t Len, int64_t *Lines)
+{
+  __m128i Nl = _mm_set1_epi8 ('\n');
+  uint32_t Mask;
+  int Bits;
+  size_t i;
+
+  for (i = 0; (*Lines > 0) && (Len - i >= 16); i += 16) {
+    Mask = (uint32_t) _mm_movemask_epi8 (_mm_cmpeq_epi8 (_mm_loadu_si128 ((const __m128i *) (Buf + i)), Nl));
+    Bits = __builtin_popcount (Mask);
+    if (Bits >= *Lines) {
+      i += PastNthBit (Mask, *Lines);
+      *Lines = 0;
+      return (i);
+    }
+    *Lines -= Bits;
+  }
+  return (i + SkipScalar (Buf + i, Len - i, Lines));
+}
+#endif
+
+static SkipFn PickSkip (void)
+{
+  static SkipFn Fn = NULL;
+
+  if (Fn != NULL) return (Fn);
+  Fn = SkipScalar;
+#ifdef HAVE_X86_SIMD
+  __builtin_cpu_init ();
+  if (__builtin_cpu_supports ("avx2") && __builtin_cpu_supports ("popcnt")) Fn = SkipAvx2;
+  else if (__builtin_cpu_supports ("sse2") && __builtin_cpu_supports ("popcnt")) Fn = SkipSse2;
+#endif
+  return (Fn);
+}
+
+/*
+   Steps over *Lines newlines of Buf. Returns the offset just past the last
+   one with *Lines set to 0, or Len with *Lines reduced by the newlines it
+   did find, for the caller to go on in the next buffer.
+*/
+size_t SkipLines (const char *Buf, size_t Len, int64_t *Lines)
+{
+  if (*Lines <= 0) return (0);
+  return (PickSkip () (Buf, Len, Lines));
+}
+
+static void *CountThread (void *arg)
+{
+  struct CountJob *Job = (struct CountJob *) arg;
+  CountFn Fn = PickCount ();
+  char *Buf;
+  off_t Offset = Job -> Offset;
+  off_t Left = Job -> Len;
+  ssize_t n;
+
+  Job -> Count = 0;
+  Job -> Status = -1;
+  Buf = (char *) malloc (COUNT_BUFSIZE);
+  if (Buf == NULL) return (NULL);
+
+#ifdef HAVE_POSIX_FADVISE
+  posix_fadvise (Job -> Fd, Offset, Left, POSIX_FADV_SEQUENTIAL);
+#endif
+  while (Left > 0) {
+    n = pread (Job -> Fd, Buf, (Left > COUNT_BUFSIZE) ? COUNT_BUFSIZE : (size_t) Left, Offset);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      free (Buf);
+      return (NULL);
+    }
+    if (n == 0) break;
+    Job -> Count += Fn (Buf, n);
+    Offset += n;
+    Left -= n;
+  }
+
+  free (Buf);
+  Job -> Status = 0;
+  return (NULL);
+}
+
+/*
+   Counts the '\n' bytes in [Offset, Offset + Len) of Fd, exactly what
+   wc -l counts. The range is split evenly over up to NumThreads threads
+   (a newline needs no alignment), each reading large blocks with pread.
+   Returns 0 on success, -1 with errno set on a read error.
+*/
+int CountNewlines (int Fd, off_t Offset, off_t Len, int NumThreads, int64_t *Count)
+{
+  struct CountJob *Jobs;
+  pthread_t *Threads;
+  off_t Share;
+  int Status = 0;
+  int t;
+
+  PickCount ();   // before the threads race to do it
+  if (NumThreads > Len / COUNT_MIN_SHARE) NumThreads = (int) (Len / COUNT_MIN_SHARE);
+  if (NumThreads < 1) NumThreads = 1;
+
+  Jobs = (struct CountJob *) calloc (NumThreads, sizeof (struct CountJob));
+  Threads = (pthread_t *) calloc (NumThreads, sizeof (pthread_t));
+  if ((Jobs == NULL) || (Threads == NULL)) {
+    free (Jobs);
+    free (Threads);
+    errno = ENOMEM;
+    return (-1);
+  }
+
+  Share = Len / NumThreads;
+  for (t = 0; t < NumThreads; t++) {
+    Jobs [t].Fd = Fd;
+    Jobs [t].Offset = Offset + Share * t;
+    Jobs [t].Len = (t == NumThreads - 1) ? Len - Share * t : Share;
+  }
+
+  // thread 0's share runs right here
+  for (t = 1; t < NumThreads; t++) {
+    Jobs [t].Started = (pthread_create (&Threads [t], NULL, CountThread, &Jobs [t]) == 0);
+  }
+  CountThread (&Jobs [0]);
+
+  *Count = 0;
+  for (t = 0; t < NumThreads; t++) {
+    if (t > 0) {
+      if (Jobs [t].Started) pthread_join (Threads [t], NULL);
+      else CountThread (&Jobs [t]);  // couldn't start it, do it inline
+    }
+    if (Jobs [t].Status != 0) Status = -1;
+    *Count += Jobs [t].Count;
+  }
+
+  free (Jobs);
+  free (Threads);
+  return (Status);
+}
@@ -0,0 +1,15 @@
+#include <stdint.h>
+#include <sys/types.h>
+
+#ifdef __cplusplus //inform the compiler that these are C functions if we are using a c++ compiler
+extern "C"
+{
+#endif
+
+    int64_t CountNewlinesBuf(const char *Buf, size_t Len);
+    size_t SkipLines(const char *Buf, size_t Len, int64_t *Lines);
+    int CountNewlines(int Fd, off_t Offset, off_t Len, int NumThreads, int64_t *Count);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,184 @@
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include "vcsv.h"
+
+#include <string.h>
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define HAVE_X86_SIMD
+#include <immintrin.h>
+#endif
+
+/*
+   The structural scan of a csv line. Each 64 byte block becomes two bit
+   masks, one for the delimiters and one for the quotes. The prefix xor of
+   the quote mask (bit i is the parity of the quotes up to byte i) marks the
+   bytes inside quotes, with the parity carried from block to block, and the
+   delimiters outside them are the field separators. A doubled quote flips
+   the parity twice, so escaped quotes need no special care here; anything
+   subtler is left to the caller's own parser.
+*/
+typedef size_t (*SplitFn) (const char *Buf, size_t Len, char Delim, char Quote, size_t *Pos, size_t MaxPos, int *Quoted);
+
+static inline size_t EmitBits (uint64_t Mask, size_t Base, size_t *Pos, size_t n, size_t MaxPos)
+{
+  while ((Mask != 0) && (n < MaxPos)) {
+    Pos [n++] = Base + __builtin_ctzll (Mask);
+    Mask &= Mask - 1;
+  }
+  return (n);
+}
+
+static size_t SplitScalar (const char *Buf, size_t Len, char Delim, char Quote, size_t *Pos, size_t MaxPos, int *Quoted)
+{
+  int Inside = 0;
+  size_t n = 0;
+  size_t i;
+
+  *Quoted = 0;
+  for (i = 0; (i < Len) && (n < MaxPos); i++) {
+    if (Buf [i] == Quote) {
+      Inside ^= 1;
+      *Quoted = 1;
+    }
+    else if ((Buf [i] == Delim) && !Inside) Pos [n++] = i;
+  }
+  return (n);
+}
+
+#ifdef HAVE_X86_SIMD
+/*
+   A carry-less multiply by all ones is the prefix xor of a 64 bit mask in
+   one instruction.
+*/
+__attribute__ ((target ("pclmul")))
+static inline uint64_t PrefixXor (uint64_t Mask)
+{
+  return ((uint64_t) _mm_cvtsi128_si64 (_mm_clmulepi64_si128 (_mm_set_epi64x (0, (int64_t) Mask),
+                                                              _mm_set1_epi8 ((char) 0xff), 0)));
+}
+
+__attribute__ ((target ("avx2,pclmul")))
+static size_t SplitAvx2 (const char *Buf, size_t Len, char Delim, char Quote, size_t *Pos, size_t MaxPos, int *Quoted)
+{
+  __m256i D = _mm256_set1_epi8 (Delim);
+  __m256i Q = _mm256_set1_epi8 (Quote);
+  __m256i Lo;
+  __m256i Hi;
+  char Tail [64];
+  const char *p;
+  uint64_t Delims;
+  uint64_t Quotes;
+  uint64_t Inside;
+  uint64_t Carry = 0;
+  uint64_t AnyQuote = 0;
+  size_t n = 0;
+  size_t i;
+
+  for (i = 0; (i < Len) && (n < MaxPos); i += 64) {
+    p = Buf + i;
+    if (Len - i < 64) {
+      memset (Tail, 0, sizeof (Tail));
+      memcpy (Tail, p, Len - i);
+      p = Tail;
+    }
+    Lo = _mm256_loadu_si256 ((const __m256i *) p);
+    Hi = _mm256_loadu_si256 ((const __m256i *) (p + 32));
+    Delims = (uint32_t) _mm256_movemask_epi8 (_mm256_cmpeq_epi8 (Lo, D)) |
+             ((uint64_t) (uint32_t) _mm256_movemask_epi8 (_mm256_cmpeq_epi8 (Hi, D)) << 32);
+    Quotes = (uint32_t) _mm256_movemask_epi8 (_mm256_cmpeq_epi8 (Lo, Q)) |
+             ((uint64_t) (uint32_t) _mm256_movemask_epi8 (_mm256_cmpeq_epi8 (Hi, Q)) << 32);
+    if (Len - i < 64) {
+      // the padding may equal Delim or Quote
+      Delims &= ((uint64_t) 1 << (Len - i)) - 1;
+      Quotes &= ((uint64_t) 1 << (Len - i)) - 1;
+    }
+    if ((Quotes | Carry) != 0) {
+      AnyQuote |= Quotes;
+      Inside = PrefixXor (Quotes) ^ Carry;
+      Carry = (uint64_t) ((int64_t) Inside >> 63);
+      Delims &= ~Inside;
+    }
+    n = EmitBits (Delims, i, Pos, n, MaxPos);
+  }
+  *Quoted = (AnyQuote != 0);
+  return (n);
+}
+
+__attribute__ ((target ("sse4.2,pclmul")))
+static size_t SplitSse42 (const char *Buf, size_t Len, char Delim, char Quote, size_t *Pos, size_t MaxPos, int *Quoted)
+{
+  __m128i D = _mm_set1_epi8 (Delim);
+  __m128i Q = _mm_set1_epi8 (Quote);
+  __m128i Block;
+  char Tail [64];
+  const char *p;
+  uint64_t Delims;
+  uint64_t Quotes;
+  uint64_t Inside;
+  uint64_t Carry = 0;
+  uint64_t AnyQuote = 0;
+  size_t n = 0;
+  size_t i;
+  int k;
+
+  for (i = 0; (i < Len) && (n < MaxPos); i += 64) {
+    p = Buf + i;
+    if (Len - i < 64) {
+      memset (Tail, 0, sizeof (Tail));
+      memcpy (Tail, p, Len - i);
+      p = Tail;
+    }
+    Delims = 0;
+    Quotes = 0;
+    for (k = 0; k < 64; k += 16) {
+      Block = _mm_loadu_si128 ((const __m128i *) (p + k));
+      Delims |= (uint64_t) (uint16_t) _mm_movemask_epi8 (_mm_cmpeq_epi8 (Block, D)) << k;
+      Quotes |= (uint64_t) (uint16_t) _mm_movemask_epi8 (_mm_cmpeq_epi8 (Block, Q)) << k;
+    }
+    if (Len - i < 64) {
+      Delims &= ((uint64_t) 1 << (Len - i)) - 1;
+      Quotes &= ((uint64_t) 1 << (Len - i)) - 1;
+    }
+    if ((Quotes | Carry) != 0) {
+      AnyQuote |= Quotes;
+      Inside = PrefixXor (Quotes) ^ Carry;
+      Carry = (uint64_t) ((int64_t) Inside >> 63);
+      Delims &= ~Inside;
+    }
+    n = EmitBits (Delims, i, Pos, n, MaxPos);
+  }
+  *Quoted = (AnyQuote != 0);
+  return (n);
+}
+#endif
+
+/*
+   The widest version this cpu runs, picked on the first call.
+*/
+static SplitFn PickSplit (void)
+{
+  static SplitFn Fn = NULL;
+
+  if (Fn != NULL) return (Fn);
+  Fn = SplitScalar;
+#ifdef HAVE_X86_SIMD
+  __builtin_cpu_init ();
+  if (__builtin_cpu_supports ("avx2") && __builtin_cpu_supports ("pclmul")) Fn = SplitAvx2;
+  else if (__builtin_cpu_supports ("sse4.2") && __builtin_cpu_supports ("pclmul")) Fn = SplitSse42;
+#endif
+  return (Fn);
+}
+
+/*
+   The offsets of the Delim bytes of Buf that are outside quotes, counting
+   quotes by parity only, in Pos. Stops at MaxPos of them, so a return of
+   MaxPos may mean there are more. *Quoted is set when Buf has a quote at
+   all; without one every Delim is a separator.
+*/
+size_t CsvSeparators (const char *Buf, size_t Len, char Delim, char Quote, size_t *Pos, size_t MaxPos, int *Quoted)
+{
+  return (PickSplit () (Buf, Len, Delim, Quote, Pos, MaxPos, Quoted));
+}
@@ -0,0 +1,13 @@
+#include <stdint.h>
+#include <stddef.h>
+
+#ifdef __cplusplus //inform the compiler that these are C functions if we are using a c++ compiler
+extern "C"
+{
+#endif
+
+    size_t CsvSeparators(const char *Buf, size_t Len, char Delim, char Quote, size_t *Pos, size_t MaxPos, int *Quoted);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,401 @@
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include "vfileio.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#ifdef HAVE_SYS_SENDFILE_H
+#include <sys/sendfile.h>
+#endif
+
+#define COPY_BUFSIZE  (4 * 1024 * 1024)   // user-space fallback buffer
+#define COPY_CHUNK    (1024 * 1024 * 1024) // max bytes handed to the kernel per call
+#define STREAM_CHUNK  (8 * 1024 * 1024)    // StreamFileRange copies and drops this much at a time
+#define DIRECT_ALIGN  (4096)               // O_DIRECT buffer, offset and length alignment
+
+/*
+   Each transfer method moves as much of [*Offset, *Offset + *Left) as it can
+   and advances both. It returns 0 when the range is done (or the input hit
+   EOF early), and -1 with errno set when it stopped. The caller decides from
+   errno whether the next method is worth a try.
+*/
+typedef ssize_t (*TransferFn) (int InFd, off_t *Offset, size_t Len, int OutFd);
+
+#ifdef HAVE_COPY_FILE_RANGE
+static ssize_t TransferCopyFileRange (int InFd, off_t *Offset, size_t Len, int OutFd)
+{
+  return copy_file_range (InFd, Offset, OutFd, NULL, Len, 0);
+}
+#endif
+
+#ifdef HAVE_SPLICE
+static ssize_t TransferSplice (int InFd, off_t *Offset, size_t Len, int OutFd)
+{
+  return splice (InFd, Offset, OutFd, NULL, Len, SPLICE_F_MOVE | SPLICE_F_MORE);
+}
+#endif
+
+#ifdef HAVE_SENDFILE
+static ssize_t TransferSendfile (int InFd, off_t *Offset, size_t Len, int OutFd)
+{
+  return sendfile (OutFd, InFd, Offset, Len);
+}
+#endif
+
+static int RunTransfer (TransferFn Fn, int InFd, off_t *Offset, off_t *Left, int OutFd)
+{
+  ssize_t n;
+  size_t Chunk;
+
+  while (*Left > 0) {
+    Chunk = (*Left > COPY_CHUNK) ? COPY_CHUNK : (size_t) *Left;
+    n = Fn (InFd, Offset, Chunk, OutFd);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      return (-1);
+    }
+    if (n == 0) *Left = 0;   // input is shorter than we were told, nothing more to move
+    else *Left -= n;
+  }
+  return (0);
+}
+
+/*
+   errno values meaning "this method does not apply to these descriptors",
+   as opposed to a real I/O failure.
+*/
+static int TransferUnsupported (int err)
+{
+  return (err == EINVAL) || (err == ENOSYS) || (err == EXDEV) || (err == EBADF) ||
+         (err == EOPNOTSUPP) || (err == ETXTBSY) || (err == EPERM);
+}
+
+int WriteAll (int Fd, const char *Buf, size_t Len)
+{
+  ssize_t n;
+
+  while (Len > 0) {
+    n = write (Fd, Buf, Len);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      return (-1);
+    }
+    Buf += n;
+    Len -= n;
+  }
+  return (0);
+}
+
+static int CopyPread (int InFd, off_t Offset, off_t Left, int OutFd)
+{
+  char *Buf;
+  ssize_t n;
+  size_t Chunk;
+
+  Buf = (char *) malloc (COPY_BUFSIZE);
+  if (Buf == NULL) return (-1);
+
+  while (Left > 0) {
+    Chunk = (Left > COPY_BUFSIZE) ? COPY_BUFSIZE : (size_t) Left;
+    n = pread (InFd, Buf, Chunk, Offset);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      free (Buf);
+      return (-1);
+    }
+    if (n == 0) break;
+    if (WriteAll (OutFd, Buf, n) != 0) {
+      free (Buf);
+      return (-1);
+    }
+    Offset += n;
+    Left -= n;
+  }
+
+  free (Buf);
+  return (0);
+}
+
+/*
+   Copies Len bytes starting at Offset of InFd to the current position of OutFd.
+   InFd's file position is left alone. The kernel does the copy where it can:
+   copy_file_range when OutFd is a regular file, splice into pipes, sendfile
+   into sockets (and as a second try for the others). A large-buffer
+   pread/write loop covers everything else, e.g. a terminal.
+   Returns 0 on success, -1 with errno set on failure.
+*/
+int CopyFileRange (int InFd, off_t Offset, off_t Len, int OutFd)
+{
+  struct stat statbuf;
+  TransferFn Methods [3];
+  int NumMethods = 0;
+  int i;
+
+  if (Len <= 0) return (0);
+  if (fstat (OutFd, &statbuf) != 0) return (-1);
+
+  if (S_ISREG (statbuf.st_mode)) {
+#ifdef HAVE_COPY_FILE_RANGE
+    Methods [NumMethods++] = TransferCopyFileRange;
+#endif
+#ifdef HAVE_SENDFILE
+    Methods [NumMethods++] = TransferSendfile;
+#endif
+  } else if (S_ISFIFO (statbuf.st_mode)) {
+#ifdef HAVE_SPLICE
+    Methods [NumMethods++] = TransferSplice;
+#endif
+#ifdef HAVE_SENDFILE
+    Methods [NumMethods++] = TransferSendfile;
+#endif
+  } else if (S_ISSOCK (statbuf.st_mode)) {
+#ifdef HAVE_SENDFILE
+    Methods [NumMethods++] = TransferSendfile;
+#endif
+  }
+
+  for (i = 0; i < NumMethods; i++) {
+    if (RunTransfer (Methods [i], InFd, &Offset, &Len, OutFd) == 0) return (0);
+    if (!TransferUnsupported (errno)) return (-1);
+  }
+
+  return (CopyPread (InFd, Offset, Len, OutFd));
+}
+
+/*
+   Tells the kernel the pages of [Offset, Offset + Len) of Fd won't be
+   needed again. Only clean pages go, so for an output file call it once
+   they are written back. Does nothing where posix_fadvise is missing.
+*/
+void DropFileCache (int Fd, off_t Offset, off_t Len)
+{
+#ifdef HAVE_POSIX_FADVISE
+  if (Len > 0) posix_fadvise (Fd, Offset, Len, POSIX_FADV_DONTNEED);
+#endif
+}
+
+/*
+   Moves Len bytes from *Offset of DirectFd, an O_DIRECT descriptor, to
+   OutFd. Reads are widened to DIRECT_ALIGN boundaries and the extra bytes
+   are left out of the write. Advances *Offset and *Len as it goes, so a
+   caller whose filesystem refuses O_DIRECT (EINVAL) can finish the rest
+   another way.
+*/
+static int CopyDirect (int DirectFd, off_t *Offset, off_t *Len, int OutFd)
+{
+  void *Buf;
+  off_t Aligned;
+  off_t Skip;
+  off_t Take;
+  ssize_t n;
+
+  if (posix_memalign (&Buf, DIRECT_ALIGN, STREAM_CHUNK) != 0) {
+    errno = EINVAL;
+    return (-1);
+  }
+
+  while (*Len > 0) {
+    Aligned = *Offset & ~((off_t) DIRECT_ALIGN - 1);
+    Skip = *Offset - Aligned;
+    n = pread (DirectFd, Buf, STREAM_CHUNK, Aligned);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      free (Buf);
+      return (-1);
+    }
+    if (n <= Skip) break;   // input ends early
+    Take = n - Skip;
+    if (Take > *Len) Take = *Len;
+    if (WriteAll (OutFd, (char *) Buf + Skip, Take) != 0) {
+      free (Buf);
+      return (-1);
+    }
+    *Offset += Take;
+    *Len -= Take;
+  }
+
+  free (Buf);
+  return (0);
+}
+
+/*
+   CopyFileRange for big streaming reads that shouldn't take over the page
+   cache. The range is marked sequential and copied STREAM_CHUNK at a time;
+   the next chunk is read ahead and the one just copied is dropped again.
+   A regular output file is written back behind the copy, one chunk behind,
+   and its pages dropped too, so the cache footprint stays at a few chunks
+   however big the range is. With DirectFd >= 0 (the same file opened
+   O_DIRECT) the input bypasses the cache altogether; if the filesystem
+   won't do O_DIRECT, the rest is copied the cached way.
+   Returns 0 on success, -1 with errno set on failure.
+*/
+int StreamFileRange (int InFd, int DirectFd, off_t Offset, off_t Len, int OutFd)
+{
+  struct stat statbuf;
+  off_t Chunk;
+  off_t OutPos = -1;
+  off_t PrevPos = -1;
+  off_t PrevLen = 0;
+
+  if (Len <= 0) return (0);
+
+  if (DirectFd >= 0) {
+    if (CopyDirect (DirectFd, &Offset, &Len, OutFd) == 0) return (0);
+    if (errno != EINVAL) return (-1);
+  }
+
+#ifdef HAVE_POSIX_FADVISE
+  posix_fadvise (InFd, Offset, Len, POSIX_FADV_SEQUENTIAL);
+#endif
+  if ((fstat (OutFd, &statbuf) == 0) && (S_ISREG (statbuf.st_mode))) OutPos = lseek (OutFd, 0, SEEK_CUR);
+
+  while (Len > 0) {
+    Chunk = (Len > STREAM_CHUNK) ? STREAM_CHUNK : Len;
+#ifdef HAVE_POSIX_FADVISE
+    if (Len > Chunk) posix_fadvise (InFd, Offset + Chunk, (Len - Chunk > STREAM_CHUNK) ? STREAM_CHUNK : Len - Chunk, POSIX_FADV_WILLNEED);
+#endif
+    if (CopyFileRange (InFd, Offset, Chunk, OutFd) != 0) return (-1);
+    DropFileCache (InFd, Offset, Chunk);
+
+    if (OutPos >= 0) {
+#ifdef HAVE_SYNC_FILE_RANGE
+      // start writing this chunk back, wait for the previous one and let it go
+      sync_file_range (OutFd, OutPos, Chunk, SYNC_FILE_RANGE_WRITE);
+      if (PrevLen > 0) {
+        sync_file_range (OutFd, PrevPos, PrevLen, SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+        DropFileCache (OutFd, PrevPos, PrevLen);
+      }
+#endif
+      PrevPos = OutPos;
+      PrevLen = Chunk;
+      OutPos += Chunk;
+    }
+    Offset += Chunk;
+    Len -= Chunk;
+  }
+  return (0);
+}
+
+/*
+   Opens every file in Names, in that order, as one stream. The descriptors
+   are close-on-exec so worker commands don't inherit hundreds of them.
+   Returns 0 on success, -1 after saying which file failed.
+*/
+int FileSetOpen (struct FileSet *Set, char **Names, int NumFiles)
+{
+  struct stat statbuf;
+  int i;
+
+  Set -> NumFiles = NumFiles;
+  Set -> Names = Names;
+  Set -> Fds = (int *) malloc (NumFiles * sizeof (int));
+  Set -> Starts = (off_t *) malloc ((NumFiles + 1) * sizeof (off_t));
+  if ((Set -> Fds == NULL) || (Set -> Starts == NULL)) {
+    fprintf (stderr, "Out of memory for %d files\n", NumFiles);
+    return (-1);
+  }
+
+  Set -> NoCache = 0;
+  Set -> Starts [0] = 0;
+  for (i = 0; i < NumFiles; i++) {
+    Set -> Fds [i] = open (Names [i], O_RDONLY | O_CLOEXEC);
+    if ((Set -> Fds [i] < 0) || (fstat (Set -> Fds [i], &statbuf) != 0)) {
+      fprintf (stderr, "Can't open [%s]\n", Names [i]);
+      Set -> NumFiles = i + (Set -> Fds [i] >= 0);
+      FileSetClose (Set);
+      return (-1);
+    }
+    Set -> Starts [i + 1] = Set -> Starts [i] + statbuf.st_size;
+  }
+  return (0);
+}
+
+void FileSetClose (struct FileSet *Set)
+{
+  int i;
+
+  for (i = 0; i < Set -> NumFiles; i++) close (Set -> Fds [i]);
+  free (Set -> Fds);
+  free (Set -> Starts);
+  Set -> Fds = NULL;
+  Set -> Starts = NULL;
+  Set -> NumFiles = 0;
+}
+
+/*
+   The file holding stream byte Offset, skipping empty files.
+*/
+static int FileSetFind (struct FileSet *Set, off_t Offset)
+{
+  int lo = 0;
+  int hi = Set -> NumFiles - 1;
+  int mid;
+
+  while (lo < hi) {
+    mid = lo + (hi - lo + 1) / 2;
+    if (Set -> Starts [mid] <= Offset) lo = mid;
+    else hi = mid - 1;
+  }
+  while ((lo < Set -> NumFiles - 1) && (Set -> Starts [lo + 1] <= Offset)) lo++;
+  return (lo);
+}
+
+/*
+   pread on the stream. Reads can span file edges, a short count only
+   happens at the end of the last file.
+*/
+ssize_t FileSetPread (struct FileSet *Set, void *Buf, size_t Len, off_t Offset)
+{
+  size_t Done = 0;
+  size_t Want;
+  ssize_t n;
+  int i;
+
+  if ((Set -> NumFiles == 0) || (Offset >= Set -> Starts [Set -> NumFiles])) return (0);
+
+  for (i = FileSetFind (Set, Offset); (i < Set -> NumFiles) && (Done < Len); i++) {
+    while ((Done < Len) && (Offset < Set -> Starts [i + 1])) {
+      Want = Len - Done;
+      if ((off_t) Want > Set -> Starts [i + 1] - Offset) Want = Set -> Starts [i + 1] - Offset;
+      n = pread (Set -> Fds [i], (char *) Buf + Done, Want, Offset - Set -> Starts [i]);
+      if (n < 0) {
+        if (errno == EINTR) continue;
+        return (-1);
+      }
+      if (n == 0) return (Done);   // the file shrank under us
+      if (Set -> NoCache) DropFileCache (Set -> Fds [i], Offset - Set -> Starts [i], n);
+      Done += n;
+      Offset += n;
+    }
+  }
+  return (Done);
+}
+
+/*
+   CopyFileRange for a stretch of the stream, one file at a time.
+*/
+int FileSetCopyRange (struct FileSet *Set, off_t Offset, off_t Len, int OutFd)
+{
+  off_t Chunk;
+  int i;
+
+  if ((Len <= 0) || (Set -> NumFiles == 0)) return (0);
+
+  for (i = FileSetFind (Set, Offset); (i < Set -> NumFiles) && (Len > 0); i++) {
+    Chunk = Set -> Starts [i + 1] - Offset;
+    if (Chunk > Len) Chunk = Len;
+    if (Chunk <= 0) continue;
+    if (Set -> NoCache) {
+      if (StreamFileRange (Set -> Fds [i], -1, Offset - Set -> Starts [i], Chunk, OutFd) != 0) return (-1);
+    } else if (CopyFileRange (Set -> Fds [i], Offset - Set -> Starts [i], Chunk, OutFd) != 0) return (-1);
+    Offset += Chunk;
+    Len -= Chunk;
+  }
+  return (0);
+}
@@ -0,0 +1,30 @@
+#include <sys/types.h>
+
+/*
+   Several files read back to back as one byte stream, like cat would.
+*/
+struct FileSet {
+  int NumFiles;
+  char **Names;
+  int *Fds;
+  off_t *Starts;    // Starts[i] is where file i begins in the stream, Starts[NumFiles] its total size
+  int NoCache;      // drop what was read from the page cache, see StreamFileRange
+};
+
+#ifdef __cplusplus //inform the compiler that these are C functions if we are using a c++ compiler
+extern "C"
+{
+#endif
+
+    int CopyFileRange(int InFd, off_t Offset, off_t Len, int OutFd);
+    int WriteAll(int Fd, const char *Buf, size_t Len);
+    int StreamFileRange(int InFd, int DirectFd, off_t Offset, off_t Len, int OutFd);
+    void DropFileCache(int Fd, off_t Offset, off_t Len);
+    int FileSetOpen(struct FileSet *Set, char **Names, int NumFiles);
+    void FileSetClose(struct FileSet *Set);
+    ssize_t FileSetPread(struct FileSet *Set, void *Buf, size_t Len, off_t Offset);
+    int FileSetCopyRange(struct FileSet *Set, off_t Offset, off_t Len, int OutFd);
+
+#ifdef __cplusplus
+}
+#endif
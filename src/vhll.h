@@ -0,0 +1,33 @@
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+   A HyperLogLog sketch of how many distinct values a stream has. The top
+   HLL_P bits of a value's 64 bit hash pick one of 2^HLL_P registers, which
+   keeps the longest run of leading zeros seen in the rest. The registers
+   are 6 bits each, packed, so 2048 of them take 1.5KB, for a standard error
+   of about 2.3% at any count. Two sketches merge by taking the larger of
+   each register.
+*/
+#define HLL_P       (11)
+#define HLL_REGS    (1 << HLL_P)
+#define HLL_BYTES   (HLL_REGS * 6 / 8 + 1)    // one spare, registers are read 16 bits at a time
+
+struct Hll {
+  unsigned char Regs [HLL_BYTES];
+};
+
+#ifdef __cplusplus //inform the compiler that these are C functions if we are using a c++ compiler
+extern "C"
+{
+#endif
+
+    uint64_t HllHash(const char *Buf, size_t Len);
+    void HllInit(struct Hll *H);
+    void HllAdd(struct Hll *H, uint64_t Hash);
+    void HllMerge(struct Hll *Dst, const struct Hll *Src);
+    double HllEstimate(const struct Hll *H);
+
+#ifdef __cplusplus
+}
+#endif
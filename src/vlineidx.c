@@ -0,0 +1,296 @@
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include "vlineidx.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#define INDEX_BUFSIZE     (8 * 1024 * 1024)   // read per step while building
+#define INDEX_INTERVAL    (256)               // lines per checkpoint
+
+struct IndexWriter {
+  FILE *fp;
+  uint64_t Pos;               // bytes written so far
+  uint64_t *Checkpoints;
+  uint64_t NumCheckpoints;
+  uint64_t MaxCheckpoints;
+  uint64_t NumLines;
+  off_t LastStart;
+};
+
+static int PutVarint (struct IndexWriter *W, uint64_t v)
+{
+  unsigned char Buf [10];
+  int n = 0;
+
+  while (v >= 0x80) {
+    Buf [n++] = (unsigned char) (v | 0x80);
+    v >>= 7;
+  }
+  Buf [n++] = (unsigned char) v;
+  if (fwrite (Buf, 1, n, W -> fp) != (size_t) n) return (-1);
+  W -> Pos += n;
+  return (0);
+}
+
+// a corrupt index can't make it read past End
+static uint64_t GetVarint (const unsigned char **p, const unsigned char *End)
+{
+  uint64_t v = 0;
+  int Shift = 0;
+
+  while ((*p < End) && (**p & 0x80)) {
+    if (Shift < 64) v |= (uint64_t) (**p & 0x7f) << Shift;
+    Shift += 7;
+    (*p)++;
+  }
+  if (*p == End) return (v);
+  if (Shift < 64) v |= (uint64_t) **p << Shift;
+  (*p)++;
+  return (v);
+}
+
+/*
+   A line starts at Start. Every Interval'th one becomes a checkpoint, the
+   rest are written as their distance from the line before.
+*/
+static int AddLine (struct IndexWriter *W, off_t Start)
+{
+  uint64_t *Grown;
+
+  if (W -> NumLines % INDEX_INTERVAL == 0) {
+    if (W -> NumCheckpoints == W -> MaxCheckpoints) {
+      W -> MaxCheckpoints = (W -> MaxCheckpoints == 0) ? 1024 : W -> MaxCheckpoints * 2;
+      Grown = (uint64_t *) realloc (W -> Checkpoints, W -> MaxCheckpoints * 2 * sizeof (uint64_t));
+      if (Grown == NULL) return (-1);
+      W -> Checkpoints = Grown;
+    }
+    W -> Checkpoints [W -> NumCheckpoints * 2] = Start;
+    W -> Checkpoints [W -> NumCheckpoints * 2 + 1] = W -> Pos;
+    W -> NumCheckpoints++;
+  }
+  else if (PutVarint (W, Start - W -> LastStart) != 0) return (-1);
+
+  W -> LastStart = Start;
+  W -> NumLines++;
+  return (0);
+}
+
+/*
+   Reads all of Fd (described by St) and writes the index of its line
+   starts to IndexName, by way of a temp file renamed into place. A last
+   line without a newline still counts. Returns 0 on success, -1 with errno
+   set.
+*/
+int LineIndexBuild (int Fd, struct stat *St, char *IndexName)
+{
+  struct IndexWriter W;
+  struct LineIndexHeader Header;
+  char *TmpName;
+  char *Buf;
+  char *p;
+  char *End;
+  off_t Offset = 0;
+  ssize_t n;
+  int TmpFd;
+  int SavedErrno;
+  mode_t Mask;
+
+  memset (&W, 0, sizeof (W));
+  TmpName = (char *) malloc (strlen (IndexName) + 8);
+  Buf = (char *) malloc (INDEX_BUFSIZE);
+  if ((TmpName == NULL) || (Buf == NULL)) {
+    free (TmpName);
+    free (Buf);
+    errno = ENOMEM;
+    return (-1);
+  }
+  sprintf (TmpName, "%s.XXXXXX", IndexName);
+  TmpFd = mkstemp (TmpName);
+  if ((TmpFd < 0) || ((W.fp = fdopen (TmpFd, "wb")) == NULL)) {
+    SavedErrno = errno;
+    if (TmpFd >= 0) {
+      close (TmpFd);
+      unlink (TmpName);
+    }
+    free (TmpName);
+    free (Buf);
+    errno = SavedErrno;
+    return (-1);
+  }
+  setvbuf (W.fp, NULL, _IOFBF, 1024 * 1024);
+  Mask = umask (0);   // mkstemp made it 0600, give it the mode a plain create would
+  umask (Mask);
+  fchmod (TmpFd, 0666 & ~Mask);
+
+  // room for the header, it is filled in once the counts are known
+  memset (&Header, 0, sizeof (Header));
+  if (fwrite (&Header, sizeof (Header), 1, W.fp) != 1) goto fail;
+  W.Pos = sizeof (Header);
+
+#ifdef HAVE_POSIX_FADVISE
+  posix_fadvise (Fd, 0, St -> st_size, POSIX_FADV_SEQUENTIAL);
+#endif
+  if ((St -> st_size > 0) && (AddLine (&W, 0) != 0)) goto fail;
+  while (Offset < St -> st_size) {
+    n = pread (Fd, Buf, INDEX_BUFSIZE, Offset);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      goto fail;
+    }
+    if (n == 0) break;
+    End = Buf + n;
+    for (p = Buf; (p = (char *) memchr (p, '\n', End - p)) != NULL; p++) {
+      if (Offset + (p - Buf) + 1 < St -> st_size) {
+        if (AddLine (&W, Offset + (p - Buf) + 1) != 0) goto fail;
+      }
+    }
+    Offset += n;
+  }
+
+  memcpy (Header.Magic, LINE_INDEX_MAGIC, sizeof (Header.Magic));
+  Header.FileSize = St -> st_size;
+  Header.MtimeSec = St -> st_mtim.tv_sec;
+  Header.MtimeNsec = St -> st_mtim.tv_nsec;
+  Header.NumLines = W.NumLines;
+  Header.Interval = INDEX_INTERVAL;
+  Header.NumCheckpoints = W.NumCheckpoints;
+
+  // keep the table 8 byte aligned so it can be used straight from the map
+  while (W.Pos % sizeof (uint64_t) != 0) {
+    if (fputc (0, W.fp) == EOF) goto fail;
+    W.Pos++;
+  }
+  Header.CheckpointsAt = W.Pos;
+  if ((W.NumCheckpoints > 0) &&
+      (fwrite (W.Checkpoints, 2 * sizeof (uint64_t), W.NumCheckpoints, W.fp) != W.NumCheckpoints)) goto fail;
+  if ((fseeko (W.fp, 0, SEEK_SET) != 0) || (fwrite (&Header, sizeof (Header), 1, W.fp) != 1)) goto fail;
+  if (fclose (W.fp) != 0) {
+    W.fp = NULL;
+    goto fail;
+  }
+  W.fp = NULL;
+  if (rename (TmpName, IndexName) != 0) goto fail;
+
+  free (W.Checkpoints);
+  free (TmpName);
+  free (Buf);
+  return (0);
+
+fail:
+  SavedErrno = (errno != 0) ? errno : EIO;
+  if (W.fp != NULL) fclose (W.fp);
+  unlink (TmpName);
+  free (W.Checkpoints);
+  free (TmpName);
+  free (Buf);
+  errno = SavedErrno;
+  return (-1);
+}
+
+/*
+   Maps the index and checks it against St, the file it should describe.
+   Returns 0 on success, -1 with errno set: ESTALE when the file has
+   changed since the index was built, EINVAL when it isn't an index.
+*/
+int LineIndexOpen (struct LineIndex *Idx, char *IndexName, struct stat *St)
+{
+  struct stat IdxSt;
+  struct LineIndexHeader *H;
+  uint64_t c;
+  int Fd;
+  int SavedErrno;
+
+  memset (Idx, 0, sizeof (*Idx));
+  Fd = open (IndexName, O_RDONLY | O_CLOEXEC);
+  if (Fd < 0) return (-1);
+  if (fstat (Fd, &IdxSt) != 0) {
+    SavedErrno = errno;
+    close (Fd);
+    errno = SavedErrno;
+    return (-1);
+  }
+  if (IdxSt.st_size < (off_t) sizeof (struct LineIndexHeader)) {
+    close (Fd);
+    errno = EINVAL;
+    return (-1);
+  }
+
+  Idx -> MapLen = IdxSt.st_size;
+  Idx -> Map = (unsigned char *) mmap (NULL, Idx -> MapLen, PROT_READ, MAP_SHARED, Fd, 0);
+  SavedErrno = errno;
+  close (Fd);
+  if (Idx -> Map == MAP_FAILED) {
+    Idx -> Map = NULL;
+    errno = SavedErrno;
+    return (-1);
+  }
+
+  H = Idx -> Header = (struct LineIndexHeader *) Idx -> Map;
+  if ((memcmp (H -> Magic, LINE_INDEX_MAGIC, sizeof (H -> Magic)) != 0) || (H -> Interval == 0) ||
+      (H -> CheckpointsAt % sizeof (uint64_t) != 0) || (H -> CheckpointsAt > Idx -> MapLen) ||
+      (H -> NumCheckpoints > (Idx -> MapLen - H -> CheckpointsAt) / (2 * sizeof (uint64_t))) ||
+      (H -> NumCheckpoints != (H -> NumLines + H -> Interval - 1) / H -> Interval)) {
+    LineIndexClose (Idx);
+    errno = EINVAL;
+    return (-1);
+  }
+  if ((H -> FileSize != (uint64_t) St -> st_size) || (H -> MtimeSec != (int64_t) St -> st_mtim.tv_sec) ||
+      (H -> MtimeNsec != (int64_t) St -> st_mtim.tv_nsec)) {
+    LineIndexClose (Idx);
+    errno = ESTALE;
+    return (-1);
+  }
+
+  // each checkpoint's varints start between the header and the checkpoint table
+  Idx -> Checkpoints = (uint64_t *) (Idx -> Map + H -> CheckpointsAt);
+  for (c = 0; c < H -> NumCheckpoints; c++) {
+    if ((Idx -> Checkpoints [c * 2 + 1] < sizeof (struct LineIndexHeader)) ||
+        (Idx -> Checkpoints [c * 2 + 1] > H -> CheckpointsAt)) {
+      LineIndexClose (Idx);
+      errno = EINVAL;
+      return (-1);
+    }
+  }
+  Idx -> NumLines = H -> NumLines;
+#ifdef MADV_RANDOM
+  madvise (Idx -> Map, Idx -> MapLen, MADV_RANDOM);
+#endif
+  return (0);
+}
+
+void LineIndexClose (struct LineIndex *Idx)
+{
+  if (Idx -> Map != NULL) munmap (Idx -> Map, Idx -> MapLen);
+  memset (Idx, 0, sizeof (*Idx));
+}
+
+/*
+   Where line number Line (from 0, less than NumLines) starts and how long
+   it is, newline included.
+*/
+void LineIndexLookup (struct LineIndex *Idx, uint64_t Line, off_t *Start, off_t *Len)
+{
+  uint64_t Interval = Idx -> Header -> Interval;
+  uint64_t c = Line / Interval;
+  uint64_t k;
+  uint64_t Off;
+  const unsigned char *p;
+  const unsigned char *End = Idx -> Map + Idx -> Header -> CheckpointsAt;
+
+  Off = Idx -> Checkpoints [c * 2];
+  p = Idx -> Map + Idx -> Checkpoints [c * 2 + 1];
+  for (k = c * Interval; k < Line; k++) Off += GetVarint (&p, End);
+  *Start = Off;
+
+  if (Line + 1 == Idx -> NumLines) *Len = Idx -> Header -> FileSize - Off;
+  else if ((Line + 1) % Interval == 0) *Len = Idx -> Checkpoints [(c + 1) * 2] - Off;
+  else *Len = GetVarint (&p, End);
+}
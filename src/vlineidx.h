@@ -0,0 +1,48 @@
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+/*
+   A line index is a sidecar file of line start offsets. The header is
+   followed by the line lengths as LEB128 varints (most lines take a byte or
+   two), and a table of checkpoints at the end: every Interval'th line's
+   start offset and where its run of varints begins. Finding line n is a
+   table lookup plus at most Interval - 1 varint decodes, straight out of
+   the mapped file. Numbers are in host byte order, an index is not meant
+   to travel between machines.
+*/
+#define LINE_INDEX_MAGIC    "RXLIDX1"
+#define LINE_INDEX_SUFFIX   ".ridx"
+
+struct LineIndexHeader {
+  char Magic [8];
+  uint64_t FileSize;          // of the indexed file, with the mtime to tell a stale index
+  int64_t MtimeSec;
+  int64_t MtimeNsec;
+  uint64_t NumLines;
+  uint64_t Interval;          // lines per checkpoint
+  uint64_t NumCheckpoints;
+  uint64_t CheckpointsAt;     // file offset of the checkpoint table
+};
+
+struct LineIndex {
+  unsigned char *Map;
+  size_t MapLen;
+  struct LineIndexHeader *Header;
+  uint64_t *Checkpoints;      // pairs of line start, varint offset
+  uint64_t NumLines;
+};
+
+#ifdef __cplusplus //inform the compiler that these are C functions if we are using a c++ compiler
+extern "C"
+{
+#endif
+
+    int LineIndexBuild(int Fd, struct stat *St, char *IndexName);
+    int LineIndexOpen(struct LineIndex *Idx, char *IndexName, struct stat *St);
+    void LineIndexClose(struct LineIndex *Idx);
+    void LineIndexLookup(struct LineIndex *Idx, uint64_t Line, off_t *Start, off_t *Len);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,266 @@
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include "vfileio.h"
+#include "vpartition.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+
+#define READ_CHUNK        (4 * 1024 * 1024)    // input read per step
+#define PART_BUF_MAX      (1024 * 1024)        // write buffer per partition per thread
+#define PART_BUF_MIN      (64 * 1024)          // don't start another thread if the buffers would get smaller than this
+#define PART_BUF_LEAST    (4 * 1024)           // and never go below this, even on a single thread
+#define PART_BUF_BUDGET   (256 * 1024 * 1024)  // all write buffers together
+
+#define FNV_OFFSET  (0xcbf29ce484222325ULL)
+#define FNV_PRIME   (0x100000001b3ULL)
+
+/*
+   What the threads share: the input, the key and one output per partition.
+   A partition's output is locked only while a full buffer is written out.
+*/
+struct PartitionOut {
+  int *Fds;
+  pthread_mutex_t *Locks;
+  int NumParts;
+  int *Fields;
+  int NumFields;
+  char IsDelim [256];
+  size_t BufSize;
+};
+
+struct PartitionJob {
+  struct FileSet *In;
+  struct PartitionOut *Out;
+  off_t Head;
+  off_t Tail;
+  int Started;
+  int Status;
+};
+
+/*
+   FNV-1a over the key fields of one line (no newline in Line), a zero
+   byte between fields so "a","bc" and "ab","c" differ. Fields are cut at
+   every delimiter character, as Tokenize does, and a missing field is
+   empty. The hash doesn't depend on the machine, so separate runs and
+   hosts send a key to the same partition.
+*/
+static uint64_t HashKey (char *Line, size_t Len, struct PartitionOut *Out)
+{
+  uint64_t h = FNV_OFFSET;
+  size_t FieldStart;
+  size_t i = 0;
+  int Field = 0;
+  int k;
+
+  if ((Len > 0) && (Line [Len - 1] == '\r')) Len--;
+
+  for (k = 0; k < Out -> NumFields; k++) {
+    if (Out -> Fields [k] < Field) {
+      // fields listed out of order, start over
+      Field = 0;
+      i = 0;
+    }
+    while ((Field < Out -> Fields [k]) && (i <= Len)) {
+      while ((i < Len) && !Out -> IsDelim [(unsigned char) Line [i]]) i++;
+      i++;
+      Field++;
+    }
+    FieldStart = i;
+    if (i <= Len) {
+      while ((i < Len) && !Out -> IsDelim [(unsigned char) Line [i]]) {
+        h ^= (unsigned char) Line [i++];
+        h *= FNV_PRIME;
+      }
+    }
+    i = FieldStart;
+    h *= FNV_PRIME;   // the zero byte between fields
+  }
+  return (h);
+}
+
+static int FlushPart (struct PartitionOut *Out, int Part, char *Buf, size_t Len)
+{
+  int Status;
+
+  if (Len == 0) return (0);
+  pthread_mutex_lock (&Out -> Locks [Part]);
+  Status = WriteAll (Out -> Fds [Part], Buf, Len);
+  pthread_mutex_unlock (&Out -> Locks [Part]);
+  return (Status);
+}
+
+static void *PartitionThread (void *arg)
+{
+  struct PartitionJob *Job = (struct PartitionJob *) arg;
+  struct PartitionOut *Out = Job -> Out;
+  char *In;
+  char **Bufs;
+  size_t *Used;
+  size_t InSize = READ_CHUNK;
+  size_t Have = 0;
+  size_t Start;
+  size_t Len;
+  size_t Want;
+  char *nl;
+  char *p;
+  off_t Offset = Job -> Head;
+  ssize_t n;
+  int Part;
+  int Eof = 0;
+  int k;
+
+  Job -> Status = -1;
+  In = (char *) malloc (InSize + 1);
+  Bufs = (char **) calloc (Out -> NumParts, sizeof (char *));
+  Used = (size_t *) calloc (Out -> NumParts, sizeof (size_t));
+  if ((In == NULL) || (Bufs == NULL) || (Used == NULL)) goto done;
+  for (k = 0; k < Out -> NumParts; k++) {
+    if ((Bufs [k] = (char *) malloc (Out -> BufSize)) == NULL) goto done;
+  }
+
+  while (!Eof || (Have > 0)) {
+    if (!Eof) {
+      if (Have == InSize) {
+        // a line longer than the read buffer
+        p = (char *) realloc (In, InSize * 2 + 1);
+        if (p == NULL) goto done;
+        In = p;
+        InSize *= 2;
+      }
+      Want = InSize - Have;
+      if ((off_t) Want > Job -> Tail - Offset) Want = Job -> Tail - Offset;
+      n = (Want > 0) ? FileSetPread (Job -> In, In + Have, Want, Offset) : 0;
+      if (n < 0) goto done;
+      if (n == 0) Eof = 1;
+      Have += n;
+      Offset += n;
+    }
+
+    Start = 0;
+    while (Start < Have) {
+      nl = (char *) memchr (In + Start, '\n', Have - Start);
+      if (nl == NULL) {
+        if (!Eof) break;
+        In [Have++] = '\n';   // the input's last line has no newline, give it one so it stays a line
+        nl = In + Have - 1;
+      }
+      Len = nl - (In + Start) + 1;
+      Part = (int) (HashKey (In + Start, Len - 1, Out) % Out -> NumParts);
+
+      if (Used [Part] + Len > Out -> BufSize) {
+        if (FlushPart (Out, Part, Bufs [Part], Used [Part]) != 0) goto done;
+        Used [Part] = 0;
+      }
+      if (Len > Out -> BufSize) {
+        if (FlushPart (Out, Part, In + Start, Len) != 0) goto done;
+      } else {
+        memcpy (Bufs [Part] + Used [Part], In + Start, Len);
+        Used [Part] += Len;
+      }
+      Start += Len;
+    }
+    memmove (In, In + Start, Have - Start);
+    Have -= Start;
+  }
+
+  for (k = 0; k < Out -> NumParts; k++) {
+    if (FlushPart (Out, k, Bufs [k], Used [k]) != 0) goto done;
+  }
+  Job -> Status = 0;
+
+done:
+  if (Bufs != NULL) {
+    for (k = 0; k < Out -> NumParts; k++) free (Bufs [k]);
+  }
+  free (Bufs);
+  free (Used);
+  free (In);
+  return (NULL);
+}
+
+/*
+   How many threads PartitionLines should use at most for NumParts
+   partitions, so every thread's buffers still get PART_BUF_MIN each within
+   PART_BUF_BUDGET.
+*/
+int PartitionMaxThreads (int NumParts)
+{
+  size_t Max = PART_BUF_BUDGET / ((size_t) NumParts * PART_BUF_MIN);
+
+  return ((Max < 1) ? 1 : ((Max > INT32_MAX) ? INT32_MAX : (int) Max));
+}
+
+/*
+   Reads In once and appends each line to OutFds [hash (key fields) % NumParts].
+   Ranges holds NumRanges + 1 line aligned offsets; each range is read by its
+   own thread with its own buffer per partition, so lines of one partition
+   come out grouped by range rather than strictly in input order (in input
+   order for a single range). Returns 0 on success, -1 with errno set on a
+   read or write error.
+*/
+int PartitionLines (struct FileSet *In, off_t *Ranges, int NumRanges, int *Fields, int NumFields, char *DelimChrs, int *OutFds, int NumParts)
+{
+  struct PartitionOut Out;
+  struct PartitionJob *Jobs;
+  pthread_t *Threads;
+  int Status = 0;
+  char *p;
+  int t;
+  int k;
+
+  Out.Fds = OutFds;
+  Out.NumParts = NumParts;
+  Out.Fields = Fields;
+  Out.NumFields = NumFields;
+  memset (Out.IsDelim, 0, sizeof (Out.IsDelim));
+  for (p = DelimChrs; *p; p++) Out.IsDelim [(unsigned char) *p] = 1;
+  Out.BufSize = PART_BUF_BUDGET / ((size_t) NumRanges * NumParts);
+  if (Out.BufSize > PART_BUF_MAX) Out.BufSize = PART_BUF_MAX;
+  if (Out.BufSize < PART_BUF_LEAST) Out.BufSize = PART_BUF_LEAST;
+
+  Out.Locks = (pthread_mutex_t *) malloc (NumParts * sizeof (pthread_mutex_t));
+  Jobs = (struct PartitionJob *) calloc (NumRanges, sizeof (struct PartitionJob));
+  Threads = (pthread_t *) calloc (NumRanges, sizeof (pthread_t));
+  if ((Out.Locks == NULL) || (Jobs == NULL) || (Threads == NULL)) {
+    free (Out.Locks);
+    free (Jobs);
+    free (Threads);
+    errno = ENOMEM;
+    return (-1);
+  }
+  for (k = 0; k < NumParts; k++) pthread_mutex_init (&Out.Locks [k], NULL);
+
+  for (t = 0; t < NumRanges; t++) {
+    Jobs [t].In = In;
+    Jobs [t].Out = &Out;
+    Jobs [t].Head = Ranges [t];
+    Jobs [t].Tail = Ranges [t + 1];
+  }
+
+  // range 0 runs right here
+  for (t = 1; t < NumRanges; t++) {
+    Jobs [t].Started = (pthread_create (&Threads [t], NULL, PartitionThread, &Jobs [t]) == 0);
+  }
+  PartitionThread (&Jobs [0]);
+
+  for (t = 1; t < NumRanges; t++) {
+    if (Jobs [t].Started) pthread_join (Threads [t], NULL);
+    else PartitionThread (&Jobs [t]);  // couldn't start it, do it inline
+  }
+  for (t = 0; t < NumRanges; t++) {
+    if (Jobs [t].Status != 0) Status = -1;
+  }
+
+  for (k = 0; k < NumParts; k++) pthread_mutex_destroy (&Out.Locks [k]);
+  free (Out.Locks);
+  free (Jobs);
+  free (Threads);
+  return (Status);
+}
@@ -0,0 +1,15 @@
+#include <sys/types.h>
+
+struct FileSet;
+
+#ifdef __cplusplus //inform the compiler that these are C functions if we are using a c++ compiler
+extern "C"
+{
+#endif
+
+    int PartitionMaxThreads(int NumParts);
+    int PartitionLines(struct FileSet *In, off_t *Ranges, int NumRanges, int *Fields, int NumFields, char *DelimChrs, int *OutFds, int NumParts);
+
+#ifdef __cplusplus
+}
+#endif
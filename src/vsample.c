@@ -0,0 +1,193 @@
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include "vsample.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+
+/*
+   splitmix64. Small, fast, and each thread can have its own state, which
+   random() can't give.
+*/
+uint64_t SampleRandom (uint64_t *State)
+{
+  uint64_t z = (*State += 0x9e3779b97f4a7c15ULL);
+
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+  return (z ^ (z >> 31));
+}
+
+/*
+   Uniform in [0, n), with the draws past the last whole multiple of n
+   thrown back.
+*/
+uint64_t SampleRandomBelow (uint64_t *State, uint64_t n)
+{
+  uint64_t Limit = UINT64_MAX - (UINT64_MAX % n);
+  uint64_t r;
+
+  do {
+    r = SampleRandom (State);
+  } while (r >= Limit);
+  return (r % n);
+}
+
+/*
+   Uniform in (0, 1), never 0 so it is safe to take the log of.
+*/
+double SampleRandomUnit (uint64_t *State)
+{
+  return (((SampleRandom (State) >> 11) + 0.5) * (1.0 / 9007199254740992.0));
+}
+
+/*
+   How many failures before the first success, each try succeeding with
+   probability p: the gap to the next line kept when each is kept with
+   probability p.
+*/
+int64_t SampleGeometric (uint64_t *State, double p)
+{
+  double Gap;
+
+  if (p >= 1) return (0);
+  Gap = floor (log (SampleRandomUnit (State)) / log1p (-p));
+  return ((Gap < 9e18) ? (int64_t) Gap : INT64_MAX);
+}
+
+/*
+   One step of algorithm L for a full reservoir of Size that has seen Seen
+   lines: shrinks *W and returns the number of the line to take next, a
+   geometric jump away that grows as W shrinks. *W starts at 1.
+*/
+int64_t SampleNextL (uint64_t *State, int Size, double *W, int64_t Seen)
+{
+  double Jump;
+
+  *W *= exp (log (SampleRandomUnit (State)) / Size);
+  Jump = floor (log (SampleRandomUnit (State)) / log1p (-*W));
+  return ((Jump < 1e18) ? Seen + (int64_t) Jump : INT64_MAX);   // W can underflow on endless streams
+}
+
+static void ReservoirNext (struct Reservoir *R)
+{
+  R -> Next = SampleNextL (R -> Rng, R -> Size, &R -> W, R -> Seen);
+}
+
+static int ReservoirStore (struct Reservoir *R, int Slot, const char *Line, size_t Len)
+{
+  char *Grown;
+
+  if (Len > R -> Caps [Slot]) {
+    Grown = (char *) realloc (R -> Lines [Slot], Len);
+    if (Grown == NULL) return (-1);
+    R -> Lines [Slot] = Grown;
+    R -> Caps [Slot] = Len;
+  }
+  memcpy (R -> Lines [Slot], Line, Len);
+  R -> Lens [Slot] = Len;
+  return (0);
+}
+
+/*
+   An empty reservoir of Size lines, drawing on the random state Rng.
+   Returns 0, or -1 with errno set.
+*/
+int ReservoirInit (struct Reservoir *R, int Size, uint64_t *Rng)
+{
+  memset (R, 0, sizeof (*R));
+  R -> Size = Size;
+  R -> Rng = Rng;
+  R -> W = 1;
+  R -> Lines = (char **) calloc (Size + 1, sizeof (char *));
+  R -> Lens = (size_t *) calloc (Size + 1, sizeof (size_t));
+  R -> Caps = (size_t *) calloc (Size + 1, sizeof (size_t));
+  if ((R -> Lines == NULL) || (R -> Lens == NULL) || (R -> Caps == NULL)) {
+    ReservoirFree (R);
+    errno = ENOMEM;
+    return (-1);
+  }
+  return (0);
+}
+
+void ReservoirFree (struct Reservoir *R)
+{
+  int i;
+
+  if (R -> Lines != NULL) {
+    for (i = 0; i < R -> Size; i++) free (R -> Lines [i]);
+  }
+  free (R -> Lines);
+  free (R -> Lens);
+  free (R -> Caps);
+  memset (R, 0, sizeof (*R));
+}
+
+/*
+   The next line of the stream. It is copied in if the reservoir takes it.
+   Returns 0, or -1 with errno set when there is no memory for it.
+*/
+int ReservoirOffer (struct Reservoir *R, const char *Line, size_t Len)
+{
+  int Slot;
+
+  if (R -> Size <= 0) {
+    R -> Seen++;
+    return (0);
+  }
+  if (R -> Count < R -> Size) {
+    if (ReservoirStore (R, R -> Count, Line, Len) != 0) return (-1);
+    R -> Count++;
+    R -> Seen++;
+    if (R -> Count == R -> Size) ReservoirNext (R);
+    return (0);
+  }
+  if (R -> Seen == R -> Next) {
+    Slot = (int) SampleRandomBelow (R -> Rng, R -> Size);
+    if (ReservoirStore (R, Slot, Line, Len) != 0) return (-1);
+    R -> Seen++;
+    ReservoirNext (R);
+    return (0);
+  }
+  R -> Seen++;
+  return (0);
+}
+
+/*
+   How many of the coming lines the reservoir doesn't want; the caller may
+   step over them with ReservoirPass instead of offering each.
+*/
+int64_t ReservoirSkip (struct Reservoir *R)
+{
+  if ((R -> Size <= 0) || (R -> Count < R -> Size)) return ((R -> Size <= 0) ? INT64_MAX : 0);
+  return (R -> Next - R -> Seen);
+}
+
+void ReservoirPass (struct Reservoir *R, int64_t n)
+{
+  R -> Seen += n;
+}
+
+/*
+   Takes the line in Slot out of a finished reservoir, for drawing from it
+   without replacement. The last line moves into its place; the buffers
+   are swapped, not freed, so ReservoirFree still frees each once.
+*/
+void ReservoirRemove (struct Reservoir *R, int Slot)
+{
+  char *Line;
+  size_t Cap;
+
+  R -> Count--;
+  Line = R -> Lines [Slot];
+  Cap = R -> Caps [Slot];
+  R -> Lines [Slot] = R -> Lines [R -> Count];
+  R -> Lens [Slot] = R -> Lens [R -> Count];
+  R -> Caps [Slot] = R -> Caps [R -> Count];
+  R -> Lines [R -> Count] = Line;
+  R -> Caps [R -> Count] = Cap;
+}
@@ -0,0 +1,41 @@
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+   A fixed size uniform sample of a stream of lines, kept with Vitter's
+   algorithm L: once full, it works out how many lines to pass over before
+   the next one it takes, so it only needs random numbers for the lines it
+   keeps, not for every line.
+*/
+struct Reservoir {
+  int Size;
+  int Count;          // slots filled so far
+  int64_t Seen;       // lines offered or passed over
+  int64_t Next;       // the line number it takes next, once full
+  double W;
+  uint64_t *Rng;      // SampleRandom state, the caller's
+  char **Lines;
+  size_t *Lens;
+  size_t *Caps;
+};
+
+#ifdef __cplusplus //inform the compiler that these are C functions if we are using a c++ compiler
+extern "C"
+{
+#endif
+
+    uint64_t SampleRandom(uint64_t *State);
+    uint64_t SampleRandomBelow(uint64_t *State, uint64_t n);
+    double SampleRandomUnit(uint64_t *State);
+    int64_t SampleGeometric(uint64_t *State, double p);
+    int64_t SampleNextL(uint64_t *State, int Size, double *W, int64_t Seen);
+    int ReservoirInit(struct Reservoir *R, int Size, uint64_t *Rng);
+    void ReservoirFree(struct Reservoir *R);
+    int ReservoirOffer(struct Reservoir *R, const char *Line, size_t Len);
+    int64_t ReservoirSkip(struct Reservoir *R);
+    void ReservoirPass(struct Reservoir *R, int64_t n);
+    void ReservoirRemove(struct Reservoir *R, int Slot);
+
+#ifdef __cplusplus
+}
+#endif
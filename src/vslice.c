@@ -0,0 +1,348 @@
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include "vslice.h"
+#include "vstrutils.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#define SAMPLES_PER_BUCKET  (16)
+#define SAMPLE_MAXLINE      (128 * 1024)
+#define SAMPLE_SEED         (0x51ce5eedU)     // fixed so separate fslicer runs pick the same cuts
+
+#define CSV_WINDOW      (1024 * 1024)        // bytes read per step while looking for a boundary
+#define CSV_MAX_WINDOW  (16 * 1024 * 1024)   // give up speculating after this much and scan exactly
+#define CSV_UNRESOLVED  ((off_t) -2)
+
+/*
+   The CSV reader states, as get-fs reads a record: a field that starts with
+   a quote (after optional blanks) runs to the matching quote, "" inside it is
+   a literal quote, and a quote anywhere else is just data.
+*/
+#define CSV_FIELD_START   (0)   // outside quotes, nothing of this field seen yet
+#define CSV_UNQUOTED      (1)   // outside quotes, inside an unquoted field
+#define CSV_QUOTED        (2)   // inside a quoted field
+#define CSV_QUOTED_QUOTE  (3)   // saw a quote inside a quoted field, "" or the end of the quotes
+#define CSV_NUM_STATES    (4)
+
+// states in which a newline ends the record
+#define CSV_RECORD_END_STATES ((1 << CSV_FIELD_START) | (1 << CSV_UNQUOTED) | (1 << CSV_QUOTED_QUOTE))
+
+struct CsvResolveJob {
+  int Fd;
+  off_t FileSize;
+  off_t *Cuts;
+  int First;
+  int Step;
+  int NumCuts;
+  int Started;
+  int Status;
+};
+
+/*
+   The line boundary for a cut at byte SliceBlockStart: just past the first
+   newline at or after it, or 0 for a cut at 0. Callers clamp it to the
+   file size, it can be one past the end when the last line has no newline.
+*/
+void GetLineBoundary (FILE *fp, off_t SliceBlockStart, off_t *Boundary)
+{
+  int c;
+
+  off_t SliceOffset = 0;
+
+  fseeko (fp, SliceBlockStart, SEEK_SET);
+  if (SliceBlockStart > 0) {
+    while (!feof (fp)) {
+      c = fgetc (fp);
+      SliceOffset++;
+      if (c == '\n') break;
+    }
+  }
+
+  *Boundary = (SliceBlockStart + SliceOffset);
+}
+
+static int CsvNextState (int State, int c)
+{
+  switch (State) {
+    case CSV_FIELD_START:
+      if (c == '"') return (CSV_QUOTED);
+      if ((c == ',') || (c == '\n') || (c == ' ') || (c == '\t') || (c == '\r')) return (CSV_FIELD_START);
+      return (CSV_UNQUOTED);
+    case CSV_UNQUOTED:
+      if ((c == ',') || (c == '\n')) return (CSV_FIELD_START);
+      return (CSV_UNQUOTED);
+    case CSV_QUOTED:
+      if (c == '"') return (CSV_QUOTED_QUOTE);
+      return (CSV_QUOTED);
+    default:
+      if (c == '"') return (CSV_QUOTED);
+      if ((c == ',') || (c == '\n')) return (CSV_FIELD_START);
+      return (CSV_UNQUOTED);
+  }
+}
+
+/*
+   Exact fallback: walk the file from Start, a known record start, and
+   return the end of the first record that ends at or after Cut.
+*/
+static off_t CsvScanFrom (int Fd, char *Buf, off_t FileSize, off_t Start, off_t Cut)
+{
+  off_t Pos = Start;
+  ssize_t n;
+  ssize_t i;
+  int State = CSV_FIELD_START;
+
+  while (Pos < FileSize) {
+    n = pread (Fd, Buf, CSV_WINDOW, Pos);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      return (-1);
+    }
+    if (n == 0) break;
+    for (i = 0; i < n; i++) {
+      if ((Buf [i] == '\n') && (Pos + i >= Cut) && ((1 << State) & CSV_RECORD_END_STATES)) return (Pos + i + 1);
+      State = CsvNextState (State, (unsigned char) Buf [i]);
+    }
+    Pos += n;
+  }
+  return (FileSize);
+}
+
+/*
+   The state at Cut is unknown, so every state is assumed at once and the
+   set of live guesses is stepped through the bytes together. Guesses that
+   land on the same state merge, and a newline is a record boundary only when
+   it ends the record under every guess still alive, which makes the answer
+   exact, not just likely. A quote anywhere but at a field start collapses
+   the guesses, so this rarely reads more than a record or two. Quoted text
+   whose lines keep starting with a quote can keep two guesses apart for
+   good; then CSV_UNRESOLVED comes back and the caller scans exactly.
+*/
+static off_t CsvResolveCut (int Fd, char *Buf, off_t FileSize, off_t Cut)
+{
+  off_t Pos = Cut;
+  ssize_t n;
+  ssize_t i;
+  int Live = (1 << CSV_NUM_STATES) - 1;
+  int Next;
+  int s;
+
+  if (Cut <= 0) return (0);
+  if (Cut >= FileSize) return (FileSize);
+
+  while ((Pos < FileSize) && (Pos - Cut < CSV_MAX_WINDOW)) {
+    n = pread (Fd, Buf, CSV_WINDOW, Pos);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      return (-1);
+    }
+    if (n == 0) break;
+    for (i = 0; i < n; i++) {
+      if ((Buf [i] == '\n') && ((Live & ~CSV_RECORD_END_STATES) == 0)) return (Pos + i + 1);
+      Next = 0;
+      for (s = 0; s < CSV_NUM_STATES; s++) {
+        if (Live & (1 << s)) Next |= 1 << CsvNextState (s, (unsigned char) Buf [i]);
+      }
+      Live = Next;
+    }
+    Pos += n;
+  }
+
+  return (CSV_UNRESOLVED);
+}
+
+static void *CsvResolveThread (void *arg)
+{
+  struct CsvResolveJob *Job = (struct CsvResolveJob *) arg;
+  char *Buf;
+  int k;
+
+  Job -> Status = 0;
+  Buf = (char *) malloc (CSV_WINDOW);
+  if (Buf == NULL) {
+    Job -> Status = -1;
+    return (NULL);
+  }
+
+  for (k = Job -> First; k < Job -> NumCuts; k += Job -> Step) {
+    Job -> Cuts [k] = CsvResolveCut (Job -> Fd, Buf, Job -> FileSize, Job -> Cuts [k]);
+    if (Job -> Cuts [k] == -1) Job -> Status = -1;
+  }
+
+  free (Buf);
+  return (NULL);
+}
+
+/*
+   Moves every byte offset in Cuts forward to the start of the next CSV
+   record, honouring newlines inside quoted fields. Cuts must be in
+   ascending order. The cut points are independent of each other, so they
+   are resolved on up to one thread per cpu. The few that stay ambiguous are
+   then settled exactly, scanning from the nearest boundary before them.
+   Returns 0 on success, -1 on a read error.
+*/
+int ResolveCsvBoundaries (int Fd, off_t FileSize, off_t *Cuts, int NumCuts)
+{
+  struct CsvResolveJob *Jobs;
+  pthread_t *Threads;
+  off_t *Raw;
+  off_t Start;
+  char *Buf;
+  int NumThreads;
+  int NumUnresolved = 0;
+  int Status = 0;
+  int t;
+  int k;
+
+  NumThreads = (int) sysconf (_SC_NPROCESSORS_ONLN);
+  if (NumThreads > NumCuts) NumThreads = NumCuts;
+  if (NumThreads < 1) NumThreads = 1;
+
+  Jobs = (struct CsvResolveJob *) calloc (NumThreads, sizeof (struct CsvResolveJob));
+  Threads = (pthread_t *) calloc (NumThreads, sizeof (pthread_t));
+  Raw = (off_t *) malloc (NumCuts * sizeof (off_t));
+  if ((Jobs == NULL) || (Threads == NULL) || (Raw == NULL)) {
+    free (Jobs);
+    free (Threads);
+    free (Raw);
+    return (-1);
+  }
+  for (k = 0; k < NumCuts; k++) Raw [k] = Cuts [k];
+
+  for (t = 0; t < NumThreads; t++) {
+    Jobs [t].Fd = Fd;
+    Jobs [t].FileSize = FileSize;
+    Jobs [t].Cuts = Cuts;
+    Jobs [t].First = t;
+    Jobs [t].Step = NumThreads;
+    Jobs [t].NumCuts = NumCuts;
+  }
+
+  // thread 0's share runs right here
+  for (t = 1; t < NumThreads; t++) {
+    Jobs [t].Started = (pthread_create (&Threads [t], NULL, CsvResolveThread, &Jobs [t]) == 0);
+  }
+  CsvResolveThread (&Jobs [0]);
+
+  for (t = 1; t < NumThreads; t++) {
+    if (Jobs [t].Started) pthread_join (Threads [t], NULL);
+    else CsvResolveThread (&Jobs [t]);  // couldn't start it, do it inline
+  }
+  for (t = 0; t < NumThreads; t++) {
+    if (Jobs [t].Status != 0) Status = -1;
+  }
+
+  Buf = NULL;
+  for (k = 0; (k < NumCuts) && (Status == 0); k++) {
+    if (Cuts [k] != CSV_UNRESOLVED) continue;
+    if ((Buf == NULL) && ((Buf = (char *) malloc (CSV_WINDOW)) == NULL)) {
+      Status = -1;
+      break;
+    }
+    // everything before k is settled by now, and any boundary is a record start
+    Start = 0;
+    for (t = k - 1; t >= 0; t--) {
+      if (Cuts [t] <= Raw [k]) {
+        Start = Cuts [t];
+        break;
+      }
+    }
+    Cuts [k] = CsvScanFrom (Fd, Buf, FileSize, Start, Raw [k]);
+    if (Cuts [k] < 0) Status = -1;
+    NumUnresolved++;
+  }
+  if (NumUnresolved > 0)
+    fprintf (stderr, "fslicer: %d csv cut point(s) stayed ambiguous, settled by scanning from the previous boundary\n", NumUnresolved);
+
+  free (Buf);
+  free (Raw);
+  free (Jobs);
+  free (Threads);
+  return (Status);
+}
+
+/*
+   Picks byte cuts that give every slice about the same number of lines,
+   for files whose line length drifts. The file is split into buckets, the
+   average line length of each is estimated with SampleLine, and the cuts
+   are placed on the running line estimate, interpolating inside a bucket.
+   The random seed is fixed so every fslicer run on the same file samples
+   the same lines and agrees on the cuts. Cuts[i] is the raw cut for slice
+   FirstSlice + i (FileSize from NumSlices on). Returns 0, or -1 when out
+   of memory.
+*/
+int EstimateLineCuts (FILE *fp, off_t FileSize, int NumSlices, int NumSamples, int FirstSlice, int Count, off_t *Cuts)
+{
+  double *CumLines;
+  double Target;
+  double Frac;
+  double BytesSampled;
+  off_t BucketSize;
+  off_t BucketStart;
+  off_t BucketLen;
+  char *Line;
+  int NumBuckets;
+  int Slice;
+  int LinesSampled;
+  int b;
+  int i;
+
+  NumBuckets = NumSamples / SAMPLES_PER_BUCKET;
+  if (NumBuckets < 1) NumBuckets = 1;
+  if (NumBuckets > FileSize) NumBuckets = (FileSize > 0) ? (int) FileSize : 1;
+  BucketSize = FileSize / NumBuckets;
+
+  CumLines = (double *) calloc (NumBuckets + 1, sizeof (double));
+  Line = (char *) malloc (SAMPLE_MAXLINE + 1);
+  if ((CumLines == NULL) || (Line == NULL)) {
+    free (CumLines);
+    free (Line);
+    return (-1);
+  }
+
+  srandom (SAMPLE_SEED ^ (unsigned int) FileSize);
+  for (b = 0; b < NumBuckets; b++) {
+    BucketStart = BucketSize * b;
+    BucketLen = (b == NumBuckets - 1) ? FileSize - BucketStart : BucketSize;
+    BytesSampled = 0;
+    LinesSampled = 0;
+    for (i = 0; (i < SAMPLES_PER_BUCKET) && (BucketLen > 0); i++) {
+      Line [0] = '\0';
+      BytesSampled += SampleLine (Line, SAMPLE_MAXLINE, fp, BucketStart, BucketLen);
+      LinesSampled++;
+    }
+    CumLines [b + 1] = CumLines [b];
+    if (BytesSampled > 0) CumLines [b + 1] += BucketLen * LinesSampled / BytesSampled;
+  }
+
+  b = 0;
+  for (i = 0; i < Count; i++) {
+    Slice = FirstSlice + i;
+    if (Slice <= 0) {
+      Cuts [i] = 0;
+      continue;
+    }
+    if (Slice >= NumSlices) {
+      Cuts [i] = FileSize;
+      continue;
+    }
+    Target = CumLines [NumBuckets] * Slice / NumSlices;
+    while ((b < NumBuckets - 1) && (CumLines [b + 1] <= Target)) b++;
+    while ((b > 0) && (CumLines [b] > Target)) b--;
+    BucketStart = BucketSize * b;
+    BucketLen = (b == NumBuckets - 1) ? FileSize - BucketStart : BucketSize;
+    Frac = (CumLines [b + 1] > CumLines [b]) ? (Target - CumLines [b]) / (CumLines [b + 1] - CumLines [b]) : 0;
+    Cuts [i] = BucketStart + (off_t) (Frac * BucketLen);
+    if (Cuts [i] > FileSize) Cuts [i] = FileSize;
+  }
+
+  free (CumLines);
+  free (Line);
+  return (0);
+}
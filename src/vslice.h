@@ -0,0 +1,15 @@
+#include <stdio.h>
+#include <sys/types.h>
+
+#ifdef __cplusplus //inform the compiler that these are C functions if we are using a c++ compiler
+extern "C"
+{
+#endif
+
+    void GetLineBoundary(FILE *fp, off_t SliceBlockStart, off_t *Boundary);
+    int ResolveCsvBoundaries(int Fd, off_t FileSize, off_t *Cuts, int NumCuts);
+    int EstimateLineCuts(FILE *fp, off_t FileSize, int NumSlices, int NumSamples, int FirstSlice, int Count, off_t *Cuts);
+
+#ifdef __cplusplus
+}
+#endif
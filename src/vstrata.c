@@ -0,0 +1,287 @@
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include "vsample.h"
+#include "vstrata.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#define STRATA_BLOCK      (1024 * 1024)          // arena blocks are at least this
+#define STRATA_SLACK      (64 * 1024 * 1024)     // unused line space tolerated before compacting
+#define STRATA_MIN_TABLE  (1024)
+
+#define FNV_OFFSET  (0xcbf29ce484222325ULL)
+#define FNV_PRIME   (0x100000001b3ULL)
+
+struct StrataBlock {
+  struct StrataBlock *Next;
+  size_t Used;
+  size_t Size;
+  char Data [];
+};
+
+/*
+   Len bytes (8 byte aligned) from the arena at *Head, starting a new
+   block when the current one is full. NULL when out of memory.
+*/
+static void *BlockAlloc (struct StrataBlock **Head, size_t Len)
+{
+  struct StrataBlock *b = *Head;
+  size_t Size;
+  void *p;
+
+  Len = (Len + 7) & ~(size_t) 7;
+  if ((b == NULL) || (b -> Size - b -> Used < Len)) {
+    Size = (Len > STRATA_BLOCK) ? Len : STRATA_BLOCK;
+    b = (struct StrataBlock *) malloc (sizeof (struct StrataBlock) + Size);
+    if (b == NULL) return (NULL);
+    b -> Next = *Head;
+    b -> Used = 0;
+    b -> Size = Size;
+    *Head = b;
+  }
+  p = b -> Data + b -> Used;
+  b -> Used += Len;
+  return (p);
+}
+
+static void BlocksFree (struct StrataBlock *b)
+{
+  struct StrataBlock *Next;
+
+  for (; b != NULL; b = Next) {
+    Next = b -> Next;
+    free (b);
+  }
+}
+
+static uint64_t HashKey (const char *Key, size_t KeyLen)
+{
+  uint64_t h = FNV_OFFSET;
+  size_t i;
+
+  for (i = 0; i < KeyLen; i++) {
+    h ^= (unsigned char) Key [i];
+    h *= FNV_PRIME;
+  }
+  return (h);
+}
+
+/*
+   Doubles the table and puts every key back in it.
+*/
+static int GrowTable (struct Strata *S)
+{
+  uint32_t *Table;
+  uint64_t Size = S -> TableSize * 2;
+  uint64_t i;
+  uint64_t h;
+
+  Table = (uint32_t *) calloc (Size, sizeof (uint32_t));
+  if (Table == NULL) return (-1);
+  for (i = 0; i < S -> NumKeys; i++) {
+    for (h = S -> Keys [i].Hash & (Size - 1); Table [h] != 0; h = (h + 1) & (Size - 1));
+    Table [h] = (uint32_t) (i + 1);
+  }
+  free (S -> Table);
+  S -> Table = Table;
+  S -> TableSize = Size;
+  return (0);
+}
+
+/*
+   The stratum for Key, made (empty) the first time the key comes up.
+*/
+static struct Stratum *FindStratum (struct Strata *S, const char *Key, size_t KeyLen)
+{
+  uint64_t Hash = HashKey (Key, KeyLen);
+  uint64_t h;
+  struct Stratum *St;
+  struct Stratum *Grown;
+
+  for (h = Hash & (S -> TableSize - 1); S -> Table [h] != 0; h = (h + 1) & (S -> TableSize - 1)) {
+    St = &S -> Keys [S -> Table [h] - 1];
+    if ((St -> Hash == Hash) && (St -> KeyLen == KeyLen) && (memcmp (St -> Key, Key, KeyLen) == 0)) return (St);
+  }
+
+  if (S -> NumKeys == UINT32_MAX - 1) return (NULL);
+  if (S -> NumKeys == S -> MaxKeys) {
+    S -> MaxKeys *= 2;
+    Grown = (struct Stratum *) realloc (S -> Keys, S -> MaxKeys * sizeof (struct Stratum));
+    if (Grown == NULL) return (NULL);
+    S -> Keys = Grown;
+  }
+  St = &S -> Keys [S -> NumKeys];
+  memset (St, 0, sizeof (*St));
+  St -> Hash = Hash;
+  St -> KeyLen = (uint32_t) KeyLen;
+  St -> W = 1;
+  St -> Key = (char *) BlockAlloc (&S -> Fixed, KeyLen);
+  if (St -> Key == NULL) return (NULL);
+  memcpy (St -> Key, Key, KeyLen);
+  S -> Table [h] = (uint32_t) (++S -> NumKeys);
+
+  // keep the table at most 70% full
+  if ((S -> NumKeys * 10 > S -> TableSize * 7) && (GrowTable (S) != 0)) return (NULL);
+  return (&S -> Keys [S -> NumKeys - 1]);
+}
+
+/*
+   Copies every sampled line into fresh blocks, dropping the space of the
+   lines they replaced.
+*/
+static int CompactLines (struct Strata *S)
+{
+  struct StrataBlock *Fresh = NULL;
+  struct StrataSlot *Slot;
+  uint64_t i;
+  int k;
+  char *p;
+
+  S -> LinesUsed = 0;
+  for (i = 0; i < S -> NumKeys; i++) {
+    for (k = 0; k < S -> Keys [i].Count; k++) {
+      Slot = &S -> Keys [i].Slots [k];
+      p = (char *) BlockAlloc (&Fresh, Slot -> Len);
+      if (p == NULL) {
+        BlocksFree (Fresh);
+        return (-1);
+      }
+      memcpy (p, Slot -> Line, Slot -> Len);
+      Slot -> Line = p;
+      Slot -> Cap = Slot -> Len;
+      S -> LinesUsed += (Slot -> Len + 7) & ~(size_t) 7;
+    }
+  }
+  BlocksFree (S -> Lines);
+  S -> Lines = Fresh;
+  S -> LinesLive = S -> LinesUsed;
+  return (0);
+}
+
+/*
+   Puts Line in Slot, over the line that was there when it fits.
+*/
+static int StoreLine (struct Strata *S, struct StrataSlot *Slot, const char *Line, size_t Len)
+{
+  char *p;
+
+  if (Len > UINT32_MAX) {
+    errno = EFBIG;
+    return (-1);
+  }
+  if (Len > Slot -> Cap) {
+    p = (char *) BlockAlloc (&S -> Lines, Len);
+    if (p == NULL) return (-1);
+    S -> LinesUsed += (Len + 7) & ~(size_t) 7;
+    S -> LinesLive += ((Len + 7) & ~(size_t) 7) - ((Slot -> Cap + 7) & ~(size_t) 7);
+    Slot -> Line = p;
+    Slot -> Cap = (uint32_t) Len;
+  }
+  memcpy (Slot -> Line, Line, Len);
+  Slot -> Len = (uint32_t) Len;
+
+  if ((S -> LinesUsed > 2 * S -> LinesLive + STRATA_SLACK) && (CompactLines (S) != 0)) return (-1);
+  return (0);
+}
+
+/*
+   Empty strata keeping K lines per key, drawing on the random state Rng.
+   Returns 0, or -1 with errno set.
+*/
+int StrataInit (struct Strata *S, int K, uint64_t *Rng)
+{
+  memset (S, 0, sizeof (*S));
+  S -> K = K;
+  S -> Rng = Rng;
+  S -> MaxKeys = STRATA_MIN_TABLE;
+  S -> TableSize = STRATA_MIN_TABLE;
+  S -> Keys = (struct Stratum *) malloc (S -> MaxKeys * sizeof (struct Stratum));
+  S -> Table = (uint32_t *) calloc (S -> TableSize, sizeof (uint32_t));
+  if ((S -> Keys == NULL) || (S -> Table == NULL)) {
+    StrataFree (S);
+    errno = ENOMEM;
+    return (-1);
+  }
+  return (0);
+}
+
+void StrataFree (struct Strata *S)
+{
+  free (S -> Keys);
+  free (S -> Table);
+  BlocksFree (S -> Fixed);
+  BlocksFree (S -> Lines);
+  memset (S, 0, sizeof (*S));
+}
+
+/*
+   The next line, with the key it is sampled under. Returns 0, or -1 with
+   errno set when there is no memory for it.
+*/
+int StrataOffer (struct Strata *S, const char *Key, size_t KeyLen, const char *Line, size_t Len)
+{
+  struct Stratum *St;
+  struct StrataSlot *Slots;
+  int Cap;
+  int Slot;
+
+  St = FindStratum (S, Key, KeyLen);
+  if (St == NULL) {
+    errno = ENOMEM;
+    return (-1);
+  }
+
+  if (St -> Count < S -> K) {
+    if (St -> Count == St -> SlotCap) {
+      Cap = (St -> SlotCap == 0) ? 4 : St -> SlotCap * 2;
+      if (Cap > S -> K) Cap = S -> K;
+      Slots = (struct StrataSlot *) BlockAlloc (&S -> Fixed, Cap * sizeof (struct StrataSlot));
+      if (Slots == NULL) {
+        errno = ENOMEM;
+        return (-1);
+      }
+      memset (Slots, 0, Cap * sizeof (struct StrataSlot));
+      if (St -> Count > 0) memcpy (Slots, St -> Slots, St -> Count * sizeof (struct StrataSlot));
+      St -> Slots = Slots;
+      St -> SlotCap = Cap;
+    }
+    if (StoreLine (S, &St -> Slots [St -> Count], Line, Len) != 0) return (-1);
+    St -> Count++;
+    St -> Seen++;
+    if (St -> Count == S -> K) St -> Next = SampleNextL (S -> Rng, S -> K, &St -> W, St -> Seen);
+    return (0);
+  }
+
+  if (St -> Seen == St -> Next) {
+    Slot = (int) SampleRandomBelow (S -> Rng, S -> K);
+    if (StoreLine (S, &St -> Slots [Slot], Line, Len) != 0) return (-1);
+    St -> Seen++;
+    St -> Next = SampleNextL (S -> Rng, S -> K, &St -> W, St -> Seen);
+    return (0);
+  }
+  St -> Seen++;
+  return (0);
+}
+
+/*
+   Every key's sample, keys in the order they first came up. A line the
+   input ended without a newline gets one.
+*/
+void StrataPrint (struct Strata *S, FILE *Out)
+{
+  struct StrataSlot *Slot;
+  uint64_t i;
+  int k;
+
+  for (i = 0; i < S -> NumKeys; i++) {
+    for (k = 0; k < S -> Keys [i].Count; k++) {
+      Slot = &S -> Keys [i].Slots [k];
+      fwrite (Slot -> Line, 1, Slot -> Len, Out);
+      if ((Slot -> Len == 0) || (Slot -> Line [Slot -> Len - 1] != '\n')) fputc ('\n', Out);
+    }
+  }
+}
@@ -0,0 +1,59 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+   Up to K sample lines per distinct key, from one pass over the lines.
+   Each key has its own algorithm L reservoir. The keys live in one array
+   in the order they were first seen, found through an open addressed
+   table of indexes into it, and the lines are copied into large arena
+   blocks that are compacted when replaced lines have left too much of
+   them unused. Memory follows keys x K, not the size of the input.
+*/
+struct StrataBlock;
+
+struct StrataSlot {
+  char *Line;
+  uint32_t Len;
+  uint32_t Cap;
+};
+
+struct Stratum {
+  uint64_t Hash;
+  char *Key;
+  uint32_t KeyLen;
+  int Count;
+  int SlotCap;                    // grows up to K, most keys never need all of it
+  int64_t Seen;
+  int64_t Next;
+  double W;
+  struct StrataSlot *Slots;
+};
+
+struct Strata {
+  int K;
+  uint64_t *Rng;                  // SampleRandom state, the caller's
+  struct Stratum *Keys;
+  uint64_t NumKeys;
+  uint64_t MaxKeys;
+  uint32_t *Table;                // index + 1 into Keys, 0 for empty
+  uint64_t TableSize;
+  struct StrataBlock *Fixed;      // keys and slot arrays, kept to the end
+  struct StrataBlock *Lines;      // sampled lines, compacted now and then
+  size_t LinesUsed;
+  size_t LinesLive;
+};
+
+#ifdef __cplusplus //inform the compiler that these are C functions if we are using a c++ compiler
+extern "C"
+{
+#endif
+
+    int StrataInit(struct Strata *S, int K, uint64_t *Rng);
+    void StrataFree(struct Strata *S);
+    int StrataOffer(struct Strata *S, const char *Key, size_t KeyLen, const char *Line, size_t Len);
+    void StrataPrint(struct Strata *S, FILE *Out);
+
+#ifdef __cplusplus
+}
+#endif
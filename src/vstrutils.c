@@ -1,5 +1,6 @@
 #include "vstrutils.h"
 
+#include <limits.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -46,4 +47,64 @@ int SampleLine (char * Line, int MaxLine, FILE *fp, off_t offset,  off_t len)
     fgets(Line, MaxLine, fp);
     ctr = strlen(Line);
     return ctr;
-}
\ No newline at end of file
+}
+
+/*
+   Parses a comma separated list of field numbers, e.g. "0,3", into a
+   malloc'ed array. Returns 0 on success, -1 for an empty list or anything
+   that isn't a field number.
+*/
+int ParseFieldList (char *List, int **Fields, int *NumFields)
+{
+    char *p;
+    char *end;
+    int Count = 1;
+    int k = 0;
+    long v;
+
+    for (p = List; *p; p++)
+    {
+        if (*p == ',')
+            Count++;
+    }
+    *Fields = (int *)malloc(Count * sizeof(int));
+    if (*Fields == NULL)
+        return (-1);
+
+    p = List;
+    while (k < Count)
+    {
+        v = strtol(p, &end, 10);
+        if ((end == p) || (v < 0) || (v > INT_MAX) || ((*end != ',') && (*end != '\0')))
+        {
+            free(*Fields);
+            *Fields = NULL;
+            return (-1);
+        }
+        (*Fields)[k++] = (int)v;
+        p = end + 1;
+    }
+    *NumFields = Count;
+    return (0);
+}
+
+/*
+   "0.5%" is 0.005, a plain "0.005" stays as it is. -1 for anything else.
+*/
+double ParsePercent (char *s)
+{
+    char *end;
+    double v;
+
+    v = strtod(s, &end);
+    if (end == s)
+        return (-1);
+    if (*end == '%')
+    {
+        v /= 100;
+        end++;
+    }
+    if (*end != '\0')
+        return (-1);
+    return (v);
+}
@@ -7,6 +7,8 @@ extern "C"
 
     int Tokenize(char **Toks, char *Str, char *DelimChrs, int MaxToks);
     int SampleLine(char *Line, int MaxLine, FILE *fp, off_t offset, off_t len);
+    int ParseFieldList(char *List, int **Fields, int *NumFields);
+    double ParsePercent(char *s);
 
 #ifdef __cplusplus
 }
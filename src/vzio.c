@@ -0,0 +1,678 @@
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include "vzio.h"
+#include "vfileio.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#define Z_INBUFSIZE     (1024 * 1024)
+#define Z_OUTBUFSIZE    (1024 * 1024)
+#define Z_SCANBUFSIZE   (1024 * 1024)
+#define Z_VERIFY_BYTES  (64 * 1024)   // a plain gzip member candidate must inflate this much cleanly
+#define ZSTD_VERIFY_BLOCKS (64)       // block headers walked to accept a zstd frame candidate
+
+#define GZIP_HEADER_LEN (10)
+#define BGZF_HEADER_LEN (18)
+
+#define ZSTD_MAGIC           (0xFD2FB528U)
+#define ZSTD_SKIPPABLE_MASK  (0xFFFFFFF0U)
+#define ZSTD_SKIPPABLE_MAGIC (0x184D2A50U)
+#define ZSTD_SEEKABLE_MAGIC  (0x8F92EAB1U)
+#define ZSTD_MAX_BLOCK       (128 * 1024)
+
+/*
+   Streams the decompressed bytes of a file starting at a member (or frame)
+   boundary, one member at a time, so the caller always knows which member
+   the bytes it is handed came out of.
+*/
+struct ZReader {
+  int Fd;
+  int Format;
+  off_t FileSize;
+  off_t ReadPos;          // file offset of the next pread
+  unsigned char *InBuf;
+  size_t InLen;           // bytes in InBuf
+  size_t InOff;           // bytes of InBuf already fed to the decoder
+  int InMember;           // 0 when the next byte starts a new member
+  off_t MemberStart;      // file offset where the current member began
+  int Quiet;              // set while probing candidates, bad data is expected then
+#ifdef HAVE_ZLIB
+  z_stream zs;
+  int zsInit;
+#endif
+#ifdef HAVE_ZSTD
+  ZSTD_DStream *zds;
+#endif
+};
+
+static uint32_t GetLE32 (const unsigned char *p)
+{
+  return ((uint32_t) p [0]) | ((uint32_t) p [1] << 8) | ((uint32_t) p [2] << 16) | ((uint32_t) p [3] << 24);
+}
+
+static uint64_t GetLE64 (const unsigned char *p)
+{
+  return ((uint64_t) GetLE32 (p)) | ((uint64_t) GetLE32 (p + 4) << 32);
+}
+
+static ssize_t PreadFull (int Fd, void *Buf, size_t Len, off_t Offset)
+{
+  ssize_t n;
+  size_t Done = 0;
+
+  while (Done < Len) {
+    n = pread (Fd, (char *) Buf + Done, Len - Done, Offset + Done);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      return (-1);
+    }
+    if (n == 0) break;
+    Done += n;
+  }
+  return (Done);
+}
+
+static int IsGzipHeader (const unsigned char *p, size_t Len)
+{
+  return (Len >= GZIP_HEADER_LEN) && (p [0] == 0x1f) && (p [1] == 0x8b) && (p [2] == 8) && ((p [3] & 0xe0) == 0);
+}
+
+/*
+   BGZF members are gzip members with a "BC" extra subfield holding the
+   member size - 1.
+*/
+static int IsBgzfHeader (const unsigned char *p, size_t Len, off_t *BlockSize)
+{
+  if (!IsGzipHeader (p, Len) || (Len < BGZF_HEADER_LEN)) return (0);
+  if (((p [3] & 0x04) == 0) || (p [12] != 'B') || (p [13] != 'C') || (p [14] != 2) || (p [15] != 0)) return (0);
+  if (BlockSize != NULL) *BlockSize = ((off_t) p [16] | ((off_t) p [17] << 8)) + 1;
+  return (1);
+}
+
+static int IsZstdMagic (const unsigned char *p, size_t Len)
+{
+  uint32_t Magic;
+
+  if (Len < 4) return (0);
+  Magic = GetLE32 (p);
+  return (Magic == ZSTD_MAGIC) || ((Magic & ZSTD_SKIPPABLE_MASK) == ZSTD_SKIPPABLE_MAGIC);
+}
+
+int DetectCompression (int Fd)
+{
+  unsigned char Buf [BGZF_HEADER_LEN];
+  ssize_t n;
+
+  n = PreadFull (Fd, Buf, sizeof (Buf), 0);
+  if (n <= 0) return (VZ_PLAIN);
+  if (IsBgzfHeader (Buf, n, NULL)) return (VZ_BGZF);
+  if (IsGzipHeader (Buf, n)) return (VZ_GZIP);
+  if ((n >= 4) && (GetLE32 (Buf) == ZSTD_MAGIC)) return (VZ_ZSTD);
+  return (VZ_PLAIN);
+}
+
+const char *CompressionName (int Format)
+{
+  switch (Format) {
+    case VZ_GZIP: return ("gzip");
+    case VZ_BGZF: return ("bgzf");
+    case VZ_ZSTD: return ("zstd");
+    default: return ("plain");
+  }
+}
+
+/*
+   Whether this build can decompress Format at all.
+*/
+int CompressionSupported (int Format)
+{
+  switch (Format) {
+    case VZ_PLAIN: return (1);
+#ifdef HAVE_ZLIB
+    case VZ_GZIP:
+    case VZ_BGZF: return (1);
+#endif
+#ifdef HAVE_ZSTD
+    case VZ_ZSTD: return (1);
+#endif
+    default: return (0);
+  }
+}
+
+static int ZReaderOpen (struct ZReader *r, int Fd, int Format, off_t FileSize, off_t Start)
+{
+  memset (r, 0, sizeof (*r));
+  r -> Fd = Fd;
+  r -> Format = Format;
+  r -> FileSize = FileSize;
+  r -> ReadPos = Start;
+  r -> InBuf = (unsigned char *) malloc (Z_INBUFSIZE);
+  if (r -> InBuf == NULL) return (-1);
+
+#ifdef HAVE_ZSTD
+  if (Format == VZ_ZSTD) {
+    r -> zds = ZSTD_createDStream ();
+    if (r -> zds == NULL) {
+      free (r -> InBuf);
+      return (-1);
+    }
+  }
+#endif
+  return (0);
+}
+
+static void ZReaderClose (struct ZReader *r)
+{
+#ifdef HAVE_ZLIB
+  if (r -> zsInit) inflateEnd (&r -> zs);
+#endif
+#ifdef HAVE_ZSTD
+  if (r -> zds != NULL) ZSTD_freeDStream (r -> zds);
+#endif
+  free (r -> InBuf);
+}
+
+static int ZReaderStartMember (struct ZReader *r)
+{
+#ifdef HAVE_ZLIB
+  if ((r -> Format == VZ_GZIP) || (r -> Format == VZ_BGZF)) {
+    if (r -> zsInit) return ((inflateReset (&r -> zs) == Z_OK) ? 0 : -1);
+    if (inflateInit2 (&r -> zs, 15 + 16) != Z_OK) return (-1);
+    r -> zsInit = 1;
+    return (0);
+  }
+#endif
+#ifdef HAVE_ZSTD
+  if (r -> Format == VZ_ZSTD) return (ZSTD_isError (ZSTD_initDStream (r -> zds)) ? -1 : 0);
+#endif
+  errno = ENOTSUP;
+  return (-1);
+}
+
+/*
+   Decompresses up to OutMax bytes, never past the end of the current
+   member, and tells which member they came from. Returns 1 with data,
+   0 at the end of the input, -1 on error.
+*/
+static int ZRead (struct ZReader *r, unsigned char *Out, size_t OutMax, size_t *OutLen, off_t *MemberStart)
+{
+  ssize_t n;
+  size_t Consumed;
+  size_t Produced;
+  size_t Want;
+
+  *OutLen = 0;
+  for (;;) {
+    if (r -> InOff == r -> InLen) {
+      Want = Z_INBUFSIZE;
+      if (r -> FileSize - r -> ReadPos < (off_t) Want) Want = r -> FileSize - r -> ReadPos;
+      n = (Want > 0) ? PreadFull (r -> Fd, r -> InBuf, Want, r -> ReadPos) : 0;
+      if (n < 0) return (-1);
+      if (n == 0) {
+        if (r -> InMember) {
+          if (!r -> Quiet) fprintf (stderr, "fslicer: %s input is truncated\n", CompressionName (r -> Format));
+          errno = EIO;
+          return (-1);
+        }
+        return (0);
+      }
+      r -> InLen = n;
+      r -> InOff = 0;
+      r -> ReadPos += n;
+    }
+
+    if (!r -> InMember) {
+      // gzip tolerates padding after the last member, stop at anything that isn't one
+      if ((r -> Format != VZ_ZSTD) && (r -> InBuf [r -> InOff] != 0x1f)) return (0);
+      r -> MemberStart = r -> ReadPos - (r -> InLen - r -> InOff);
+      if (ZReaderStartMember (r) != 0) return (-1);
+      r -> InMember = 1;
+    }
+
+    Consumed = 0;
+    Produced = 0;
+#ifdef HAVE_ZLIB
+    if ((r -> Format == VZ_GZIP) || (r -> Format == VZ_BGZF)) {
+      int ret;
+
+      r -> zs.next_in = r -> InBuf + r -> InOff;
+      r -> zs.avail_in = r -> InLen - r -> InOff;
+      r -> zs.next_out = Out;
+      r -> zs.avail_out = OutMax;
+      ret = inflate (&r -> zs, Z_NO_FLUSH);
+      Consumed = (r -> InLen - r -> InOff) - r -> zs.avail_in;
+      Produced = OutMax - r -> zs.avail_out;
+      r -> InOff += Consumed;
+      if (ret == Z_STREAM_END) r -> InMember = 0;
+      else if ((ret != Z_OK) && (ret != Z_BUF_ERROR)) {
+        if (!r -> Quiet) fprintf (stderr, "fslicer: bad gzip data near offset %lld\n", (long long) r -> MemberStart);
+        errno = EIO;
+        return (-1);
+      }
+    }
+#endif
+#ifdef HAVE_ZSTD
+    if (r -> Format == VZ_ZSTD) {
+      ZSTD_inBuffer in;
+      ZSTD_outBuffer out;
+      size_t ret;
+
+      in.src = r -> InBuf + r -> InOff;
+      in.size = r -> InLen - r -> InOff;
+      in.pos = 0;
+      out.dst = Out;
+      out.size = OutMax;
+      out.pos = 0;
+      ret = ZSTD_decompressStream (r -> zds, &out, &in);
+      if (ZSTD_isError (ret)) {
+        if (!r -> Quiet) fprintf (stderr, "fslicer: bad zstd data near offset %lld: %s\n", (long long) r -> MemberStart, ZSTD_getErrorName (ret));
+        errno = EIO;
+        return (-1);
+      }
+      Consumed = in.pos;
+      Produced = out.pos;
+      r -> InOff += Consumed;
+      if (ret == 0) r -> InMember = 0;
+    }
+#endif
+    if (Produced > 0) {
+      *OutLen = Produced;
+      *MemberStart = r -> MemberStart;
+      return (1);
+    }
+    if ((Consumed == 0) && r -> InMember && (r -> InOff < r -> InLen)) {
+      // the decoder neither ate input nor made output with room for both, it is stuck
+      errno = EIO;
+      return (-1);
+    }
+  }
+}
+
+/*
+   Walks a zstd frame's block headers from Pos without decompressing.
+   Returns 1 if the frame looks sound for up to MaxBlocks blocks and is
+   followed by the end of the file or another frame, 0 otherwise.
+*/
+static int VerifyZstdFrame (int Fd, off_t FileSize, off_t Pos, int MaxBlocks)
+{
+  static const int DictIdBytes [4] = { 0, 1, 2, 4 };
+  unsigned char Hdr [18];
+  uint32_t Block;
+  off_t BlockSize;
+  int Fhd;
+  int FcsBytes;
+  int Blocks;
+  ssize_t n;
+
+  n = PreadFull (Fd, Hdr, sizeof (Hdr), Pos);
+  if ((n < 6) || (GetLE32 (Hdr) != ZSTD_MAGIC)) return (0);
+
+  Fhd = Hdr [4];
+  if (Fhd & 0x08) return (0);   // reserved bit
+  FcsBytes = Fhd >> 6;
+  FcsBytes = (FcsBytes == 0) ? ((Fhd & 0x20) ? 1 : 0) : (1 << FcsBytes);
+  Pos += 5 + ((Fhd & 0x20) ? 0 : 1) + DictIdBytes [Fhd & 0x03] + FcsBytes;
+
+  for (Blocks = 0; Blocks < MaxBlocks; Blocks++) {
+    if (PreadFull (Fd, Hdr, 3, Pos) != 3) return (0);
+    Block = (uint32_t) Hdr [0] | ((uint32_t) Hdr [1] << 8) | ((uint32_t) Hdr [2] << 16);
+    BlockSize = Block >> 3;
+    switch ((Block >> 1) & 3) {
+      case 0: break;                                                  // raw
+      case 1: BlockSize = 1; break;                                   // rle
+      case 2: if (BlockSize > ZSTD_MAX_BLOCK) return (0); break;      // compressed
+      default: return (0);                                            // reserved
+    }
+    Pos += 3 + BlockSize;
+    if (Pos > FileSize) return (0);
+    if (Block & 1) {
+      if (Fhd & 0x04) Pos += 4;   // content checksum
+      if (Pos == FileSize) return (1);
+      n = PreadFull (Fd, Hdr, 4, Pos);
+      return (IsZstdMagic (Hdr, n));
+    }
+  }
+  return (1);
+}
+
+/*
+   Decides whether a gzip header at Pos really starts a member rather than
+   being a lookalike inside compressed data.
+*/
+static int VerifyMemberStart (int Fd, int Format, off_t FileSize, off_t Pos)
+{
+  unsigned char Hdr [BGZF_HEADER_LEN];
+  unsigned char *Out;
+  off_t BlockSize;
+  off_t Next;
+  off_t MemberStart;
+  size_t OutLen;
+  size_t Total = 0;
+  ssize_t n;
+  int ret;
+  struct ZReader r;
+
+  if (Format == VZ_ZSTD) return (VerifyZstdFrame (Fd, FileSize, Pos, ZSTD_VERIFY_BLOCKS));
+
+  n = PreadFull (Fd, Hdr, sizeof (Hdr), Pos);
+  if (Format == VZ_BGZF) {
+    // the member says how long it is, so the next one must be right there
+    if (!IsBgzfHeader (Hdr, n, &BlockSize)) return (0);
+    Next = Pos + BlockSize;
+    if (Next == FileSize) return (1);
+    n = PreadFull (Fd, Hdr, sizeof (Hdr), Next);
+    return (IsBgzfHeader (Hdr, n, NULL));
+  }
+
+  // plain gzip has no length, so try to inflate the start of the member
+  if (!IsGzipHeader (Hdr, n)) return (0);
+  Out = (unsigned char *) malloc (Z_OUTBUFSIZE);
+  if ((Out == NULL) || (ZReaderOpen (&r, Fd, Format, FileSize, Pos) != 0)) {
+    free (Out);
+    return (0);
+  }
+  r.Quiet = 1;
+  while (Total < Z_VERIFY_BYTES) {
+    ret = ZRead (&r, Out, Z_VERIFY_BYTES, &OutLen, &MemberStart);
+    if (ret <= 0) break;
+    Total += OutLen;
+    if (!r.InMember) {
+      Total = Z_VERIFY_BYTES;
+      break;
+    }
+  }
+  ZReaderClose (&r);
+  free (Out);
+  return (Total >= Z_VERIFY_BYTES);
+}
+
+static off_t FindMemberStart (int Fd, int Format, off_t FileSize, off_t Cut, unsigned char *Buf)
+{
+  off_t Pos = Cut;
+  ssize_t n;
+  ssize_t i;
+
+  while (Pos < FileSize) {
+    n = PreadFull (Fd, Buf, Z_SCANBUFSIZE, Pos);
+    if (n < 0) return (-1);
+    for (i = 0; i + 4 <= n; i++) {
+      if (Format == VZ_ZSTD) {
+        if (GetLE32 (Buf + i) != ZSTD_MAGIC) continue;
+      } else if ((Buf [i] != 0x1f) || (Buf [i + 1] != 0x8b) || (Buf [i + 2] != 8)) continue;
+      if (VerifyMemberStart (Fd, Format, FileSize, Pos + i)) return (Pos + i);
+    }
+    if (n < Z_SCANBUFSIZE) break;
+    Pos += n - 3;   // a magic number may straddle the two reads
+  }
+  return (FileSize);
+}
+
+/*
+   Moves every byte offset in Cuts forward to the start of the next member
+   (gzip) or frame (zstd), or to FileSize if there is none. With a member list
+   from a side index it is a lookup, otherwise the file is scanned from the
+   cut for a verified member header. Returns 0 on success, -1 on a read error.
+*/
+int ResolveMemberBoundaries (int Fd, int Format, off_t FileSize, off_t *Members, int NumMembers, off_t *Cuts, int NumCuts)
+{
+  unsigned char *Buf = NULL;
+  int lo;
+  int hi;
+  int mid;
+  int k;
+
+  for (k = 0; k < NumCuts; k++) {
+    if (Cuts [k] <= 0) {
+      Cuts [k] = 0;
+      continue;
+    }
+    if (Cuts [k] >= FileSize) {
+      Cuts [k] = FileSize;
+      continue;
+    }
+
+    if (Members != NULL) {
+      lo = 0;
+      hi = NumMembers;
+      while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (Members [mid] < Cuts [k]) lo = mid + 1;
+        else hi = mid;
+      }
+      Cuts [k] = (lo < NumMembers) ? Members [lo] : FileSize;
+      continue;
+    }
+
+    if (Buf == NULL) {
+      Buf = (unsigned char *) malloc (Z_SCANBUFSIZE);
+      if (Buf == NULL) return (-1);
+    }
+    Cuts [k] = FindMemberStart (Fd, Format, FileSize, Cuts [k], Buf);
+    if (Cuts [k] < 0) {
+      free (Buf);
+      return (-1);
+    }
+  }
+
+  free (Buf);
+  return (0);
+}
+
+/*
+   Reads a bgzip .gzi index: a little endian uint64 count followed by that
+   many (compressed offset, uncompressed offset) uint64 pairs. The first
+   member at offset 0 is implied. Returns 0 on success, -1 after saying why.
+*/
+int LoadMemberIndex (char *IndexName, off_t **Members, int *NumMembers)
+{
+  FILE *fp;
+  unsigned char Buf [16];
+  uint64_t Count;
+  uint64_t i;
+  off_t *List;
+
+  fp = fopen (IndexName, "rb");
+  if (!fp) {
+    fprintf (stderr, "Can't open [%s]\n", IndexName);
+    return (-1);
+  }
+
+  if ((fread (Buf, 1, 8, fp) != 8) || ((Count = GetLE64 (Buf)) > (uint64_t) INT32_MAX - 1)) {
+    fprintf (stderr, "[%s] is not a .gzi index\n", IndexName);
+    fclose (fp);
+    return (-1);
+  }
+
+  List = (off_t *) malloc ((Count + 1) * sizeof (off_t));
+  if (List == NULL) {
+    fprintf (stderr, "Out of memory for %llu members\n", (unsigned long long) Count);
+    fclose (fp);
+    return (-1);
+  }
+
+  List [0] = 0;
+  for (i = 0; i < Count; i++) {
+    if (fread (Buf, 1, 16, fp) != 16) {
+      fprintf (stderr, "[%s] is truncated\n", IndexName);
+      free (List);
+      fclose (fp);
+      return (-1);
+    }
+    List [i + 1] = (off_t) GetLE64 (Buf);
+    if (List [i + 1] <= List [i]) {
+      fprintf (stderr, "[%s] is not sorted\n", IndexName);
+      free (List);
+      fclose (fp);
+      return (-1);
+    }
+  }
+
+  fclose (fp);
+  *Members = List;
+  *NumMembers = (int) Count + 1;
+  return (0);
+}
+
+/*
+   Reads the seek table a zstd "seekable format" writer (zstd's
+   contrib/seekable_format, t2sz, ...) leaves in a skippable frame at the end
+   of the file. Returns 0 with the frame list, 1 if the file has no seek
+   table, -1 on a read error.
+*/
+int LoadZstdSeekTable (int Fd, off_t FileSize, off_t **Members, int *NumMembers)
+{
+  unsigned char Footer [9];
+  unsigned char *Table;
+  uint32_t NumFrames;
+  uint32_t i;
+  size_t EntrySize;
+  size_t TableSize;
+  off_t TableStart;
+  off_t Pos = 0;
+  off_t *List;
+
+  if (FileSize < 8 + 9) return (1);
+  if (PreadFull (Fd, Footer, sizeof (Footer), FileSize - sizeof (Footer)) != sizeof (Footer)) return (-1);
+  if (GetLE32 (Footer + 5) != ZSTD_SEEKABLE_MAGIC) return (1);
+
+  NumFrames = GetLE32 (Footer);
+  EntrySize = (Footer [4] & 0x80) ? 12 : 8;
+  TableSize = 8 + (size_t) NumFrames * EntrySize + sizeof (Footer);
+  if ((NumFrames == 0) || (NumFrames > (uint32_t) INT32_MAX) || ((off_t) TableSize > FileSize)) return (1);
+  TableStart = FileSize - TableSize;
+
+  Table = (unsigned char *) malloc (TableSize);
+  List = (off_t *) malloc (NumFrames * sizeof (off_t));
+  if ((Table == NULL) || (List == NULL)) {
+    free (Table);
+    free (List);
+    return (-1);
+  }
+  if (PreadFull (Fd, Table, TableSize, TableStart) != (ssize_t) TableSize) {
+    free (Table);
+    free (List);
+    return (-1);
+  }
+
+  if ((GetLE32 (Table) & ZSTD_SKIPPABLE_MASK) != ZSTD_SKIPPABLE_MAGIC) {
+    free (Table);
+    free (List);
+    return (1);
+  }
+
+  for (i = 0; i < NumFrames; i++) {
+    List [i] = Pos;
+    Pos += GetLE32 (Table + 8 + (size_t) i * EntrySize);
+  }
+  free (Table);
+
+  // the frame sizes have to add up to exactly where the table starts
+  if (Pos != TableStart) {
+    free (List);
+    return (1);
+  }
+
+  *Members = List;
+  *NumMembers = (int) NumFrames;
+  return (0);
+}
+
+/*
+   Decompresses the members in [Head, Tail) to OutFd, cut to whole lines the
+   same way plain slices are: unless SkipFirstLine is 0 the output starts after
+   the first newline, and it runs on into the member at Tail up to and including
+   its first newline. Neighbouring slices therefore meet exactly.
+   Returns 0 on success, -1 with errno set on failure.
+*/
+int WriteCompressedSlice (int Fd, int Format, off_t FileSize, off_t Head, off_t Tail, int SkipFirstLine, int OutFd)
+{
+  struct ZReader r;
+  unsigned char *Out;
+  unsigned char *p;
+  unsigned char *nl;
+  size_t OutLen;
+  off_t MemberStart;
+  int Copying;
+  int Status = 0;
+  int ret;
+
+  if (Head >= Tail) return (0);
+
+  Out = (unsigned char *) malloc (Z_OUTBUFSIZE);
+  if ((Out == NULL) || (ZReaderOpen (&r, Fd, Format, FileSize, Head) != 0)) {
+    free (Out);
+    return (-1);
+  }
+
+  Copying = !SkipFirstLine;
+  while ((ret = ZRead (&r, Out, Z_OUTBUFSIZE, &OutLen, &MemberStart)) > 0) {
+    p = Out;
+    if (!Copying) {
+      nl = (unsigned char *) memchr (p, '\n', OutLen);
+      if (nl == NULL) continue;
+      // our first line starts past our last member, the previous slice has it all
+      if (MemberStart >= Tail) break;
+      Copying = 1;
+      OutLen -= nl + 1 - p;
+      p = nl + 1;
+    }
+
+    if (MemberStart >= Tail) {
+      nl = (unsigned char *) memchr (p, '\n', OutLen);
+      if (nl != NULL) {
+        Status = WriteAll (OutFd, (char *) p, nl + 1 - p);
+        break;
+      }
+    }
+
+    if ((Status = WriteAll (OutFd, (char *) p, OutLen)) != 0) break;
+  }
+  if (ret < 0) Status = -1;
+
+  ZReaderClose (&r);
+  free (Out);
+  return (Status);
+}
+
+/*
+   fgets for the start of a compressed file, used to pick up its header line.
+*/
+int ReadCompressedLine (int Fd, int Format, off_t FileSize, char *Line, int MaxLine)
+{
+  struct ZReader r;
+  unsigned char Out [4096];
+  unsigned char *nl;
+  size_t OutLen;
+  size_t Take;
+  off_t MemberStart;
+  int Len = 0;
+
+  Line [0] = '\0';
+  if (ZReaderOpen (&r, Fd, Format, FileSize, 0) != 0) return (-1);
+
+  while ((Len < MaxLine - 1) && (ZRead (&r, Out, sizeof (Out), &OutLen, &MemberStart) > 0)) {
+    nl = (unsigned char *) memchr (Out, '\n', OutLen);
+    Take = (nl != NULL) ? (size_t) (nl + 1 - Out) : OutLen;
+    if (Take > (size_t) (MaxLine - 1 - Len)) Take = MaxLine - 1 - Len;
+    memcpy (Line + Len, Out, Take);
+    Len += Take;
+    if (nl != NULL) break;
+  }
+  Line [Len] = '\0';
+
+  ZReaderClose (&r);
+  return (0);
+}
@@ -0,0 +1,24 @@
+#include <sys/types.h>
+
+#define VZ_PLAIN  (0)   // not compressed
+#define VZ_GZIP   (1)   // gzip, possibly several members back to back
+#define VZ_BGZF   (2)   // gzip whose members carry their own size (bgzip, samtools)
+#define VZ_ZSTD   (3)   // zstd, possibly several frames back to back
+
+#ifdef __cplusplus //inform the compiler that these are C functions if we are using a c++ compiler
+extern "C"
+{
+#endif
+
+    int DetectCompression(int Fd);
+    const char *CompressionName(int Format);
+    int CompressionSupported(int Format);
+    int LoadMemberIndex(char *IndexName, off_t **Members, int *NumMembers);
+    int LoadZstdSeekTable(int Fd, off_t FileSize, off_t **Members, int *NumMembers);
+    int ResolveMemberBoundaries(int Fd, int Format, off_t FileSize, off_t *Members, int NumMembers, off_t *Cuts, int NumCuts);
+    int WriteCompressedSlice(int Fd, int Format, off_t FileSize, off_t Head, off_t Tail, int SkipFirstLine, int OutFd);
+    int ReadCompressedLine(int Fd, int Format, off_t FileSize, char *Line, int MaxLine);
+
+#ifdef __cplusplus
+}
+#endif